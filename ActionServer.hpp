@@ -13,6 +13,10 @@
  * @file
  * @brief       Mechaduino ROS2 Action Server
  *
+ * Serves the move_to action (mechaduino_msgs/action/MoveTo) from its own
+ * thread. Goals are handed to the control loop as profiled moves; a new goal
+ * preempts the running one without stopping the axis.
+ *
  * @author      Florian Seybold <florian@seybold.space>
  */
 
@@ -20,8 +24,324 @@
 #define ACTIONSERVER_HPP
 
 #include <rcl_action/rcl_action.h>
+#include <action_msgs/msg/goal_status.h>
+#include <mechaduino_msgs/action/move_to.h>
 
 #include <thread.h>
+#include <xtimer.h>
+
+#include <cmath>
+#include <cstring>
+
+#include "Controller.hpp"
+#include "RosNode.hpp"
+
+#define ENABLE_DEBUG    (0)
+#include "debug.h"
+
+
+class ActionServer
+{
+public:
+   ActionServer(Controller& controller_, RosNode& ros_, const char& priority_ = THREAD_PRIORITY_MAIN - 1)
+      : controller(controller_),
+        ros(ros_),
+        priority(priority_)
+   { }
+
+   void start()
+   {
+      if(go==true) return;
+
+      // After stop() the thread can still be blocked in rcl_wait() for an
+      // idle_period, the new one must not be created on its stack
+      const uint32_t t0 = xtimer_now_usec();
+      while(threadAlive() && xtimer_now_usec() - t0 < 2*idle_period) xtimer_usleep(1000);
+      if(threadAlive()) {
+         puts("[Action server thread still running]");
+         return;
+      }
+
+      if(!ros.init()) return;
+
+      if(!initialized) {
+         rcl_allocator_t allocator = rcl_get_default_allocator();
+         if(rcl_clock_init(RCL_STEADY_TIME, &clock, &allocator) != RCL_RET_OK) {
+            puts("[Init of action server clock failed]");
+            return;
+         }
+
+         rcl_action_server_options_t options = rcl_action_server_get_default_options();
+         if(rcl_action_server_init(&server, &ros.node, &clock, ROSIDL_GET_ACTION_TYPE_SUPPORT(mechaduino_msgs, MoveTo), "move_to", &options) != RCL_RET_OK) {
+            puts("[Init of action server failed]");
+            return;
+         }
+
+         size_t subscriptions, guard_conditions, timers, clients, services;
+         rcl_action_server_wait_set_get_num_entities(&server, &subscriptions, &guard_conditions, &timers, &clients, &services);
+         if(rcl_wait_set_init(&wait_set, subscriptions, guard_conditions, timers, clients, services, 0, &ros.context, allocator) != RCL_RET_OK) {
+            puts("[Init of action server wait set failed]");
+            return;
+         }
+
+         mechaduino_msgs__action__MoveTo_SendGoal_Request__init(&goal_request);
+         mechaduino_msgs__action__MoveTo_SendGoal_Response__init(&goal_response);
+         mechaduino_msgs__action__MoveTo_GetResult_Request__init(&result_request);
+         mechaduino_msgs__action__MoveTo_GetResult_Response__init(&result_response);
+         mechaduino_msgs__action__MoveTo_FeedbackMessage__init(&feedback);
+
+         initialized = true;
+      }
+
+      go=true;
+
+      pid = thread_create(thread_stack, sizeof(thread_stack),
+         priority,
+         THREAD_CREATE_STACKTEST,
+         [](void* arg)->void*{ return ((ActionServer*)arg)->run(); },
+         (void*)this,
+         "actionserver");
+
+      DEBUG("ActionServer::start(): Created thread %i...\n", pid);
+   }
+
+   void stop()
+   {
+      go=false;
+   }
+
+   uint32_t feedback_period = 100000;   // us between feedback messages
+   float tolerance = 0.5;               // deg of following error counted as arrived
+   uint32_t settle_time = 20000;        // us within tolerance before a goal succeeds
+   float abort_error = 45.0;            // deg of following error that aborts a goal
+
+private:
+   /// Whether the thread of an earlier start() has not exited yet. RIOT
+   /// keeps a thread's control block in its stack, so a thread found there
+   /// is ours and not a later one that got the same pid.
+   bool threadAlive() const
+   {
+      const char* t = pid != KERNEL_PID_UNDEF ? (const char*)thread_get(pid) : NULL;
+      return t >= thread_stack && t < thread_stack + sizeof(thread_stack);
+   }
+
+   void* run()
+   {
+      DEBUG("ActionServer::run(): Entering...\n");
+
+      while(go)
+      {
+         rcl_wait_set_clear(&wait_set);
+         rcl_action_wait_set_add_action_server(&wait_set, &server, NULL);
+         rcl_wait(&wait_set, RCL_US_TO_NS(goal ? busy_period : idle_period));
+
+         bool goal_ready = false;
+         bool cancel_ready = false;
+         bool result_ready = false;
+         bool expired = false;
+         if(rcl_action_server_wait_set_get_entities_ready(&wait_set, &server, &goal_ready, &cancel_ready, &result_ready, &expired) == RCL_RET_OK) {
+            if(goal_ready) take_goal();
+            if(cancel_ready) take_cancel();
+            if(result_ready) take_result_request();
+            if(expired) expire_goals();
+         }
+
+         update_goal();
+      }
+
+      return NULL;
+   }
+
+   void take_goal()
+   {
+      rmw_request_id_t header;
+      if(rcl_action_take_goal_request(&server, &header, &goal_request) != RCL_RET_OK) return;
+
+      const mechaduino_msgs__action__MoveTo_Goal& g = goal_request.goal;
+      const bool valid = controller.running() && std::isfinite(g.position)
+         && g.max_velocity >= 0.0 && g.max_acceleration >= 0.0;
+
+      rcl_action_goal_info_t info = rcl_action_get_zero_initialized_goal_info();
+      info.goal_id = goal_request.goal_id;
+      stamp(info.stamp);
+      rcl_action_goal_handle_t* handle = valid ? rcl_action_accept_new_goal(&server, &info) : NULL;
+
+      goal_response.accepted = handle != NULL;
+      stamp(goal_response.stamp);
+      rcl_action_send_goal_response(&server, &header, &goal_response);
+      if(!handle) return;
+
+      if(goal) finish(GOAL_EVENT_ABORT, action_msgs__msg__GoalStatus__STATUS_ABORTED);   // preempted
+
+      rcl_action_update_goal_state(handle, GOAL_EVENT_EXECUTE);
+      goal = handle;
+      goal_id = info.goal_id;
+      canceling = false;
+      settling = false;
+      last_feedback = xtimer_now_usec() - feedback_period;
+
+      controller.move_to(g.position, g.max_velocity, g.max_acceleration);
+      publish_status();
+   }
+
+   void take_cancel()
+   {
+      rmw_request_id_t header;
+      rcl_action_cancel_request_t request = rcl_action_get_zero_initialized_cancel_request();
+      if(rcl_action_take_cancel_request(&server, &header, &request) != RCL_RET_OK) return;
+
+      rcl_action_cancel_response_t response = rcl_action_get_zero_initialized_cancel_response();
+      if(rcl_action_process_cancel_request(&server, &request, &response) == RCL_RET_OK) {
+         for(size_t i = 0; i < response.msg.goals_canceling.size; ++i) {
+            if(goal && !canceling && same_goal(response.msg.goals_canceling.data[i].goal_id, goal_id)) {
+               rcl_action_update_goal_state(goal, GOAL_EVENT_CANCEL_GOAL);
+               canceling = true;
+               controller.halt();
+               publish_status();
+            }
+         }
+      }
+      rcl_action_send_cancel_response(&server, &header, &response.msg);
+      rcl_action_cancel_response_fini(&response);
+   }
+
+   void take_result_request()
+   {
+      rmw_request_id_t header;
+      if(rcl_action_take_result_request(&server, &header, &result_request) != RCL_RET_OK) return;
+
+      if(goal && same_goal(result_request.goal_id, goal_id) && result_waiting < max_result_waiting) {
+         result_headers[result_waiting++] = header;   // answered when the goal finishes
+         return;
+      }
+
+      if(same_goal(result_request.goal_id, last_goal_id)) {
+         rcl_action_send_result_response(&server, &header, &result_response);
+         return;
+      }
+
+      // Unknown goal, the stored result of the last goal stays as it is
+      mechaduino_msgs__action__MoveTo_GetResult_Response unknown;
+      mechaduino_msgs__action__MoveTo_GetResult_Response__init(&unknown);
+      unknown.status = action_msgs__msg__GoalStatus__STATUS_UNKNOWN;
+      rcl_action_send_result_response(&server, &header, &unknown);
+      mechaduino_msgs__action__MoveTo_GetResult_Response__fini(&unknown);
+   }
+
+   void expire_goals()
+   {
+      rcl_action_goal_info_t expired[2];
+      size_t num_expired = 0;
+      rcl_action_expire_goals(&server, expired, 2, &num_expired);
+   }
+
+   /// Tracks the running goal in the control loop and sends rate limited feedback
+   void update_goal()
+   {
+      if(!goal) return;
+
+      const uint32_t now = xtimer_now_usec();
+      const float e = controller.error();
+
+      if(canceling) {
+         if(!controller.moving()) finish(GOAL_EVENT_CANCELED, action_msgs__msg__GoalStatus__STATUS_CANCELED);
+      }
+      else if(!controller.running() || fabs(e) > abort_error) {
+         finish(GOAL_EVENT_ABORT, action_msgs__msg__GoalStatus__STATUS_ABORTED);
+      }
+      else if(!controller.moving() && fabs(e) <= tolerance) {
+         if(!settling) {
+            settling = true;
+            settle_start = now;
+         }
+         else if(now - settle_start >= settle_time) {
+            finish(GOAL_EVENT_SUCCEED, action_msgs__msg__GoalStatus__STATUS_SUCCEEDED);
+         }
+      }
+      else {
+         settling = false;
+      }
+
+      if(goal && now - last_feedback >= feedback_period) {
+         feedback.goal_id = goal_id;
+         feedback.feedback.position = controller.position();
+         feedback.feedback.following_error = e;
+         rcl_action_publish_feedback(&server, &feedback);
+         last_feedback = now;
+      }
+   }
+
+   void finish(const rcl_action_goal_event_t& event, const int8_t& status)
+   {
+      rcl_action_update_goal_state(goal, event);
+
+      last_goal_id = goal_id;
+      result_response.status = status;
+      result_response.result.position = controller.position();
+      result_response.result.following_error = controller.error();
+      for(unsigned i = 0; i < result_waiting; ++i)
+         rcl_action_send_result_response(&server, &result_headers[i], &result_response);
+      result_waiting = 0;
+
+      goal = NULL;
+      publish_status();
+      rcl_action_notify_goal_done(&server);
+   }
+
+   void publish_status()
+   {
+      rcl_action_goal_status_array_t status = rcl_action_get_zero_initialized_goal_status_array();
+      if(rcl_action_get_goal_status_array(&server, &status) == RCL_RET_OK)
+         rcl_action_publish_status(&server, &status.msg);
+      rcl_action_goal_status_array_fini(&status);
+   }
+
+   void stamp(builtin_interfaces__msg__Time& t)
+   {
+      rcl_time_point_value_t now = 0;
+      rcl_clock_get_now(&clock, &now);
+      t.sec = RCL_NS_TO_S(now);
+      t.nanosec = now % 1000000000;
+   }
+
+   static bool same_goal(const unique_identifier_msgs__msg__UUID& a, const unique_identifier_msgs__msg__UUID& b)
+   {
+      return memcmp(a.uuid, b.uuid, sizeof(a.uuid)) == 0;
+   }
+
+   Controller& controller;
+   RosNode& ros;
+   const char priority;
+
+   char thread_stack[2*THREAD_STACKSIZE_DEFAULT+THREAD_EXTRA_STACKSIZE_PRINTF];
+   bool go = false;
+   kernel_pid_t pid = KERNEL_PID_UNDEF;
+   bool initialized = false;
+
+   const uint32_t busy_period = 10000;    // us between goal updates
+   const uint32_t idle_period = 100000;
+
+   rcl_clock_t clock;
+   rcl_action_server_t server = rcl_action_get_zero_initialized_server();
+   rcl_wait_set_t wait_set = rcl_get_zero_initialized_wait_set();
+
+   mechaduino_msgs__action__MoveTo_SendGoal_Request goal_request;
+   mechaduino_msgs__action__MoveTo_SendGoal_Response goal_response;
+   mechaduino_msgs__action__MoveTo_GetResult_Request result_request;
+   mechaduino_msgs__action__MoveTo_GetResult_Response result_response;
+   mechaduino_msgs__action__MoveTo_FeedbackMessage feedback;
+
+   rcl_action_goal_handle_t* goal = NULL;
+   unique_identifier_msgs__msg__UUID goal_id;
+   unique_identifier_msgs__msg__UUID last_goal_id = { };
+   bool canceling = false;
+   bool settling = false;
+   uint32_t settle_start = 0;
+   uint32_t last_feedback = 0;
 
+   static const unsigned max_result_waiting = 4;
+   rmw_request_id_t result_headers[max_result_waiting];
+   unsigned result_waiting = 0;
+};
 
 #endif
@@ -0,0 +1,115 @@
+/*
+ * Copyright (C) 2019 Florian Seybold
+ *
+ * This file is subject to the terms and conditions of the GNU Lesser
+ * General Public License v2.1. See the file LICENSE in the top level
+ * directory for more details.
+ */
+
+/**
+ * @ingroup     mechaduino_firmware
+ *
+ * @{
+ * @file
+ * @brief       Offset and drift of the local clock against a master clock
+ *
+ * The master measures a round trip and hands over the midpoint as a sample
+ * "at local time l the master read m". Samples steer a reference point and
+ * a drift (in ppb) with a small PI servo, conversions in both directions
+ * are integer only. Free of RIOT includes, also used by host tools.
+ *
+ * @author      Florian Seybold <florian@seybold.space>
+ */
+
+#ifndef CLOCKSYNC_HPP
+#define CLOCKSYNC_HPP
+
+#include <stdint.h>
+
+class ClockSync
+{
+public:
+   /// Adds a sample: at local time local (us) the master clock read master (us)
+   void sample(const uint64_t& local, const uint64_t& master)
+   {
+      if(samples > 0) {
+         residual = (int64_t)(master - to_master(local));
+         if(residual > step_limit || residual < -step_limit) {
+            ++steps;          // lost track, start over
+            samples = 0;
+         }
+      }
+
+      if(samples == 0) {
+         ref_local = local;
+         ref_master = master;
+         drift = 0;
+         residual = 0;
+      }
+      else {
+         const int64_t d = (int64_t)(local - ref_local);
+         if(d <= 0) return;
+
+         // The first interval measures the drift, later ones only correct it
+         const int64_t correction = residual * 1000000000 / d;
+         int64_t next = drift + (samples == 1 ? correction : correction / 8);    // clamped before it is narrowed
+         if(next > max_drift) next = max_drift;
+         else if(next < -max_drift) next = -max_drift;
+         drift = (int32_t)next;
+
+         ref_master = master - residual / 2;
+         ref_local = local;
+      }
+      ++samples;
+   }
+
+   bool synced() const
+   {
+      return samples >= 2;
+   }
+
+   uint64_t to_master(const uint64_t& local) const
+   {
+      const int64_t d = (int64_t)(local - ref_local);
+      return ref_master + d + d * drift / 1000000000;
+   }
+
+   uint64_t to_local(const uint64_t& master) const
+   {
+      const int64_t d = (int64_t)(master - ref_master);
+      return ref_local + d - d * drift / (1000000000 + drift);
+   }
+
+   int32_t driftPpb() const
+   {
+      return drift;
+   }
+
+   int64_t lastResidual() const
+   {
+      return residual;
+   }
+
+   uint32_t sampleCount() const
+   {
+      return samples;
+   }
+
+   uint32_t stepCount() const
+   {
+      return steps;
+   }
+
+private:
+   static const int64_t step_limit = 10000;     // us, larger residuals restart the estimate
+   static const int32_t max_drift = 1000000;    // ppb, beyond any crystal
+
+   uint64_t ref_local = 0;
+   uint64_t ref_master = 0;
+   int32_t drift = 0;          // master us per local us - 1, in ppb
+   int64_t residual = 0;       // us, last sample against the prediction
+   uint32_t samples = 0;
+   uint32_t steps = 0;
+};
+
+#endif
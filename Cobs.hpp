@@ -0,0 +1,75 @@
+/*
+ * Copyright (C) 2019 Florian Seybold
+ *
+ * This file is subject to the terms and conditions of the GNU Lesser
+ * General Public License v2.1. See the file LICENSE in the top level
+ * directory for more details.
+ */
+
+/**
+ * @ingroup     mechaduino_firmware
+ *
+ * @{
+ * @file
+ * @brief       Consistent Overhead Byte Stuffing for zero delimited frames
+ *
+ * Free of RIOT includes, shared with the host tools.
+ *
+ * @author      Florian Seybold <florian@seybold.space>
+ */
+
+#ifndef COBS_HPP
+#define COBS_HPP
+
+#include <stdint.h>
+#include <stddef.h>
+
+/// Worst case encoded size of len bytes, without the frame delimiter
+constexpr size_t cobs_max_size(size_t len)
+{
+   return len + len / 254 + 1;
+}
+
+/// Encodes len bytes into out, which must hold cobs_max_size(len) bytes.
+/// Returns the encoded length, the 0x00 delimiter is not appended.
+inline size_t cobs_encode(const uint8_t* in, size_t len, uint8_t* out)
+{
+   size_t code_pos = 0;
+   size_t o = 1;
+   uint8_t code = 1;
+
+   for(size_t i = 0; i < len; ++i) {
+      if(in[i] == 0) {
+         out[code_pos] = code;
+         code_pos = o++;
+         code = 1;
+         continue;
+      }
+      out[o++] = in[i];
+      if(++code == 0xff) {
+         out[code_pos] = code;
+         code_pos = o++;
+         code = 1;
+      }
+   }
+   out[code_pos] = code;
+   return o;
+}
+
+/// Decodes one frame (without delimiter) into out, which must hold len bytes.
+/// Returns the decoded length or -1 if the frame is malformed.
+inline int cobs_decode(const uint8_t* in, size_t len, uint8_t* out)
+{
+   size_t o = 0;
+   size_t i = 0;
+
+   while(i < len) {
+      const uint8_t code = in[i++];
+      if(code == 0 || i + code - 1 > len) return -1;
+      for(uint8_t k = 1; k < code; ++k) out[o++] = in[i++];
+      if(code != 0xff && i < len) out[o++] = 0;
+   }
+   return (int)o;
+}
+
+#endif
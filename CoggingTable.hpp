@@ -0,0 +1,327 @@
+/*
+ * Copyright (C) 2019 Florian Seybold
+ *
+ * This file is subject to the terms and conditions of the GNU Lesser
+ * General Public License v2.1. See the file LICENSE in the top level
+ * directory for more details.
+ */
+
+/**
+ * @ingroup     mechaduino_firmware
+ *
+ * @{
+ * @file
+ * @brief       Cogging and torque ripple compensation over the mechanical angle
+ *
+ * Holds an effort correction for each of bins equal slices of a revolution,
+ * as signed bytes of scale effort each, and hands out the linearly
+ * interpolated value at the measured angle for the control loop to add to
+ * its effort.
+ *
+ * The table is learnt from a slow sweep at constant velocity: the loop has
+ * to supply the effort that cancels the detent torque, so the effort it
+ * applied, averaged per bin over one revolution, is the correction. One
+ * revolution forward and one back are averaged to cancel the friction, the
+ * mean (a constant load) is left to the integrator. The sweep collects the
+ * bins in 16 bit in the ScratchArena, only the ripple left after removing
+ * the mean is quantized to the byte table, so friction and load of any
+ * size do not clip it. Controller runs the sweep moves, with margin on both
+ * ends for the ramps.
+ *
+ * save() keeps the table in flash, a header page with crc in front of the
+ * table pages; the header is erased first and written last.
+ *
+ * @author      Florian Seybold <florian@seybold.space>
+ */
+
+#ifndef COGGINGTABLE_HPP
+#define COGGINGTABLE_HPP
+
+#include <periph/flashpage.h>
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <cmath>
+
+#include "Crc.hpp"
+#include "ScratchArena.hpp"
+
+class CoggingTable
+{
+public:
+   static const unsigned bins = 2048;        // 0.18 deg, ten per detent period of a 200 step motor
+   static constexpr float scale = 0.25;      // effort per unit, +/-31.75 in all
+
+   enum Sweep { Idle, Forward, Backward };
+
+   /// Correction at measured angle y (deg, 0 to 360)
+   float effort(const float& y) const
+   {
+      const float x = y * (bins / 360.0f);
+      unsigned i = (unsigned)x;
+      const float f = x - i;
+      if(i >= bins) i -= bins;
+      const unsigned j = i + 1 < bins ? i + 1 : 0;
+      return scale * (table[i] + f * (table[j] - table[i]));
+   }
+
+   /// Starts a sweep from position from (deg) and sets target to where the
+   /// forward move goes. The correction is off until the sweep has finished.
+   /// Fails while another operation holds the scratch arena.
+   bool start(const float& from, float& target)
+   {
+      lease.drop();
+      if(!lease.take("cogging sweep")) return false;
+      sweep_table = lease.alloc<int16_t>(bins);
+      if(!sweep_table) {
+         lease.drop();
+         return false;
+      }
+      memset(sweep_table, 0, bins * sizeof(int16_t));
+
+      was_enabled = enabled;
+      enabled = false;
+      origin = from;
+      begin(Forward);
+      target = from + 360.0 + 2.0 * margin;
+      return true;
+   }
+
+   /// Takes a tick of the sweep: position yw, angle y and the applied effort u
+   void learn(const float& yw, const float& y, const float& u)
+   {
+      if(sweep == Idle || yw < origin + margin || yw > origin + margin + 360.0) return;
+
+      unsigned b = (unsigned)(y * (bins / 360.0f));
+      if(b >= bins) b -= bins;
+      if(bin < 0) {
+         bin = b;
+         first = b;
+      }
+      else if(b != (unsigned)bin) {
+         const unsigned ahead = sweep == Forward ? (b + bins - bin) % bins : (bin + bins - b) % bins;
+         if(ahead < bins / 2) flush(ahead);      // samples jittering back count for the current bin
+      }
+      sum += u;
+      ++n;
+   }
+
+   /// Ends the forward pass, returns the target of the move back
+   float turn()
+   {
+      close();
+      begin(Backward);
+      return origin;
+   }
+
+   /// Ends the backward pass and takes the table into use
+   void finish()
+   {
+      close();
+      sweep = Idle;
+
+      float mean = 0.0;
+      for(unsigned i = 0; i < bins; ++i) mean += sweep_table[i];
+      mean /= bins;
+      for(unsigned i = 0; i < bins; ++i) table[i] = quantize(scale * (sweep_table[i] - mean));
+      release();
+      enabled = true;
+   }
+
+   /// Drops a sweep that did not finish, the previous table stays
+   void abort()
+   {
+      if(sweep == Idle) return;
+      sweep = Idle;
+      release();
+      enabled = was_enabled;
+   }
+
+   void clear()
+   {
+      enabled = false;
+      memset(table, 0, sizeof(table));
+   }
+
+   Sweep state() const
+   {
+      return sweep;
+   }
+
+   bool sweeping() const
+   {
+      return sweep != Idle;
+   }
+
+   /// Restores the saved table, returns false (keeping the current one) if
+   /// the flash holds none
+   bool load()
+   {
+      const Stored& s = stored_table();
+      if(!header_valid(s.header) || crc32(s.table, sizeof(s.table)) != s.header.crc) return false;
+      memcpy(table, s.table, sizeof(table));
+      enabled = true;
+      return true;
+   }
+
+   /// Writes the table to flash, pages that already hold it are skipped
+   bool save()
+   {
+      static_assert(sizeof(table) % FLASHPAGE_SIZE == 0, "cogging table is not a whole number of pages");
+
+      ScratchArena::Lease scratch("cogging save");
+      uint8_t* page = scratch.alloc<uint8_t>(FLASHPAGE_SIZE);
+      if(!page) return false;
+
+      const Stored& s = stored_table();
+      Header h = { magic, version, bins, scale, crc32(table, sizeof(table)), 0 };
+      h.header_crc = crc32(&h, offsetof(Header, header_crc));
+      if(memcmp(&s.header, &h, sizeof(h)) == 0 && memcmp(s.table, table, sizeof(table)) == 0) return true;
+
+      memset(page, 0xff, FLASHPAGE_SIZE);
+      if(!write(&s.header, page)) return false;
+      for(unsigned p = 0; p < sizeof(table) / FLASHPAGE_SIZE; ++p) {
+         memcpy(page, (const uint8_t*)table + p * FLASHPAGE_SIZE, FLASHPAGE_SIZE);
+         if(!write(s.table + p * FLASHPAGE_SIZE, page)) return false;
+      }
+      memcpy(page, &h, sizeof(h));
+      return write(&s.header, page);
+   }
+
+   void print() const
+   {
+      int lo = 0, hi = 0;
+      for(unsigned i = 0; i < bins; ++i) {
+         if(table[i] < lo) lo = table[i];
+         if(table[i] > hi) hi = table[i];
+      }
+      printf("cogging: %s, %u bins, %f to %f effort, sweep at %f deg/s, %s\n", enabled ? "on" : "off", bins,
+             scale * lo, scale * hi, speed, sweep == Idle ? "idle" : (sweep == Forward ? "sweeping forward" : "sweeping back"));
+   }
+
+   /// Prints every bin as angle and effort
+   void printTable() const
+   {
+      for(unsigned i = 0; i < bins; ++i) printf("%f,%f\n", i * (360.0 / bins), scale * table[i]);
+   }
+
+   /// Flash taken by the stored table
+   static size_t flashBytes()
+   {
+      return sizeof(Stored);
+   }
+
+   bool enabled = false;         // add the correction in the control loop
+   float speed = 90.0;           // deg/s of the sweep
+   float amax = 360.0;           // deg/s^2
+   float margin = 10.0;          // deg before and after the measured revolution
+
+private:
+   struct Header {
+      uint32_t magic;
+      uint16_t version;
+      uint16_t bins;
+      float scale;
+      uint32_t crc;           // crc32 over the table
+      uint32_t header_crc;    // crc32 over the fields above
+   };
+
+   struct Stored {
+      Header header;
+      uint8_t header_pad[FLASHPAGE_SIZE - sizeof(Header)];
+      int8_t table[bins];
+   };
+
+   void begin(const Sweep& s)
+   {
+      sweep = s;
+      bin = -1;
+      first = -1;
+      sum = 0.0;
+      n = 0;
+   }
+
+   /// Stores the current bin's mean and moves on by ahead bins, filling the
+   /// ones skipped with the same value
+   void flush(const unsigned& ahead)
+   {
+      if(bin < 0 || n == 0) return;
+      const float mean = sum / n;
+      for(unsigned k = 0; k < ahead; ++k) {
+         const unsigned i = sweep == Forward ? (bin + k) % bins : (bin + bins - k) % bins;
+         sweep_table[i] = sweep == Forward ? quantize16(mean) : quantize16(0.5 * (scale * sweep_table[i] + mean));
+      }
+      bin = sweep == Forward ? (bin + ahead) % bins : (bin + bins - ahead) % bins;
+      sum = 0.0;
+      n = 0;
+   }
+
+   /// Flushes the last bin of a pass, unless the pass has come round to
+   /// the bin it started in, which it has written already
+   void close()
+   {
+      if(bin != first) flush(1);
+   }
+
+   void release()
+   {
+      lease.drop();
+      sweep_table = NULL;
+   }
+
+   static int8_t quantize(const float& effort)
+   {
+      const long q = lround(effort / scale);
+      return q > 127 ? 127 : (q < -127 ? -127 : q);
+   }
+
+   static int16_t quantize16(const float& effort)
+   {
+      const long q = lround(effort / scale);
+      return q > 32767 ? 32767 : (q < -32767 ? -32767 : q);
+   }
+
+   static bool header_valid(const Header& h)
+   {
+      return h.magic == magic && h.version == version && h.bins == bins && h.scale == scale
+         && h.header_crc == crc32(&h, offsetof(Header, header_crc));
+   }
+
+   static bool write(const void* at, const uint8_t* page)
+   {
+      const int number = flashpage_page((void*)at);
+      if(flashpage_verify(number, page) == FLASHPAGE_OK) return true;
+      flashpage_write(number, page);
+      return flashpage_verify(number, page) == FLASHPAGE_OK;
+   }
+
+   /// The stored table, laundered so the blank initializer is not folded
+   /// into reads
+   static const Stored& stored_table()
+   {
+      const Stored* p = &stored;
+      __asm__ ("" : "+r" (p));
+      return *p;
+   }
+
+   static const uint32_t magic = 0x47474f43;    // "COGG"
+   static const uint16_t version = 1;
+   static const Stored stored;
+
+   int8_t table[bins] = { };
+   Sweep sweep = Idle;
+   ScratchArena::Lease lease;    // held while sweeping
+   int16_t* sweep_table = NULL;  // bins of the sweep in units of scale, from the lease
+   bool was_enabled = false;     // before the sweep, restored by abort()
+   float origin = 0.0;           // deg, where the sweep started
+   int bin = -1;                 // being averaged, -1 before the first
+   int first = -1;               // the pass started in
+   float sum = 0.0;
+   unsigned n = 0;
+};
+
+const CoggingTable::Stored __attribute__((__aligned__(FLASHPAGE_SIZE))) CoggingTable::stored = { };
+
+#endif
@@ -21,11 +21,25 @@
 
 #include <thread.h>
 #include <xtimer.h>
+#include <irq.h>
 
 #include <cmath>
 
 #include "Motor.hpp"
 #include "Encoder.hpp"
+#include "Profile.hpp"
+#include "MotionQueue.hpp"
+#include "Gearing.hpp"
+#include "Homing.hpp"
+#include "IterativeLearning.hpp"
+#include "CoggingTable.hpp"
+#include "InputShaper.hpp"
+#include "Params.hpp"
+#include "Telemetry.hpp"
+#include "Scope.hpp"
+#include "Recorder.hpp"
+#include "ServoLoop.hpp"
+#include "TickProfiler.hpp"
 
 #define ENABLE_DEBUG    (0)
 #include "debug.h"
@@ -34,9 +48,13 @@
 class Controller
 {
 public:
-   Controller(const Motor& motor_, const Encoder& encoder_, const char& priority_=0/*, const uint32_t& period_=1000*/)
+   Controller(Motor& motor_, Encoder& encoder_, Params& params_, Telemetry& telemetry_, Scope& scope_, Recorder& recorder_, const char& priority_=0/*, const uint32_t& period_=1000*/)
       : motor(motor_),
         encoder(encoder_),
+        params(params_),
+        telemetry(telemetry_),
+        scope(scope_),
+        recorder(recorder_),
         priority(priority_)//,
         //period(period_)
    { }
@@ -64,76 +82,521 @@ public:
       go=false;
    }
 
+   /// Moves to target along a trapezoidal profile, the control thread takes
+   /// the move over at its next tick. vmax in deg/s, amax in deg/s^2, zero
+   /// selects the defaults. A running move is replaced without stopping.
+   void move_to(const float& target, const float& vmax = 0.0, const float& amax = 0.0)
+   {
+      post(Command::Move, target, vmax > 0.0 ? vmax : move_vmax, amax > 0.0 ? amax : move_amax);
+   }
+
+   /// Ramps a profiled move down to standstill
+   void halt()
+   {
+      post(Command::Brake, 0.0, 0.0, 0.0);
+   }
+
+   /// Steps the setpoint to target, ending any profiled move
+   void set(const float& target)
+   {
+      post(Command::Set, target, 0.0, 0.0);
+   }
+
+   /// Follows the master configured in gearing, blending in from the current
+   /// setpoint. Any other setpoint command disengages.
+   void engage(const bool& relative = false)
+   {
+      post(Command::Engage, relative ? 1.0 : 0.0, 0.0, 0.0);
+   }
+
+   /// Stops following the master, ramping down from the geared velocity
+   void disengage()
+   {
+      post(Command::Brake, 0.0, 0.0, 0.0);
+   }
+
+   /// Timed variants of move_to() and set(), applied on the tick nearest
+   /// to due (local xtimer_now_usec() time). Fails when the queue is full or
+   /// due lies more than a tick in the past.
+   bool move_at(const uint32_t& due, const float& target, const float& vmax = 0.0, const float& amax = 0.0)
+   {
+      return post_at(due, Command::Move, target, vmax > 0.0 ? vmax : move_vmax, amax > 0.0 ? amax : move_amax);
+   }
+
+   bool set_at(const uint32_t& due, const float& target)
+   {
+      return post_at(due, Command::Set, target, 0.0, 0.0);
+   }
+
+   /// Seeks the hard stop in direction dir (sign only) at reduced current,
+   /// backs off from it and puts position zero there, see Homing. Any other
+   /// setpoint command aborts. The zero is lost when the loop restarts.
+   void home(const int& dir)
+   {
+      post(Command::Home, dir < 0 ? -1.0 : 1.0, 0.0, 0.0);
+   }
+
+   /// Registers a repeated trajectory of duration s for iterative learning
+   /// and clears what was learnt. Every move or path started from standstill
+   /// while no pass runs starts a pass, so the duration has to cover one
+   /// whole repetition. Fails while a pass runs.
+   bool learn(const float& duration)
+   {
+      unsigned state = irq_disable();
+      const bool ok = learning.arm((uint32_t)(duration * Fs + 0.5), (unsigned)(learn_sample * Fs + 0.5));
+      irq_restore(state);
+      return ok;
+   }
+
+   /// Stops learning and applying the correction
+   void forget()
+   {
+      unsigned state = irq_disable();
+      learning.disarm();
+      irq_restore(state);
+   }
+
+   /// Learns the cogging table from a sweep over one revolution forward and
+   /// back at cogging.speed, see CoggingTable. Any other setpoint command
+   /// aborts, the previous table stays. Does not start while another
+   /// operation holds the scratch arena.
+   void sweepCogging()
+   {
+      post(Command::Sweep, 0.0, 0.0, 0.0);
+   }
+
+   /// Shapes the setpoint against the residual vibration of a mode of freq
+   /// Hz and damping ratio zeta, see InputShaper. InputShaper::Off passes
+   /// the setpoint through. Fails for a frequency or damping out of range.
+   bool shape(const InputShaper::Type& type, const float& freq, const float& zeta)
+   {
+      unsigned state = irq_disable();
+      const bool ok = shaper.configure(type, freq, zeta, Fs);
+      irq_restore(state);
+      return ok;
+   }
+
+   /// Queues a segment of a path (0 for the default limits). Queued segments
+   /// run back to back, blending where the direction does not change; any
+   /// other setpoint command drops the path. Fails when the queue is full.
+   bool queue(const float& target, const float& vmax = 0.0, const float& amax = 0.0)
+   {
+      unsigned state = irq_disable();
+      const bool ok = path.push(target, vmax > 0.0 ? vmax : move_vmax, amax > 0.0 ? amax : move_amax, profile.stopping());
+      irq_restore(state);
+      return ok;
+   }
+
+   unsigned queueDepth() const
+   {
+      return path.depth();
+   }
+
+   MotionQueue::Stats queueStats() const
+   {
+      return path.stats;
+   }
+
+   /// Timed commands applied so far and their largest distance from due in us
+   struct TimedStats {
+      uint32_t applied;
+      uint32_t max_error;
+   };
+
+   TimedStats timedStats() const
+   {
+      return timed_stats;
+   }
+
+   /// Timed commands that can still be queued
+   unsigned timedFree() const
+   {
+      return timed_capacity - timed_count;
+   }
+
+   /// Whether the setpoint is still changing, including its shaped copy
+   /// catching up after the profile has ended
+   bool moving() const
+   {
+      return command.kind == Command::Move || command.kind == Command::Home || command.kind == Command::Sweep || profile.active() || gearing.active() || path.active() || homing.active() || cogging.sweeping() || !shaper.settled();
+   }
+
+   bool running() const
+   {
+      return go;
+   }
+
+   float position() const
+   {
+      return loop.state.yw_1;
+   }
+
+   float error() const
+   {
+      return loop.terms.e;
+   }
+
+   float setpoint() const
+   {
+      return r;
+   }
+
+   /// Loop state published once per tick, read with snapshot()
+   struct Snapshot {
+      uint32_t tick;
+      float position;      // deg, wrapped
+      float velocity;      // deg/s, low pass filtered
+      float setpoint;
+      float error;
+   };
+
+   /// Consistent copy of the latest tick's state, lock free for the reader.
+   /// Retries while the control loop updates it (sequence count odd or changed).
+   Snapshot snapshot() const
+   {
+      Snapshot s;
+      uint32_t seq;
+      do {
+         seq = snapshot_seq;
+         __asm__ volatile("" ::: "memory");
+         s = snapshot_data;
+         __asm__ volatile("" ::: "memory");
+      } while((seq & 1) || seq != snapshot_seq);
+      return s;
+   }
+
    float r = 0.0; // Setpoint
 
+   float move_vmax = 3600.0;     // default profile velocity in deg/s
+   float move_amax = 36000.0;    // default profile acceleration in deg/s^2
+
+   Gearing gearing;              // configure while disengaged, see engage()
+
+   Homing homing;                // settings and result of home()
+
+   IterativeLearning learning;   // gains and progress of learn(), arm through learn()
+   float learn_sample = 0.01;    // s, shortest sample of the learnt correction
+
+   CoggingTable cogging;         // compensation, learnt by sweepCogging() or loaded from flash
+
+   InputShaper shaper;           // of the setpoint, configure through shape()
+
+   TickProfiler profiler;        // off until enabled
+
+   /// Tick period in us
+   uint32_t tickPeriod() const
+   {
+      return period;
+   }
+
 private:
-   void* run()
+   /// Setpoint command posted by another thread, the latest one wins
+   struct Command {
+      enum Kind { None, Move, Brake, Set, Engage, Home, Sweep } kind;
+      float target;
+      float vmax;
+      float amax;
+   };
+
+   void post(const Command::Kind& kind, const float& target, const float& vmax, const float& amax)
    {
-      DEBUG("Controller::run(): Entering...\n");
+      unsigned state = irq_disable();
+      command.target = target;
+      command.vmax = vmax;
+      command.amax = amax;
+      command.kind = kind;
+      irq_restore(state);
+   }
 
-      wrap_count = 0;
-      y_1 = 0.0;
-      yw_1 = 0.0;
-      r = 0.0;
-      ITerm = 0.0;
-      DTerm = 0.0;
+   bool post_at(const uint32_t& due, const Command::Kind& kind, const float& target, const float& vmax, const float& amax)
+   {
+      if((int32_t)(due - xtimer_now_usec()) < -(int32_t)period) return false;
 
-      //size_t s = 0;
+      unsigned state = irq_disable();
+      if(timed_count == timed_capacity) {
+         irq_restore(state);
+         return false;
+      }
+      unsigned i = timed_count;
+      for(; i > 0 && (int32_t)(timed[i-1].due - due) > 0; --i) timed[i] = timed[i-1];   // keep sorted by due
+      timed[i] = { due, { kind, target, vmax, amax } };
+      ++timed_count;
+      irq_restore(state);
+      return true;
+   }
 
-      last_wakeup=xtimer_now();
-      while(go)
-      {
-         xtimer_periodic_wakeup(&last_wakeup, period);
+   /// Hands commands posted by other threads to the profile, called at tick start
+   void take_command()
+   {
+      unsigned state = irq_disable();
+      const Command c = command;
+      command.kind = Command::None;
+      irq_restore(state);
 
-         float y = encoder.angle();                    //read encoder and lookup corrected angle in calibration lookup table
-         if ((y - y_1) < -180.0) wrap_count += 1;      //Check if we've rotated more than a full revolution (have we "wrapped" around from 359 degrees to 0 or ffrom 0 to 359?)
-         else if ((y - y_1) > 180.0) wrap_count -= 1;
+      apply(c);
+   }
 
-         float yw = (y + (360.0 * wrap_count));              //yw is the wrapped angle (can exceed one revolution)
+   /// Applies the timed commands due on the tick starting at now
+   void take_timed(const uint32_t& now)
+   {
+      while(timed_count > 0 && (int32_t)(timed[0].due - now) <= (int32_t)(period/2)) {
+         unsigned state = irq_disable();
+         const Timed t = timed[0];
+         for(unsigned i = 1; i < timed_count; ++i) timed[i-1] = timed[i];
+         --timed_count;
+         irq_restore(state);
+
+         const int32_t err = (int32_t)(now - t.due);
+         const uint32_t abs_err = err < 0 ? -err : err;
+         ++timed_stats.applied;
+         if(abs_err > timed_stats.max_error) timed_stats.max_error = abs_err;
+
+         apply(t.command);
+      }
+   }
 
-         //Position control
-         float e = (r - yw);
+   /// Runs the queued path: replans after pushes and starts the next
+   /// segment when the profile has finished the previous one
+   void take_path()
+   {
+      if(path.replan()) {
+         const float vend = path.plan(r);
+         if(path.chained()) profile.setEnd(vend);
+      }
+      if(profile.active()) return;
+
+      unsigned state = irq_disable();
+      const bool chained = path.chained();
+      MotionQueue::Segment s;
+      const bool next = path.pop(s, chained ? profile.position : r);
+      if(!next) path.done();
+      irq_restore(state);
+      if(!next) return;
+
+      if(gearing.active()) leave_gearing();
+      else if(!chained) {
+         profile.reset(r);
+         learning.begin();
+      }
+      profile.start(s.target, s.vmax, s.amax, s.vend);
+   }
 
-         ITerm += (pKi * e);                             //Integral wind up limit
-         if (ITerm > 150.0) ITerm = 150.0;
-         else if (ITerm < -150.0) ITerm = -150.0;          
+   /// Runs homing: on contact drops the setpoint to the measured position
+   /// and backs off, when backed off moves position zero there
+   void take_homing()
+   {
+      const Homing::State before = homing.state();
+      const Homing::State now = homing.update(Ts, loop.terms.e, loop.state.yw_1, velocity, profile.active());
+      if(now == before) return;
+
+      if(now == Homing::Backing) {
+         r = loop.state.yw_1;
+         loop.state.ITerm = 0.0;
+         recorder.loopChanged();
+         profile.reset(r);
+         shaper.reset(r);              // stop pushing now, not a shaper delay later
+         profile.start(homing.zero(), homing.speed, homing.amax);
+      }
+      else if(now == Homing::Done) {
+         const float shift = homing.zero();
+         loop.shift(shift);
+         recorder.loopChanged();
+         r -= shift;
+         profile.reset(r);
+         shaper.shift(-shift);
+      }
+      else {
+         profile.stop();
+      }
+   }
 
-         DTerm = pLPFa*DTerm -  pLPFb*pKd*(yw-yw_1);
+   /// Runs the cogging sweep from the tick's terms, turns at the end of the
+   /// forward move and finishes at the end of the move back
+   void take_sweep(const ServoLoop::Terms& t)
+   {
+      cogging.learn(t.yw, t.y, t.u);
+      if(profile.active()) return;
 
-         float u = (pKp * e) + ITerm + DTerm;
+      if(cogging.state() == CoggingTable::Forward) profile.start(cogging.turn(), cogging.speed, cogging.amax);
+      else cogging.finish();
+   }
 
-         y_1 = y;  //copy current value of y to previous value (y_1) for next control cycle before PA angle added
-         //if(s++%100==0) printf("Controller::run(): wrap_count=%i, y=%f, yw=%f, y_1=%f, yw_1=%f, r=%f, ITerm=%f, DTerm=%f, e=%f, u=%f\n", wrap_count, y, yw, y_1, yw_1, r, ITerm, DTerm, e, u);
+   /// The profile takes over from the gearing with the geared velocity
+   void leave_gearing()
+   {
+      gearing.stop();
+      const float v = fabs(gearing.velocity);
+      profile.reset(r, gearing.velocity);
+      profile.start(r, v > move_vmax ? v : move_vmax, move_amax);
+   }
 
-         if (u > 0)          //Depending on direction we want to apply torque, add or subtract a phase angle of PA for max effective torque.  PA should be equal to one full step angle: if the excitation angle is the same as the current position, we would not move!  
-         {                 //You can experiment with "Phase Advance" by increasing PA when operating at high speeds
-            y += PA;          //update phase excitation angle
-            if (u > motor.uMax)     // limit control effort
-               u = motor.uMax;       //saturation limits max current command
-         }
-         else
+   void apply(const Command& c)
+   {
+      if(gearing.active() && c.kind != Command::Engage) leave_gearing();
+      if(c.kind != Command::None) {
+         unsigned state = irq_disable();
+         path.clear();
+         irq_restore(state);
+         homing.stop();
+         cogging.abort();
+      }
+
+      switch(c.kind) {
+         case Command::Move:
+            if(!profile.active()) {
+               profile.reset(r);
+               learning.begin();
+            }
+            profile.start(c.target, c.vmax, c.amax);
+            break;
+         case Command::Brake:
+            profile.brake();
+            break;
+         case Command::Set:
+            profile.stop();
+            r = c.target;
+            break;
+         case Command::Engage:
+            profile.stop();
+            gearing.engage(r, c.target != 0.0);
+            break;
+         case Command::Home:
+            if(!profile.active()) profile.reset(r);
+            profile.start(homing.start(c.target, r), homing.speed, homing.amax);
+            break;
+         case Command::Sweep:
          {
-            y -= PA;          //update phase excitation angle
-            if (u < -motor.uMax)    // limit control effort
-               u = -motor.uMax;      //saturation limits max current command
+            float target;
+            if(!cogging.start(r, target)) break;
+            if(!profile.active()) profile.reset(r);
+            profile.start(target, cogging.speed, cogging.amax);
+            break;
          }
+         default:
+            break;
+      }
+   }
 
-         float U = abs(u);       //
+   /// Takes over changed parameters and recomputes what derives from them
+   void load_params()
+   {
+      params_version = params.version();
+      const ParamValues v = params.get();
 
-         //if (abs(e) < 0.1) ledPin_HIGH();    // turn on LED if error is less than 0.1
-         //else ledPin_LOW();                  //digitalWrite(ledPin, LOW);
+      const bool rate = v.Fs != Fs;
+      Fs = v.Fs;
+      period = (uint32_t)(1000000.0/Fs);
+      Ts = 1.0/Fs;
+
+      loop.configure(Fs, v.pKp, v.pKi, v.pKd, v.pLPF);
+      if(rate) shaper.configure(shaper.kind(), shaper.frequency(), shaper.damping(), Fs);   // delays are in ticks
+
+      vKp = v.vKp;
+      vKi = v.vKi;
+      vKd = v.vKd;
+      vLPF = v.vLPF;
+
+      vLPFa = exp(vLPF*-2.0*3.14159/Fs); // z = e^st pole mapping
+      vLPFb = (1.0-vLPFa)* Fs * 0.16666667;
 
+      motor.setCurrentLimit(v.iMax);
+      encoder.max_jump = v.max_jump;
+      encoder.max_rejects = v.max_rejects;
+   }
+
+   void* run()
+   {
+      DEBUG("Controller::run(): Entering...\n");
 
-         motor.output(-y, round(U));    // update phase currents
+      ticks = 0;
+      velocity = 0.0;
+      r = 0.0;
+      loop.reset();
+      encoder.reset_validation();
+      profile.stop();
+      gearing.stop();
+      path.clear();
+      homing.stop();
+      cogging.abort();
+      command.kind = Command::None;
+      timed_count = 0;
+
+      load_params();
+      shaper.reset(r);
+
+      last_wakeup=xtimer_now();
+      while(go)
+      {
+         xtimer_periodic_wakeup(&last_wakeup, period);
+         profiler.begin();
+
+         encoder.start_read();         // the encoder frame is shifted while the sample independent terms are prepared
+
+         if(command.kind != Command::None) take_command();
+         if(timed_count > 0) take_timed(xtimer_usec_from_ticks(last_wakeup));
+         if(params.version() != params_version) load_params();
+         if(path.active()) take_path();
+         if(homing.active()) take_homing();
+         if(profile.active()) r = profile.next(Ts);
+         else if(gearing.active()) r = gearing.next(Ts);
+         const float rk = shaper.shape(r);
+         const int uMax = homing.seeking() ? (int)(homing.current * motor.uMax) : motor.uMax;
+         const float uff = learning.feedforward();
+         loop.prepare();
+         profiler.lap(TickProfiler::Setpoint);
+
+         const int16_t count = encoder.finish_validated_read();
+         profiler.lap(TickProfiler::EncoderRead);
+         if(encoder.fault) {
+            motor.apply({ 0, 0 });     // no position to close the loop on, let go of the rotor
+            go = false;
+            break;
+         }
+         const float y = encoder.angle(count);   //lookup corrected angle in calibration lookup table
+         const float ucog = cogging.enabled ? cogging.effort(y) : 0.0;
+         profiler.lap(TickProfiler::Lookup);
+
+         if(recorder.recording())
+            recorder.push(xtimer_now_usec(), count, encoder.last_rejected, rk, uff + ucog, uMax, loop, Fs, motor.uMax, params_version);
+         profiler.lap(TickProfiler::Record);
+
+         const float yw_1 = loop.state.yw_1;
+         const ServoLoop::Terms& t = loop.update(rk, y, uMax, uff + ucog);
+         learning.learn(t.e, fabs(t.u) >= uMax);
+         if(cogging.sweeping()) take_sweep(t);
+         profiler.lap(TickProfiler::Pid);
+
+         //if (abs(e) < 0.1) ledPin_HIGH();    // turn on LED if error is less than 0.1
+         //else ledPin_LOW();                  //digitalWrite(ledPin, LOW);
 
-         yw_1 = yw;
+         const Motor::Phases v = motor.commutate(t.angle, t.effort);
+         profiler.lap(TickProfiler::Commutation);
+         motor.apply(v);    // update phase currents
+         profiler.lap(TickProfiler::Output);
+
+         const TelemetrySample sample = { ticks++, { rk, t.yw, t.e, t.u, t.ITerm, t.DTerm } };
+         telemetry.push(sample);
+         scope.push(sample, fabs(t.u) >= uMax, encoder.last_rejected);
+
+         velocity = vLPFa*velocity + (1.0-vLPFa)*Fs*(t.yw-yw_1);
+         ++snapshot_seq;
+         __asm__ volatile("" ::: "memory");
+         snapshot_data = { sample.tick, t.yw, velocity, rk, t.e };
+         __asm__ volatile("" ::: "memory");
+         ++snapshot_seq;
+         profiler.lap(TickProfiler::Report);
       }
 
+      encoder.service();
       return NULL;
    }
 
-   const Motor& motor;
-   const Encoder& encoder;
+   Motor& motor;
+   Encoder& encoder;
+   Params& params;
+   Telemetry& telemetry;
+   Scope& scope;
+   Recorder& recorder;
    const char priority;
    //const uint32_t period;
 
@@ -141,34 +604,39 @@ private:
    bool go = false;
    xtimer_ticks32_t last_wakeup;
 
-   long wrap_count = 0;  //keeps track of how many revolutions the motor has gone though (so you can command angles outside of 0-360)
-   float y_1 = 0.0;
-   float yw_1 = 0.0;
-   float ITerm = 0.0;
-   float DTerm = 0.0;
-
-   const int spr = 200;                // 200 steps per revolution  -- for 400 step/rev, you should only need to edit this value
-   const float aps = 360.0/ spr;       // angle per step
-   const float PA = aps;            // Phase advance...aps = 1.8 for 200 steps per rev, 0.9 for 400
-
-   //const float Fs = 6500.0;   //Sample frequency in Hz
-   const float Fs = 2000.0;   //Sample frequency in Hz
-   const uint32_t period = (uint32_t)(1000000.0/Fs);
-
-   const float pKp = 15.0;      //position mode PID values.  Depending on your motor/load/desired performance, you will need to tune these values.  You can also implement your own control scheme
-   const float pKi = 0.2;
-   const float pKd = 250.0;//1000.0;
-   const float pLPF = 30;       //break frequency in hertz
-
-   const float vKp = 0.001;       //velocity mode PID values.  Depending on your motor/load/desired performance, you will need to tune these values.  You can also implement your own control scheme
-   const float vKi = 0.001;
-   const float vKd = 0.0;
-   const float vLPF = 100.0;       //break frequency in hertz
-
-   const float pLPFa = exp(pLPF*-2.0*3.14159/Fs); // z = e^st pole mapping
-   const float pLPFb = (1.0-pLPFa);
-   const float vLPFa = exp(vLPF*-2.0*3.14159/Fs); // z = e^st pole mapping
-   const float vLPFb = (1.0-vLPFa)* Fs * 0.16666667;
+   uint32_t ticks = 0;
+   ServoLoop loop;
+
+   Profile profile;
+   MotionQueue path;
+   Command command = { Command::None, 0.0, 0.0, 0.0 };
+
+   struct Timed {
+      uint32_t due;
+      Command command;
+   };
+   static const unsigned timed_capacity = 8;
+   Timed timed[timed_capacity];
+   volatile unsigned timed_count = 0;
+   TimedStats timed_stats = { 0, 0 };
+   float velocity = 0.0;
+   volatile uint32_t snapshot_seq = 0;   // odd while snapshot_data is written
+   Snapshot snapshot_data = { 0, 0.0, 0.0, 0.0, 0.0 };
+
+   uint32_t params_version = 0;
+
+   // Loaded from params by load_params()
+   float Fs = 2000.0;   //Sample frequency in Hz
+   uint32_t period = (uint32_t)(1000000.0/Fs);
+   float Ts = 1.0/Fs;
+
+   float vKp = 0.0;       //velocity mode PID values, see Params.hpp for the defaults
+   float vKi = 0.0;
+   float vKd = 0.0;
+   float vLPF = 0.0;       //break frequency in hertz
+
+   float vLPFa = 0.0;
+   float vLPFb = 0.0;
 };
 
 #endif
@@ -0,0 +1,46 @@
+/*
+ * Copyright (C) 2019 Florian Seybold
+ *
+ * This file is subject to the terms and conditions of the GNU Lesser
+ * General Public License v2.1. See the file LICENSE in the top level
+ * directory for more details.
+ */
+
+/**
+ * @ingroup     mechaduino_firmware
+ *
+ * @{
+ * @file
+ * @brief       CRC32 for flash records and frames
+ *
+ * @author      Florian Seybold <florian@seybold.space>
+ */
+
+#ifndef CRC_HPP
+#define CRC_HPP
+
+#include <stdint.h>
+#include <stddef.h>
+
+/// CRC-32 (IEEE 802.3, same as zlib), nibble table to keep flash usage small.
+/// Pass the previous result as crc to continue a running checksum.
+inline uint32_t crc32(const void* data, size_t len, uint32_t crc = 0)
+{
+   static const uint32_t table[16] = {
+      0x00000000, 0x1db71064, 0x3b6e20c8, 0x26d930ac,
+      0x76dc4190, 0x6b6b51f4, 0x4db26158, 0x5005713c,
+      0xedb88320, 0xf00f9344, 0xd6d6a3e8, 0xcb61b38c,
+      0x9b64c2b0, 0x86d3d2d4, 0xa00ae278, 0xbdbdf21c
+   };
+
+   const uint8_t* p = (const uint8_t*)data;
+   crc = ~crc;
+   while (len--) {
+      crc = table[(crc ^ *p) & 0x0f] ^ (crc >> 4);
+      crc = table[(crc ^ (*p >> 4)) & 0x0f] ^ (crc >> 4);
+      ++p;
+   }
+   return ~crc;
+}
+
+#endif
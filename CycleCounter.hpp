@@ -0,0 +1,95 @@
+/*
+ * Copyright (C) 2019 Florian Seybold
+ *
+ * This file is subject to the terms and conditions of the GNU Lesser
+ * General Public License v2.1. See the file LICENSE in the top level
+ * directory for more details.
+ */
+
+/**
+ * @ingroup     mechaduino_firmware
+ *
+ * @{
+ * @file
+ * @brief       Free running counter for timing code sections
+ *
+ * The Cortex-M0+ has no DWT cycle counter, so on target SysTick runs free at
+ * the core clock. It is 24 bits wide, sections longer than 2^24 cycles
+ * (~350 ms at 48 MHz) wrap. Native builds count nanoseconds instead.
+ *
+ * @author      Florian Seybold <florian@seybold.space>
+ */
+
+#ifndef CYCLECOUNTER_HPP
+#define CYCLECOUNTER_HPP
+
+#include <stdint.h>
+
+#ifndef MECHADUINO_SIM
+#include <cpu.h>
+#include <periph_conf.h>
+#else
+#include <time.h>
+#endif
+
+class CycleCounter
+{
+public:
+#ifndef MECHADUINO_SIM
+   /// Starts SysTick without its interrupt, RIOT runs xtimer on a TC and
+   /// leaves SysTick unused on the SAMD21
+   static void init()
+   {
+      SysTick->LOAD = SysTick_LOAD_RELOAD_Msk;
+      SysTick->VAL = 0;
+      SysTick->CTRL = SysTick_CTRL_CLKSOURCE_Msk | SysTick_CTRL_ENABLE_Msk;
+   }
+
+   /// Counts up, SysTick itself counts down
+   static uint32_t now()
+   {
+      return mask - SysTick->VAL;
+   }
+
+   static const char* unit()
+   {
+      return "cycles";
+   }
+
+   static uint32_t per_us()
+   {
+      return CLOCK_CORECLOCK / 1000000;
+   }
+
+   static const uint32_t mask = 0xffffff;
+#else
+   static void init()
+   { }
+
+   static uint32_t now()
+   {
+      timespec t;
+      clock_gettime(CLOCK_MONOTONIC, &t);
+      return (uint32_t)t.tv_sec * 1000000000u + (uint32_t)t.tv_nsec;
+   }
+
+   static const char* unit()
+   {
+      return "ns";
+   }
+
+   static uint32_t per_us()
+   {
+      return 1000;
+   }
+
+   static const uint32_t mask = 0xffffffff;
+#endif
+
+   static uint32_t elapsed(const uint32_t& since)
+   {
+      return (now() - since) & mask;
+   }
+};
+
+#endif
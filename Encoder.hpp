@@ -19,13 +19,24 @@
 #ifndef ENCODER_HPP
 #define ENCODER_HPP
 
+#include <cstddef>
 #include <cstring>
 
 #include <xtimer.h>
 #include <periph/flashpage.h>
 
+#ifndef MECHADUINO_SIM
+#include <periph/spi.h>
+#include <periph_conf.h>
 #include "as5047d_params.h"
+#else
+#include <irq.h>
+#endif
+
 #include "Stepper.hpp"
+#include "Crc.hpp"
+#include "LookupBuilder.hpp"
+#include "ScratchArena.hpp"
 
 #define ENABLE_DEBUG    (0)
 #include "debug.h"
@@ -34,43 +45,440 @@
 class Encoder
 {
 public:
+   /// Header in front of each lookup table slot. The header page of a slot is
+   /// erased before its table is rewritten and programmed last, so a slot only
+   /// becomes valid once its complete table has been written and verified.
+   struct SlotHeader {
+      uint32_t magic;
+      uint16_t version;
+      uint16_t spr;
+      uint32_t cpr;
+      uint32_t sequence;      // incremented on every commit, newest valid slot wins
+      uint32_t timestamp;     // uptime in seconds at commit, there is no RTC
+      uint32_t crc;           // crc32 over the table
+      uint32_t header_crc;    // crc32 over the fields above
+   };
+
+   struct Slot {
+      SlotHeader header;
+      uint8_t header_pad[FLASHPAGE_SIZE - sizeof(SlotHeader)];
+      float table[16384];
+   };
+
    Encoder()
    {
+#ifndef MECHADUINO_SIM
       if (as5047d_init(&enc_dev, &as5047d_params[0])) {
          puts("[Init of as5047d failed]");
       }
+#endif
+
+      select_slot();
+
+#ifdef MECHADUINO_SIM
+      Motor::plant.mount(lookup);   // the built-in table is the sensor's true calibration
+#endif
+   }
+
+#ifndef MECHADUINO_SIM
+   /// Split phase read: start_read() sends the angle command and starts the
+   /// frame carrying the answer, finish_read() collects it. Work that does not
+   /// depend on the sample can run while the second frame is shifted.
+   void start_read()
+   {
+      spi_acquire(AS5047D_PARAM_SPI, AS5047D_PARAM_CS, SPI_MODE_1, AS5047D_PARAM_CLK);
+
+      // The AS5047D answers a command in the following frame
+      const uint8_t cmd[2] = { cmd_angle >> 8, cmd_angle & 0xff };
+      spi_transfer_bytes(AS5047D_PARAM_SPI, AS5047D_PARAM_CS, false, cmd, NULL, sizeof(cmd));
+      for(volatile int i = 0; i < 4; ++i) { }     // CSn high time >= 350 ns
+
+      SercomSpi* dev = spi_config[AS5047D_PARAM_SPI].dev;
+      gpio_clear(AS5047D_PARAM_CS);
+      dev->DATA.reg = cmd_nop >> 8;
+      while(!dev->INTFLAG.bit.DRE) { }
+      dev->DATA.reg = cmd_nop & 0xff;
    }
 
-   int16_t read() const
+   int16_t finish_read()
    {
-      return as5047d_read((as5047d_t*)&enc_dev);
+      SercomSpi* dev = spi_config[AS5047D_PARAM_SPI].dev;
+      while(!dev->INTFLAG.bit.RXC) { }
+      uint16_t frame = dev->DATA.reg << 8;
+      while(!dev->INTFLAG.bit.RXC) { }
+      frame |= dev->DATA.reg;
+      while(!dev->INTFLAG.bit.TXC) { }
+      gpio_set(AS5047D_PARAM_CS);
+      spi_release(AS5047D_PARAM_SPI);
+
+      last_frame = frame;
+      return frame & 0x3fff;
    }
 
-   float angle() const
+   /// Reads and thereby clears the AS5047D error register
+   uint16_t read_errfl()
+   {
+      const uint8_t cmd[2] = { cmd_errfl >> 8, cmd_errfl & 0xff };
+      const uint8_t nop[2] = { cmd_nop >> 8, cmd_nop & 0xff };
+      uint8_t in[2];
+
+      spi_acquire(AS5047D_PARAM_SPI, AS5047D_PARAM_CS, SPI_MODE_1, AS5047D_PARAM_CLK);
+      spi_transfer_bytes(AS5047D_PARAM_SPI, AS5047D_PARAM_CS, false, cmd, NULL, sizeof(cmd));
+      for(volatile int i = 0; i < 4; ++i) { }     // CSn high time >= 350 ns
+      spi_transfer_bytes(AS5047D_PARAM_SPI, AS5047D_PARAM_CS, false, nop, in, sizeof(in));
+      spi_release(AS5047D_PARAM_SPI);
+
+      return ((in[0] << 8) | in[1]) & 0x3fff;
+   }
+#else
+   /// Stand-in for the AS5047D on native: the frame takes as long as a
+   /// blocking driver read, the count is sampled from the simulated rotor
+   /// when the frame starts.
+   void start_read()
+   {
+      const unsigned state = irq_disable();
+      sim_count = Motor::plant.count(xtimer_now_usec64());
+      irq_restore(state);
+
+      sim_ready = xtimer_now_usec() + sim_latency;
+   }
+
+   int16_t finish_read()
+   {
+      while((int32_t)(xtimer_now_usec() - sim_ready) < 0) { }
+
+      last_frame = sim_count & 0x3fff;
+      if(!parity_ok(last_frame)) last_frame |= 0x8000;
+      return last_frame & 0x3fff;
+   }
+
+   uint16_t read_errfl()
+   {
+      return 0;
+   }
+
+   uint32_t sim_latency = 20;    // us
+   int16_t sim_count = 0;
+#endif
+
+   int16_t read()
+   {
+      start_read();
+      return finish_read();
+   }
+
+   float angle()
    {
       return lookup[read()];
    }
 
-   /// this is the calibration routine
-   void calibrate(Stepper& stepper)
+   /// finish_read() for the control loop: frames with bad parity or the error
+   /// flag set, and counts further away from the prediction than a shaft can
+   /// move in one tick, are replaced by the prediction from the last accepted
+   /// samples. After max_rejects outliers in a row the reading is trusted
+   /// again. A bad frame never becomes a count: when there is no prediction
+   /// to hold (the first sample) or max_rejects are exceeded, fault is set
+   /// and the caller has to stop. The error flag is only latched, service()
+   /// reads ERRFL outside the control tick.
+   int16_t finish_validated_read()
    {
-      int encoderReading = 0;     //or float?  not sure if we can average for more res?
-      int currentencoderReading = 0;
-      int lastencoderReading = 0;
-      int avg = 10;               //how many readings to average
+      const int16_t count = finish_read();
+
+      const int16_t predicted = wrap_count(valid_count + valid_step);
+      bool ok = true;
+      bool bad_frame = false;
+      if(!parity_ok(last_frame)) {
+         ++stats.parity_errors;
+         bad_frame = true;
+      }
+      else if(last_frame & 0x4000) {
+         ++stats.flag_errors;
+         errfl_pending = true;
+         bad_frame = true;
+      }
+      else if(validated && abs(wrap_delta(count - predicted)) > max_jump) {
+         ++stats.outliers;
+         ok = false;
+      }
+
+      if((bad_frame || !ok) && validated && rejects < max_rejects) {
+         ++rejects;
+         valid_count = predicted;
+         last_rejected = true;
+         return predicted;
+      }
+      if(bad_frame) {
+         ++stats.faults;
+         fault = true;
+         last_rejected = true;
+         return valid_count;
+      }
+      if(!ok) ++stats.resyncs;
+
+      // After a resync valid_count is a prediction and the difference the
+      // jump, not a velocity: start the prediction from standstill again
+      valid_step = validated && ok ? wrap_delta(count - valid_count) : 0;
+      valid_count = count;
+      validated = true;
+      rejects = 0;
+      last_rejected = false;
+      return count;
+   }
+
+   /// Forget the prediction history and a fault, e.g. when the control loop
+   /// (re)starts
+   void reset_validation()
+   {
+      validated = false;
+      rejects = 0;
+      valid_step = 0;
+      last_rejected = false;
+      fault = false;
+   }
+
+   /// Reads the error register when a frame had the error flag set, which
+   /// also clears the flag. Call outside the control tick, it is a blocking
+   /// SPI transaction.
+   void service()
+   {
+      if(!errfl_pending) return;
+      errfl_pending = false;
+      stats.errfl = read_errfl();
+   }
 
-      int iStart = 0;     //encoder zero position index
-      int jStart = 0;
-      int stepNo = 0;
+   struct Stats {
+      uint32_t parity_errors;
+      uint32_t flag_errors;
+      uint32_t outliers;
+      uint32_t resyncs;       // accepted after max_rejects outliers in a row
+      uint32_t faults;        // bad frames without a prediction to hold
+      uint16_t errfl;         // last AS5047D error register content
+   };
 
-      int fullStepReadings[stepper.motor.spr];
+   void printStats() const
+   {
+      printf("parity errors: %lu, error flags: %lu (last ERRFL=0x%04x%s), outliers: %lu, resyncs: %lu, faults: %lu\n",
+             (unsigned long)stats.parity_errors, (unsigned long)stats.flag_errors, stats.errfl,
+             errfl_pending ? ", not read yet" : "", (unsigned long)stats.outliers, (unsigned long)stats.resyncs,
+             (unsigned long)stats.faults);
+   }
+
+   void resetStats()
+   {
+      memset(&stats, 0, sizeof(stats));
+   }
+
+   Stats stats = { };
+   bool last_rejected = false;      // last validated read was replaced by the prediction
+   bool fault = false;              // bad frames and no prediction left to hold, the loop must stop
+   int max_jump = 400;              // counts per tick beyond the prediction, about 25 rev/s at 2 kHz
+   int max_rejects = 8;
+
+   float angle(const int16_t& count) const
+   {
+      return lookup[count];
+   }
+
+   /// crc32 over the lookup table in use, identifies it in recordings
+   uint32_t lookupCrc() const
+   {
+      return crc32(lookup, cpr * sizeof(float));
+   }
+
+   /// Times n iterations of a blocking read followed by the control math
+   /// against the split phase read overlapping the sample independent part
+   void bench(const unsigned& n)
+   {
+      volatile float state = 1.0;
+      auto prepare = [&state]() { for(int k = 0; k < 16; ++k) state = 0.99f*state + 0.01f; };
+      auto feedback = [&state, this](const int16_t& count) { for(int k = 0; k < 16; ++k) state = 0.99f*state + 0.01f*lookup[count]; };
+
+      uint32_t t0 = xtimer_now_usec();
+      for(unsigned i = 0; i < n; ++i) {
+         const int16_t count = read();
+         prepare();
+         feedback(count);
+      }
+      const uint32_t blocking = xtimer_now_usec() - t0;
+
+      t0 = xtimer_now_usec();
+      for(unsigned i = 0; i < n; ++i) {
+         start_read();
+         prepare();
+         feedback(finish_read());
+      }
+      const uint32_t overlapped = xtimer_now_usec() - t0;
+
+      printf("blocking:   %lu us per iteration\n", (unsigned long)(blocking / n));
+      printf("overlapped: %lu us per iteration\n", (unsigned long)(overlapped / n));
+   }
+
+   /// this is the calibration routine
+   void calibrate(Stepper& stepper)
+   {
+      ScratchArena::Lease scratch("calibrate");
+      int* fullStepReadings = scratch.alloc<int>(stepper.motor.spr);
+      uint16_t* spread = scratch.alloc<uint16_t>(stepper.motor.spr);
+      float* staging = scratch.alloc<float>(floats_per_page);
+      if(!staging) return;
 
-      int fullStep = 0;
-      int ticks = 0;
-      float lookupAngle = 0.0;
       //SerialUSB.println("Beginning calibration routine...");
       puts("calibrate(): Beginning calibration routine...");
 
+      if(!measure(stepper, fullStepReadings, spread))
+         return;
+
+      // The code below generates the lookup table by intepolating between
+      // full steps and mapping each encoder count to a calibrated angle
+      // The lookup table is too big to store in volatile memory,
+      // so we must generate and store it into the flash on the fly
+
+      // New tables always go to the inactive slot. Invalidate its header
+      // first, the active table stays in use until the commit.
+      const int target = 1 - active;
+      pages_written = 0;
+      pages_skipped = 0;
+      pages_failed = 0;
+      write_time = 0;
+      page = staging;
+      memset(page, 0xff, page_size);
+      page_number = flashpage_page((void*)&slot(target).header);
+      write_page();
+
+      page_count = 0;
+      lookup_count = 0;
+      lookup_crc = 0;
+      page_number = flashpage_page((void*)slot(target).table);
+
+      auto sink = [this](const float& lookupAngle) { store_lookup(lookupAngle); };
+      LookupBuilder(stepper.motor.spr, cpr).build(fullStepReadings, sink);
+
+      if (page_count != 0)
+         write_page();
+
+      printf("calibrate(): %u pages written, %u skipped, %u failed, %lu us\n",
+             pages_written, pages_skipped, pages_failed, (unsigned long)write_time);
+
+      commit_slot(target, stepper.motor.spr);
+      page = NULL;
+
+      //SerialUSB.println(" ");
+      //SerialUSB.println(" ");
+      //SerialUSB.println("Calibration complete!");
+      //SerialUSB.println("The calibration table has been written to non-volatile Flash memory!");
+      //SerialUSB.println(" ");
+      //SerialUSB.println(" ");
+   }
+
+   /// Runs the calibration moves only and streams the raw full step readings
+   /// as one binary frame (see CalibrationFrameHeader), tools/lookupgen
+   /// turns it into a table offline.
+   void capture(Stepper& stepper)
+   {
+      const int spr = stepper.motor.spr;
+      ScratchArena::Lease scratch("capture");
+      int* fullStepReadings = scratch.alloc<int>(spr);
+      uint16_t* spread = scratch.alloc<uint16_t>(spr);
+      int16_t* readings = scratch.alloc<int16_t>(spr);
+      if(!readings) return;
+
+      puts("capture(): Beginning calibration capture...");
+
+      if(!measure(stepper, fullStepReadings, spread))
+         return;
+
+      CalibrationFrameHeader header;
+      header.magic = calibration_frame_magic;
+      header.version = calibration_frame_version;
+      header.spr = stepper.motor.spr;
+      header.cpr = cpr;
+      header.avg = avg;
+
+      for(int x = 0; x < spr; ++x)
+         readings[x] = fullStepReadings[x];
+
+      uint32_t crc = crc32(&header, sizeof(header));
+      crc = crc32(readings, spr * sizeof(int16_t), crc);
+      crc = crc32(spread, spr * sizeof(uint16_t), crc);
+
+      fwrite(&header, sizeof(header), 1, stdout);
+      fwrite(readings, sizeof(int16_t), spr, stdout);
+      fwrite(spread, sizeof(uint16_t), spr, stdout);
+      fwrite(&crc, sizeof(crc), 1, stdout);
+      fflush(stdout);
+      puts("");
+   }
+
+   void printLookup()
+   {
+      for(int c = 0; c<cpr; ++c)
+      {
+         printf("%f, ", lookup[c]);
+      }
+      printf("\n");
+   };
+
+   void printSlots() const
+   {
+      for(int s = 0; s<2; ++s)
+      {
+         const SlotHeader& h = slot(s).header;
+         if(header_valid(h))
+            printf("slot %i%s: sequence=%lu, timestamp=%lus, spr=%u, cpr=%lu, crc=0x%08lx\n", s, s==active ? " (active)" : "",
+                   (unsigned long)h.sequence, (unsigned long)h.timestamp, h.spr, (unsigned long)h.cpr, (unsigned long)h.crc);
+         else
+            printf("slot %i%s: no committed table\n", s, s==active ? " (active)" : "");
+      }
+   }
+
+   /// Full crc check of a slot table, too slow for boot (about 64 KB of flash)
+   bool verify(const int& s) const
+   {
+      const SlotHeader& h = slot(s).header;
+      return header_valid(h) && crc32(slot(s).table, sizeof(slot(s).table)) == h.crc;
+   }
+
+   int active_slot() const
+   {
+      return active;
+   }
+
+   /// Flash taken by the two lookup table slots
+   static size_t flashBytes()
+   {
+      return sizeof(slots);
+   }
+
+private:
+   static bool parity_ok(uint16_t frame)
+   {
+      frame ^= frame >> 8;
+      frame ^= frame >> 4;
+      frame ^= frame >> 2;
+      frame ^= frame >> 1;
+      return (frame & 1) == 0;      // even parity over all 16 bits
+   }
+
+   int16_t wrap_count(const int& count) const
+   {
+      return (count % cpr + cpr) % cpr;
+   }
+
+   int wrap_delta(const int& delta) const
+   {
+      if(delta >= cpr/2) return delta - cpr;
+      if(delta < -cpr/2) return delta + cpr;
+      return delta;
+   }
+
+   /// Steps through all full step positions and records the averaged encoder
+   /// reading at each of them, together with the spread of the averaged samples
+   bool measure(Stepper& stepper, int* fullStepReadings, uint16_t* spread)
+   {
+      int encoderReading = 0;     //or float?  not sure if we can average for more res?
+      int currentencoderReading = 0;
+      int lastencoderReading = 0;
+
       encoderReading = read();
       stepper.dir = true;
       stepper.step();
@@ -79,20 +487,9 @@ public:
       if ((read() - encoderReading) < 0)   //check which way motor moves when stepper.dir = true
       {
          puts("calibrate(): Wired backwards");    // rewiring either phase should fix this.  You may get a false message if you happen to be near the point where the encoder rolls over...
-         return;
+         return false;
       }
 
-      /*while (stepper.stepNumber != 0) {       //go to step zero
-         if (stepper.stepNumber > 0) {
-            stepper.dir = true;
-         }
-         else
-         {
-            stepper.dir = false;
-         }
-         stepper.step();
-         xtimer_usleep(100000);
-      }*/
       stepper.home();
 
       stepper.dir = true;
@@ -101,6 +498,8 @@ public:
          encoderReading = 0;
          xtimer_usleep(20000);                           //moving too fast may not give accurate readings.  Motor needs time to settle after each step.
          lastencoderReading = read();
+         int minReading = lastencoderReading + cpr;
+         int maxReading = lastencoderReading - cpr;
 
          for (int reading = 0; reading < avg; reading++) {  //average multple readings at each step
             currentencoderReading = read();
@@ -112,6 +511,9 @@ public:
                currentencoderReading -= cpr;
             }
 
+            if (currentencoderReading < minReading) minReading = currentencoderReading;
+            if (currentencoderReading > maxReading) maxReading = currentencoderReading;
+
             encoderReading += currentencoderReading;
             xtimer_usleep(10000);
             lastencoderReading = currentencoderReading;
@@ -125,169 +527,121 @@ public:
          }
 
          fullStepReadings[x] = encoderReading;
-         // SerialUSB.println(fullStepReadings[x], DEC);      //print readings as a sanity check
-         /*if (x % 20 == 0)
-           {
-           SerialUSB.println();
-           SerialUSB.print(100*x/stepper.motor.spr);
-           SerialUSB.print("% ");
-           } else {
-           SerialUSB.print('.');
-           }*/
+         spread[x] = maxReading - minReading;
+         DEBUG("measure(): x=%i, reading=%i, spread=%u\n", x, encoderReading, spread[x]);
 
          stepper.step();
       }
-      //SerialUSB.println();
-
-      // SerialUSB.println(" ");
-      // SerialUSB.println("ticks:");                        //"ticks" represents the number of encoder counts between successive steps... these should be around 82 for a 1.8 degree stepper
-      // SerialUSB.println(" ");
-      for (int i = 0; i < stepper.motor.spr; i++) {
-         ticks = fullStepReadings[stepper.motor.mod((i + 1), stepper.motor.spr)] - fullStepReadings[stepper.motor.mod((i), stepper.motor.spr)];
-         if (ticks < -15000) {
-            ticks += cpr;
-
-         }
-         else if (ticks > 15000) {
-            ticks -= cpr;
-         }
-         // SerialUSB.println(ticks);
 
-         if (ticks > 1) {                                    //note starting point with iStart,jStart
-            for (int j = 0; j < ticks; j++) {
-               stepNo = (stepper.motor.mod(fullStepReadings[i] + j, cpr));
-               // SerialUSB.println(stepNo);
-               if (stepNo == 0) {
-                  iStart = i;
-                  jStart = j;
-               }
+      return true;
+   }
 
-            }
-         }
+   void write_page()
+   {
+      /*if (0 == (0xFFF & (uintptr_t) page_ptr))
+        {
+        SerialUSB.println();
+        SerialUSB.print("0x");
+        SerialUSB.print((uintptr_t) page_ptr, HEX);
+        } else {
+        SerialUSB.print(".");
+        }*/
 
-         if (ticks < 1) {                                    //note starting point with iStart,jStart
-            for (int j = -ticks; j > 0; j--) {
-               stepNo = (stepper.motor.mod(fullStepReadings[stepper.motor.spr - 1 - i] + j, cpr));
-               // SerialUSB.println(stepNo);
-               if (stepNo == 0) {
-                  iStart = i;
-                  jStart = j;
-               }
+      //flash.erase((const void*) page_ptr, sizeof(page));
+      //flash.write((const void*) page_ptr, (const void *) page, sizeof(page));
 
-            }
-         }
+      const uint32_t t0 = xtimer_now_usec();
 
+      // Pages that already hold the staged data are not erased again, a
+      // recalibration usually changes only part of the table.
+      if(flashpage_verify(page_number, page) == FLASHPAGE_OK) {
+         DEBUG("Skipping lookup page number %i\n", page_number);
+         ++pages_skipped;
       }
-
-      // The code below generates the lookup table by intepolating between
-      // full steps and mapping each encoder count to a calibrated angle
-      // The lookup table is too big to store in volatile memory,
-      // so we must generate and store it into the flash on the fly
-
-      // begin the write to the calibration table
-      //const void * page_ptr = (const uint8_t*) lookup;
-      //SerialUSB.print("Writing to flash 0x");
-      //SerialUSB.print((uintptr_t) page_ptr, HEX);
-      //SerialUSB.print(" page size PSZ=");
-      //SerialUSB.print(NVMCTRL->PARAM.bit.PSZ);
-      DEBUG("calibrate(): iStart=%i, jStart=%i, spr=%i\n", iStart, jStart, stepper.motor.spr);
-
-      page_count = 0;
-      page_number = flashpage_page((void*)&lookup);
-
-      for (int i = iStart; i < (iStart + stepper.motor.spr + 1); i++) {
-         ticks = fullStepReadings[stepper.motor.mod((i + 1), stepper.motor.spr)] - fullStepReadings[stepper.motor.mod((i), stepper.motor.spr)];
-
-         if (ticks < -15000) {           //check if current interval wrstepper.motor.aps over encoder's zero positon
-            ticks += cpr;
+      else {
+         DEBUG("Writing lookup page number %i\n", page_number);
+         flashpage_write(page_number, page);
+         ++pages_written;
+
+         if(flashpage_verify(page_number, page) != FLASHPAGE_OK) {
+            printf("Verification of lookup page number %i failed\n", page_number);
+            ++pages_failed;
          }
-         else if (ticks > 15000) {
-            ticks -= cpr;
-         }
-      
-         DEBUG("calibrate(): iStart=%i, jStart=%i, spr=%i, i=%i, ticks=%i\n", iStart, jStart, stepper.motor.spr, i, ticks);
-
-         //Here we print an interpolated angle corresponding to each encoder count (in order)
-         if (ticks > 1) {              //if encoder counts were increasing during cal routine...
-            if (i == iStart) { //this is an edge case
-               for (int j = jStart; j < ticks; j++) {
-                  store_lookup(0.001 * stepper.motor.mod(1000 * ((stepper.motor.aps * i) + ((stepper.motor.aps * j ) / float(ticks))), 360000.0));
-               }
-            }
+      }
 
-            else if (i == (iStart + stepper.motor.spr)) { //this is an edge case
-               for (int j = 0; j < jStart; j++) {
-                  store_lookup(0.001 * stepper.motor.mod(1000 * ((stepper.motor.aps * i) + ((stepper.motor.aps * j ) / float(ticks))), 360000.0));
-               }
-            }
-            else {                        //this is the general case
-               for (int j = 0; j < ticks; j++) {
-                  store_lookup(0.001 * stepper.motor.mod(1000 * ((stepper.motor.aps * i) + ((stepper.motor.aps * j ) / float(ticks))), 360000.0));
-               }
-            }
-         }
+      write_time += xtimer_now_usec() - t0;
+   }
 
-         else if (ticks < 1) {             //similar to above... for case when encoder counts were decreasing during cal routine
-            if (i == iStart) {
-               for (int j = - ticks; j > (jStart); j--) {
-                  store_lookup(0.001 * stepper.motor.mod(1000 * (stepper.motor.aps * (i) + (stepper.motor.aps * ((ticks + j)) / float(ticks))), 360000.0));
-               }
-            }
-            else if (i == iStart + stepper.motor.spr) {
-               for (int j = jStart; j > 0; j--) {
-                  store_lookup(0.001 * stepper.motor.mod(1000 * (stepper.motor.aps * (i) + (stepper.motor.aps * ((ticks + j)) / float(ticks))), 360000.0));
-               }
-            }
-            else {
-               for (int j = - ticks; j > 0; j--) {
-                  store_lookup(0.001 * stepper.motor.mod(1000 * (stepper.motor.aps * (i) + (stepper.motor.aps * ((ticks + j)) / float(ticks))), 360000.0));
-               }
-            }
+   /// Boot check: only the headers are validated. Since a header is written
+   /// after its table has been verified, this is enough to reject torn writes.
+   void select_slot()
+   {
+      bool found = false;
+      active = 0;
+      for(int s = 0; s<2; ++s) {
+         const SlotHeader& h = slot(s).header;
+         if(!header_valid(h)) continue;
+         if(!found || h.sequence > slot(active).header.sequence) {
+            active = s;
+            found = true;
          }
       }
+      lookup = slot(active).table;
 
-      if (page_count != 0)
-         write_page();
+      if(!found) puts("[No committed lookup table, using built-in table]");
+   }
 
-      //SerialUSB.println(" ");
-      //SerialUSB.println(" ");
-      //SerialUSB.println("Calibration complete!");
-      //SerialUSB.println("The calibration table has been written to non-volatile Flash memory!");
-      //SerialUSB.println(" ");
-      //SerialUSB.println(" ");
+   bool header_valid(const SlotHeader& h) const
+   {
+      return h.magic == slot_magic && h.version == slot_version && h.cpr == (uint32_t)cpr
+         && h.header_crc == crc32(&h, offsetof(SlotHeader, header_crc));
    }
 
-   void printLookup()
+   void commit_slot(const int& target, const int& spr)
    {
-      for(int c = 0; c<cpr; ++c)
-      {
-         printf("%f, ", lookup[c]);
+      if(pages_failed != 0) {
+         printf("calibrate(): Flash verification failed, keeping slot %i\n", active);
+         return;
+      }
+      if(lookup_count != (unsigned)cpr) {
+         printf("calibrate(): Generated %u of %i entries, keeping slot %i\n", lookup_count, cpr, active);
+         return;
+      }
+      if(crc32(slot(target).table, sizeof(slot(target).table)) != lookup_crc) {
+         printf("calibrate(): Verification of slot %i failed, keeping slot %i\n", target, active);
+         return;
       }
-      printf("\n");
-   };
 
-private:
-   void write_page()
-   {
-      /*if (0 == (0xFFF & (uintptr_t) page_ptr))
-        {
-        SerialUSB.println();
-        SerialUSB.print("0x");
-        SerialUSB.print((uintptr_t) page_ptr, HEX);
-        } else {
-        SerialUSB.print(".");
-        }*/
+      SlotHeader h;
+      h.magic = slot_magic;
+      h.version = slot_version;
+      h.spr = spr;
+      h.cpr = cpr;
+      h.sequence = header_valid(slot(active).header) ? slot(active).header.sequence + 1 : 1;
+      h.timestamp = (uint32_t)(xtimer_now_usec64() / 1000000);
+      h.crc = lookup_crc;
+      h.header_crc = crc32(&h, offsetof(SlotHeader, header_crc));
+
+      memset(page, 0xff, page_size);
+      memcpy(page, &h, sizeof(h));
+      page_number = flashpage_page((void*)&slot(target).header);
+      write_page();
 
-      //flash.erase((const void*) page_ptr, sizeof(page));
-      //flash.write((const void*) page_ptr, (const void *) page, sizeof(page));
-      
-      printf("Writing lookup page number %i\n", page_number);
-      flashpage_write(page_number, page);
+      if(!header_valid(slot(target).header)) {
+         printf("calibrate(): Writing header of slot %i failed, keeping slot %i\n", target, active);
+         return;
+      }
+
+      active = target;
+      lookup = slot(active).table;
+      printf("calibrate(): Committed slot %i, sequence %lu\n", active, (unsigned long)h.sequence);
    }
 
    void store_lookup(const float& lookupAngle)
    {
       DEBUG("store_lookup(): page_count=%i\n", page_count);
+      if(lookup_count++ >= (unsigned)cpr) return;   // never write past the slot
+      lookup_crc = crc32(&lookupAngle, sizeof(lookupAngle), lookup_crc);
       page[page_count++] = lookupAngle;
       if(page_count != floats_per_page)
          return;
@@ -298,26 +652,69 @@ private:
       // reset our counters and increment our flash page
       page_number += 1;
       page_count = 0;
-      memset(page, 0, sizeof(page));
+      memset(page, 0, page_size);
    }
 
 
+#ifndef MECHADUINO_SIM
    as5047d_t enc_dev;
+#else
+   uint32_t sim_ready = 0;
+#endif
+
+   static const uint16_t cmd_angle = 0xffff;   // read ANGLECOM, with even parity
+   static const uint16_t cmd_nop = 0xc000;     // read NOP, with even parity
+   static const uint16_t cmd_errfl = 0x4001;   // read ERRFL, with even parity
+   uint16_t last_frame = 0;
+
+   bool validated = false;
+   int16_t valid_count = 0;
+   int valid_step = 0;
+   int rejects = 0;
+   bool errfl_pending = false;      // a frame had the error flag set, ERRFL not read yet
 
    unsigned page_count = 0;
-   unsigned page_number = flashpage_page((void*)&lookup);
+   unsigned page_number = 0;
+   unsigned lookup_count = 0;
+   uint32_t lookup_crc = 0;
+
+   unsigned pages_written = 0;
+   unsigned pages_skipped = 0;
+   unsigned pages_failed = 0;
+   uint32_t write_time = 0;   // us spent comparing, writing and verifying
 
    static const unsigned page_size = FLASHPAGE_SIZE; // actual size is 64?
    static const unsigned floats_per_page = page_size / sizeof(float);
-   float page[floats_per_page] = { };
+   float* page = NULL;                       // staging buffer, leased from the ScratchArena during calibrate()
 
    const int cpr = 16384;                    // counts per rev
+   const int avg = 10;                       // how many readings to average per full step
+
+   static const uint32_t slot_magic = 0x4c4f4f4b;   // "LOOK"
+   static const uint16_t slot_version = 1;
+
+   /// The slots are rewritten at runtime, hide their const initializer
+   /// from the optimizer so header checks are not folded at compile time.
+   static const Slot& slot(const int& s)
+   {
+      const Slot* p = slots;
+      __asm__ ("" : "+r" (p));
+      return p[s];
+   }
+
+   int active = 0;
+   const float* lookup = slot(0).table;
 
-   static const float __attribute__((__aligned__(256))) lookup[16384];
+   static const Slot __attribute__((__aligned__(256))) slots[2];
 };
 
-const float Encoder::lookup[16384] = {
-   #include "lookup.dat"
+// Slot 0 carries the built-in table without a header, it is used until the
+// first calibration has been committed.
+const Encoder::Slot Encoder::slots[2] = {
+   { { }, { }, {
+      #include "lookup.dat"
+   } },
+   { }
 };
 
 #endif
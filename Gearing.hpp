@@ -0,0 +1,177 @@
+/*
+ * Copyright (C) 2019 Florian Seybold
+ *
+ * This file is subject to the terms and conditions of the GNU Lesser
+ * General Public License v2.1. See the file LICENSE in the top level
+ * directory for more details.
+ */
+
+/**
+ * @ingroup     mechaduino_firmware
+ *
+ * @{
+ * @file
+ * @brief       Electronic gearing, setpoint from a master position
+ *
+ * The master position is accumulated in 64 bit counts, either from step/dir
+ * pulses (counted in the step pin ISR) or from positions streamed over the
+ * binary protocol. Each tick the setpoint is offset + master * num / den
+ * in degrees, the ratio is applied to the whole accumulated position so
+ * rounding never adds up over turns. A relative engage counts the master
+ * from the engage position and sets the offset to the hold position.
+ * Engaging blends from the hold position to the geared path with a
+ * smoothstep, matching position and velocity at both ends.
+ *
+ * @author      Florian Seybold <florian@seybold.space>
+ */
+
+#ifndef GEARING_HPP
+#define GEARING_HPP
+
+#include <periph/gpio.h>
+
+#include <stdint.h>
+
+#include "arduino_pinmap.h"
+
+// Master step and direction inputs, step_pin and dir_pin in mechaduino_params.h
+static const gpio_t gearing_step_pin = ARDUINO_PIN_1;
+static const gpio_t gearing_dir_pin = ARDUINO_PIN_0;
+
+class Gearing
+{
+public:
+   enum Source { Pulses, Stream };
+
+   /// Sets ratio (output deg per master count as num/den), offset in deg and
+   /// the master source. Only while disengaged.
+   bool configure(const int32_t& num_, const int32_t& den_, const float& offset_, const Source& source_)
+   {
+      if(engaged || den_ == 0) return false;
+      num = num_;
+      den = den_;
+      offset = offset_;
+      if(source_ == Pulses && !pulses_attached) {
+         gpio_init(gearing_dir_pin, GPIO_IN);
+         gpio_init_int(gearing_step_pin, GPIO_IN, GPIO_RISING, [](void* arg){ ((Gearing*)arg)->pulse(); }, this);
+         pulses_attached = true;
+      }
+      if(source_ != source) {
+         last_pulses = pulses;        // the master continues from where it is
+         last_streamed = streamed;
+      }
+      source = source_;
+      return true;
+   }
+
+   /// Latest absolute master position from a stream, wraps at 32 bit
+   void stream(const uint32_t& position)
+   {
+      streamed = position;
+   }
+
+   /// Starts following from the hold position from, called by the control
+   /// loop. Relative engages shift the offset so the geared path starts at
+   /// from, otherwise the blend catches up with the absolute path.
+   void engage(const float& from, const bool& relative)
+   {
+      sync_master();
+      if(relative) {
+         reference = master;    // counted from here, keeps the float terms small
+         offset = from;
+      }
+      else {
+         reference = 0;
+      }
+      blend_from = from;
+      blend_left = blend_time;
+      last = from;
+      velocity = 0.0;
+      engaged = true;
+   }
+
+   void stop()
+   {
+      engaged = false;
+   }
+
+   bool active() const
+   {
+      return engaged;
+   }
+
+   /// Advances by one tick of length dt and returns the new setpoint
+   float next(const float& dt)
+   {
+      sync_master();
+      float out = geared();
+      if(blend_left > 0.0) {
+         const float t = 1.0 - blend_left / blend_time;
+         const float w = t * t * (3.0 - 2.0 * t);
+         out = blend_from + w * (out - blend_from);
+         blend_left -= dt;
+      }
+      velocity = (out - last) / dt;
+      last = out;
+      return out;
+   }
+
+   int64_t masterPosition() const
+   {
+      return master;
+   }
+
+   int32_t numerator() const { return num; }
+   int32_t denominator() const { return den; }
+   float offsetDeg() const { return offset; }
+
+   float velocity = 0.0;      // deg/s of the last setpoint step, handed to the profile on disengage
+   float blend_time = 0.5;    // s to blend into the geared path
+
+private:
+   void pulse()
+   {
+      pulses += gpio_read(gearing_dir_pin) ? 1 : -1;
+   }
+
+   /// Adds the master movement since the last tick, wrap safe
+   void sync_master()
+   {
+      if(source == Pulses) {
+         const uint32_t p = pulses;
+         master += (int32_t)(p - last_pulses);
+         last_pulses = p;
+      }
+      else {
+         const uint32_t p = streamed;
+         master += (int32_t)(p - last_streamed);
+         last_streamed = p;
+      }
+   }
+
+   float geared() const
+   {
+      const int64_t q = (master - reference) * num;
+      return offset + (float)(q / den) + (float)(q % den) / den;
+   }
+
+   int32_t num = 1;
+   int32_t den = 1;
+   float offset = 0.0;
+   Source source = Stream;
+   bool pulses_attached = false;
+
+   volatile uint32_t pulses = 0;     // counted by the step pin ISR
+   volatile uint32_t streamed = 0;
+   uint32_t last_pulses = 0;
+   uint32_t last_streamed = 0;
+   int64_t master = 0;
+   int64_t reference = 0;            // master position the ratio is applied from
+
+   volatile bool engaged = false;
+   float blend_from = 0.0;
+   float blend_left = 0.0;
+   float last = 0.0;
+};
+
+#endif
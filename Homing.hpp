@@ -0,0 +1,137 @@
+/*
+ * Copyright (C) 2019 Florian Seybold
+ *
+ * This file is subject to the terms and conditions of the GNU Lesser
+ * General Public License v2.1. See the file LICENSE in the top level
+ * directory for more details.
+ */
+
+/**
+ * @ingroup     mechaduino_firmware
+ *
+ * @{
+ * @file
+ * @brief       Sensorless homing against a hard stop
+ *
+ * The control loop seeks toward the stop along a profiled move at reduced
+ * current. Contact shows as a following error that keeps growing while the
+ * measured velocity has dropped to almost nothing; once both hold for a
+ * few ticks in a row the position is taken as the contact position. The
+ * setpoint then drops back to the measured position (so the motor stops
+ * pushing), the axis backs off by backoff and position zero is put there.
+ * With the current limited the rotor presses into the stop with the same
+ * torque every time, so the contact position repeats to a few counts.
+ *
+ * Controller runs the moves, this class keeps the state and detects the
+ * contact. Keep this header free of RIOT includes.
+ *
+ * @author      Florian Seybold <florian@seybold.space>
+ */
+
+#ifndef HOMING_HPP
+#define HOMING_HPP
+
+#include <cmath>
+
+class Homing
+{
+public:
+   enum State { Idle, Seeking, Backing, Done, Failed };
+
+   /// Starts seeking in direction dir (sign only) from position from (deg),
+   /// returns the target of the seek move
+   float start(const int& dir_, const float& from)
+   {
+      dir = dir_ < 0 ? -1 : 1;
+      hits = 0;
+      elapsed = 0.0;
+      contact_at = 0.0;
+      state_ = Seeking;
+      return from + dir * travel;
+   }
+
+   void stop()
+   {
+      state_ = Idle;
+   }
+
+   /// Advances by one tick of length dt, with the following error e, the
+   /// measured position and velocity (deg, deg/s) and whether the move
+   /// toward the stop or away from it still runs. Returns the new state.
+   State update(const float& dt, const float& e, const float& position, const float& velocity, const bool& moving)
+   {
+      elapsed += dt;
+      if(state_ == Seeking) {
+         if(dir * e > error_limit && fabs(velocity) < velocity_limit) {
+            if(++hits >= confirm) {
+               contact_at = position;
+               state_ = Backing;
+            }
+         }
+         else {
+            hits = 0;
+            if(!moving) state_ = Failed;    // travelled the whole way without finding a stop
+         }
+      }
+      else if(state_ == Backing && !moving) {
+         state_ = Done;
+      }
+      return state_;
+   }
+
+   State state() const
+   {
+      return state_;
+   }
+
+   bool active() const
+   {
+      return state_ == Seeking || state_ == Backing;
+   }
+
+   bool seeking() const
+   {
+      return state_ == Seeking;
+   }
+
+   /// deg, where the axis backs off to and position zero goes
+   float zero() const
+   {
+      return contact_at - dir * backoff;
+   }
+
+   /// deg, measured at contact in the frame before homing
+   float contact() const
+   {
+      return contact_at;
+   }
+
+   /// s since start()
+   float time() const
+   {
+      return elapsed;
+   }
+
+   int direction() const
+   {
+      return dir;
+   }
+
+   float speed = 180.0;          // deg/s toward the stop and back
+   float amax = 3600.0;          // deg/s^2
+   float current = 0.3;          // fraction of uMax while seeking
+   float error_limit = 2.0;      // deg of following error into the stop
+   float velocity_limit = 20.0;  // deg/s, slower counts as stalled
+   unsigned confirm = 10;        // ticks both must hold
+   float backoff = 5.0;          // deg from the contact to zero
+   float travel = 720.0;         // deg to seek before giving up
+
+private:
+   State state_ = Idle;
+   int dir = -1;
+   unsigned hits = 0;
+   float elapsed = 0.0;
+   float contact_at = 0.0;
+};
+
+#endif
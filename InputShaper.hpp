@@ -0,0 +1,205 @@
+/*
+ * Copyright (C) 2019 Florian Seybold
+ *
+ * This file is subject to the terms and conditions of the GNU Lesser
+ * General Public License v2.1. See the file LICENSE in the top level
+ * directory for more details.
+ */
+
+/**
+ * @ingroup     mechaduino_firmware
+ *
+ * @{
+ * @file
+ * @brief       Input shaping of the setpoint against residual vibration
+ *
+ * Convolves the setpoint with two or three impulses that cancel the
+ * vibration of a mode of frequency f and damping ratio zeta (Singer and
+ * Seering, "Preshaping command inputs to reduce system vibration"): ZV with
+ * amplitudes 1, K at 0 and Td/2, ZVD with 1, 2K, K^2 at 0, Td/2, Td, and
+ * the extra insensitive EI with (1+V)/4, (1-V)/2 K, (1+V)/4 K^2 at the same
+ * times for 5% vibration at the design frequency, each normalized to unit
+ * sum. Td is the damped period and K = exp(-zeta pi / sqrt(1 - zeta^2)).
+ * A step through the shaper takes Td/2 (ZV) or Td longer, in exchange the
+ * load does not ring; ZVD and EI tolerate a mode that is off by more.
+ *
+ * The setpoint history is a ring of capacity samples. For delays beyond it
+ * only every stride-th tick is kept and the delayed values are interpolated.
+ * The history is recorded while shaping is off too and kept, resampled if
+ * the stride changes, when the shaper is tuned again, so it can be switched
+ * on or retuned at any time without a jump of the shaped setpoint. The
+ * samples are counted in ticks, after a change of the tick rate a step
+ * still on its way is shaped with delays off by the ratio of the rates.
+ * Keep this header free of RIOT includes.
+ *
+ * @author      Florian Seybold <florian@seybold.space>
+ */
+
+#ifndef INPUTSHAPER_HPP
+#define INPUTSHAPER_HPP
+
+#include <cmath>
+#include <stdint.h>
+
+class InputShaper
+{
+public:
+   enum Type { Off, ZV, ZVD, EI };
+
+   static const unsigned capacity = 256;        // samples of setpoint history, 1 kB
+   static const unsigned max_impulses = 3;
+
+   /// Tunes to a mode of freq Hz and damping ratio zeta at tick rate Fs.
+   /// Fails for a frequency of 0 or below or a damping outside [0, 1),
+   /// keeping the previous shaper.
+   bool configure(const Type& type_, const float& freq_, const float& zeta_, const float& Fs)
+   {
+      if(type_ != Off && (freq_ <= 0.0 || zeta_ < 0.0 || zeta_ >= 1.0)) return false;
+      type = type_;
+      freq = freq_;
+      zeta = zeta_;
+      impulses = 1;
+      amplitude[0] = 1.0;
+      delay[0] = 0.0;
+      if(type == Off) return true;
+
+      const float root = sqrt(1.0 - zeta * zeta);
+      const float K = exp(-zeta * M_PI / root);
+      const float half = 0.5 * Fs / (freq * root);        // ticks, half the damped period
+      static const float V = 0.05;
+      const float base[3][3] = { { 1.0, 1.0, 0.0 }, { 1.0, 2.0, 1.0 }, { 0.25 * (1.0 + V), 0.5 * (1.0 - V), 0.25 * (1.0 + V) } };
+      const float* b = base[type - 1];
+
+      impulses = type == ZV ? 2 : 3;
+      float sum = 0.0;
+      float k = 1.0;
+      for(unsigned i = 0; i < impulses; ++i) {
+         amplitude[i] = b[i] * k;
+         delay[i] = i * half;
+         sum += amplitude[i];
+         k *= K;
+      }
+      for(unsigned i = 0; i < impulses; ++i) amplitude[i] /= sum;
+
+      const unsigned span = (unsigned)ceil(delay[impulses - 1]);
+      resample(span / (capacity - 2) + 1);
+      return true;
+   }
+
+   /// Fills the history with r, as if it had been the setpoint for long
+   void reset(const float& r)
+   {
+      for(unsigned i = 0; i < capacity; ++i) history[i] = r;
+      last = r;
+      since = 0;
+      still = (uint32_t)-1;
+   }
+
+   /// Records this tick's setpoint r and returns the shaped one
+   float shape(const float& r)
+   {
+      if(r != last) still = 0;
+      else if(still != (uint32_t)-1) ++still;
+      last = r;
+      if(++since >= stride) {
+         head = (head + 1) % capacity;
+         history[head] = r;
+         since = 0;
+      }
+      if(type == Off) return r;
+
+      float out = 0.0;
+      for(unsigned i = 0; i < impulses; ++i) out += amplitude[i] * at(delay[i]);
+      return out;
+   }
+
+   /// Moves the history by delta, when the position frame is shifted
+   void shift(const float& delta)
+   {
+      for(unsigned i = 0; i < capacity; ++i) history[i] += delta;
+      last += delta;
+   }
+
+   Type kind() const
+   {
+      return type;
+   }
+
+   float frequency() const
+   {
+      return freq;
+   }
+
+   float damping() const
+   {
+      return zeta;
+   }
+
+   /// Ticks a step takes longer through the shaper
+   float duration() const
+   {
+      return delay[impulses - 1];
+   }
+
+   unsigned sampleTicks() const
+   {
+      return stride;
+   }
+
+   /// Whether the shaped setpoint has arrived at the setpoint, no change of
+   /// it is still on its way through the delays. The interpolation between
+   /// samples reaches up to a stride further back.
+   bool settled() const
+   {
+      return type == Off || still >= delay[impulses - 1] + stride;
+   }
+
+private:
+   /// Takes a new stride, resampling the history in place. A longer stride
+   /// reads older samples than it writes, the ring is rewritten from the
+   /// newest sample on; a shorter one reads newer samples, from the oldest.
+   void resample(const unsigned& stride_)
+   {
+      if(stride_ == stride) return;
+      const unsigned since_ = since % stride_;
+      const float oldest = since + (capacity - 1) * stride;
+      for(unsigned k = 0; k < capacity; ++k) {
+         const unsigned j = stride_ > stride ? k : capacity - 1 - k;
+         const float d = since_ + (float)j * stride_;
+         history[(head + capacity - j) % capacity] = at(d < oldest ? d : oldest);
+      }
+      stride = stride_;
+      since = since_;
+   }
+
+   /// Setpoint d ticks ago
+   float at(const float& d) const
+   {
+      if(d <= since) {
+         return since == 0 ? last : last + (history[head] - last) * d / since;
+      }
+      const float x = (d - since) / stride;
+      const unsigned j = (unsigned)x;
+      const float f = x - j;
+      const float a = history[(head + capacity - j) % capacity];
+      const float b = history[(head + capacity - j - 1) % capacity];
+      return a + (b - a) * f;
+   }
+
+   Type type = Off;
+   float freq = 0.0;
+   float zeta = 0.0;
+
+   unsigned impulses = 1;
+   float amplitude[max_impulses] = { 1.0 };
+   float delay[max_impulses] = { 0.0 };     // ticks
+
+   float history[capacity] = { };
+   unsigned head = 0;            // newest sample
+   unsigned stride = 1;          // ticks per sample
+   unsigned since = 0;           // ticks since the newest sample
+   float last = 0.0;             // setpoint of this tick
+   uint32_t still = (uint32_t)-1;   // ticks the setpoint has not changed for
+};
+
+#endif
@@ -0,0 +1,185 @@
+/*
+ * Copyright (C) 2019 Florian Seybold
+ *
+ * This file is subject to the terms and conditions of the GNU Lesser
+ * General Public License v2.1. See the file LICENSE in the top level
+ * directory for more details.
+ */
+
+/**
+ * @ingroup     mechaduino_firmware
+ *
+ * @{
+ * @file
+ * @brief       Iterative learning control for a repeated trajectory
+ *
+ * Keeps a feedforward effort per sample of a trajectory that is run over and
+ * over, a sample being stride ticks. Each pass the loop adds the stored
+ * correction to its effort and hands back the following error; after the
+ * pass the correction becomes
+ *
+ *    c(i) <- Q( c(i) + gain * e(i + lead) )
+ *
+ * with e averaged over the sample, lead samples of delay between effort and
+ * error and Q the zero phase low pass [q/2, 1-q, q/2] that keeps the
+ * learning from amplifying what does not repeat. Sample i is only written
+ * once the pass has used it and has measured the errors up to i + lead + 1,
+ * so the update runs a sample at a time within the pass, a few float
+ * operations per tick, instead of over the whole table at its end.
+ *
+ * A pass starts with begin() and ends after the registered length. Keep
+ * this header free of RIOT includes.
+ *
+ * @author      Florian Seybold <florian@seybold.space>
+ */
+
+#ifndef ITERATIVELEARNING_HPP
+#define ITERATIVELEARNING_HPP
+
+#include <stdint.h>
+#include <cmath>
+
+class IterativeLearning
+{
+public:
+   static const unsigned capacity = 512;     // samples, 2 kB of corrections
+
+   /// Registers a trajectory of length ticks, learnt in samples of at least
+   /// sample_ticks, and clears what was learnt. Fails while a pass runs.
+   bool arm(const uint32_t& length, const unsigned& sample_ticks)
+   {
+      if(running || length == 0 || sample_ticks == 0) return false;
+      stride = (length + capacity - 1) / capacity;
+      if(stride < sample_ticks) stride = sample_ticks;
+      samples = (length + stride - 1) / stride;
+      for(unsigned i = 0; i < samples; ++i) correction[i] = 0.0;
+      passes = 0;
+      first_rms = 0.0;
+      last_rms = 0.0;
+      armed_ = true;
+      return true;
+   }
+
+   void disarm()
+   {
+      armed_ = false;
+      running = false;
+   }
+
+   /// Starts a pass if armed and none runs
+   void begin()
+   {
+      if(!armed_ || running) return;
+      tick = 0;
+      sample = 0;
+      sum = 0.0;
+      clipped = false;
+      square_sum = 0.0;
+      running = true;
+   }
+
+   /// Correction to add to this tick's effort, interpolated between the
+   /// samples
+   float feedforward() const
+   {
+      if(!running) return 0.0;
+      const float c = correction[sample];
+      if(sample + 1 == samples) return c;
+      return c + (correction[sample + 1] - c) * (tick % stride) / stride;
+   }
+
+   /// Takes this tick's following error (deg) and whether the effort was
+   /// saturated, call once per tick after feedforward(). Samples with
+   /// saturated ticks are not learnt from, only filtered.
+   void learn(const float& e, const bool& saturated)
+   {
+      if(!running) return;
+      sum += e;
+      square_sum += e * e;
+      if(saturated) clipped = true;
+      if(++tick % stride != 0) return;
+
+      if(sample >= lead) update(sample - lead, clipped ? 0.0 : sum / stride);
+      sum = 0.0;
+      clipped = false;
+      if(++sample < samples) return;
+
+      for(unsigned i = samples > lead ? samples - lead : 0; i < samples; ++i) update(i, 0.0);  // not measured, only filtered
+      filter(samples, 0.0);
+
+      const float rms = sqrt(square_sum / tick);
+      if(passes++ == 0) first_rms = rms;
+      last_rms = rms;
+      running = false;
+   }
+
+   bool armed() const
+   {
+      return armed_;
+   }
+
+   bool active() const
+   {
+      return running;
+   }
+
+   unsigned length() const
+   {
+      return samples * stride;
+   }
+
+   unsigned sampleTicks() const
+   {
+      return stride;
+   }
+
+   uint32_t passes = 0;
+   float first_rms = 0.0;        // deg, following error of the first pass
+   float last_rms = 0.0;         // deg, of the latest pass
+
+   float gain = 10.0;             // effort per deg of following error
+   float q = 0.5;                // weight of the neighbours in the Q filter
+   unsigned lead = 0;            // samples from effort to error
+   float limit = 50.0;           // largest correction, effort
+
+private:
+   /// Sample i plus the learnt step, then filters the one before it
+   void update(const unsigned& i, const float& e)
+   {
+      float raw = correction[i] + gain * e;
+      if(raw > limit) raw = limit;
+      else if(raw < -limit) raw = -limit;
+      if(i == 0) {
+         raw_1 = raw;       // the filter mirrors at the ends
+         raw_2 = raw;
+      }
+      else {
+         filter(i, raw);
+      }
+   }
+
+   /// Writes sample i-1 from the raw values around it, raw of i is next
+   void filter(const unsigned& i, const float& next)
+   {
+      const float out = 0.5 * q * (raw_2 + (i < samples ? next : raw_1)) + (1.0 - q) * raw_1;
+      raw_2 = raw_1;
+      raw_1 = next;
+      correction[i - 1] = out;
+   }
+
+   float correction[capacity] = { };
+   unsigned stride = 1;
+   unsigned samples = 0;
+   bool armed_ = false;
+   bool running = false;
+
+   uint32_t tick = 0;            // of the pass
+   unsigned sample = 0;
+   float sum = 0.0;              // error over the sample
+   bool clipped = false;         // saturated within the sample
+   float square_sum = 0.0;       // over the pass
+   float raw_1 = 0.0;            // unfiltered new corrections of the last two samples
+   float raw_2 = 0.0;
+};
+
+#endif
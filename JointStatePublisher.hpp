@@ -0,0 +1,202 @@
+/*
+ * Copyright (C) 2019 Florian Seybold
+ *
+ * This file is subject to the terms and conditions of the GNU Lesser
+ * General Public License v2.1. See the file LICENSE in the top level
+ * directory for more details.
+ */
+
+/**
+ * @ingroup     mechaduino_firmware
+ *
+ * @{
+ * @file
+ * @brief       Periodic sensor_msgs/JointState publisher
+ *
+ * Samples Controller::snapshot() at a fixed rate and publishes position
+ * (rad) and velocity (rad/s) on joint_states. The message and its
+ * sequences are allocated once in start() and reused for every publish.
+ *
+ * @author      Florian Seybold <florian@seybold.space>
+ */
+
+#ifndef JOINTSTATEPUBLISHER_HPP
+#define JOINTSTATEPUBLISHER_HPP
+
+#include <rcl/rcl.h>
+#include <sensor_msgs/msg/joint_state.h>
+#include <rosidl_generator_c/primitives_sequence_functions.h>
+#include <rosidl_generator_c/string_functions.h>
+
+#include <thread.h>
+#include <xtimer.h>
+
+#include <stdio.h>
+
+#include "Controller.hpp"
+#include "RosNode.hpp"
+
+#define ENABLE_DEBUG    (0)
+#include "debug.h"
+
+
+class JointStatePublisher
+{
+public:
+   JointStatePublisher(Controller& controller_, RosNode& ros_, const char* joint_, const char& priority_ = THREAD_PRIORITY_MAIN - 1)
+      : controller(controller_),
+        ros(ros_),
+        joint(joint_),
+        priority(priority_)
+   { }
+
+   /// Publishes at rate Hz
+   void start(const uint32_t& rate = 100)
+   {
+      const uint32_t last_period = period;
+      period = 1000000 / (rate > 0 && rate <= 1000 ? rate : 100);
+
+      if(go==true) return;
+
+      // After stop() the thread can still sleep for a period, the new one
+      // must not be created on its stack
+      const uint32_t t0 = xtimer_now_usec();
+      while(threadAlive() && xtimer_now_usec() - t0 < 2*last_period) xtimer_usleep(1000);
+      if(threadAlive()) {
+         puts("[Joint state thread still running]");
+         return;
+      }
+
+      if(!ros.init()) return;
+
+      if(!initialized) {
+         rcl_allocator_t allocator = rcl_get_default_allocator();
+         if(rcl_clock_init(RCL_STEADY_TIME, &clock, &allocator) != RCL_RET_OK) {
+            puts("[Init of joint state clock failed]");
+            return;
+         }
+
+         rcl_publisher_options_t options = rcl_publisher_get_default_options();
+         if(rcl_publisher_init(&publisher, &ros.node, ROSIDL_GET_MSG_TYPE_SUPPORT(sensor_msgs, msg, JointState), "joint_states", &options) != RCL_RET_OK) {
+            puts("[Init of joint state publisher failed]");
+            return;
+         }
+
+         if(!sensor_msgs__msg__JointState__init(&msg)
+            || !rosidl_generator_c__String__Sequence__init(&msg.name, 1)
+            || !rosidl_generator_c__String__assign(&msg.name.data[0], joint)
+            || !rosidl_generator_c__double__Sequence__init(&msg.position, 1)
+            || !rosidl_generator_c__double__Sequence__init(&msg.velocity, 1)) {
+            puts("[Init of joint state message failed]");
+            return;
+         }
+
+         initialized = true;
+      }
+
+      resetStats();
+      go=true;
+
+      pid = thread_create(thread_stack, sizeof(thread_stack),
+         priority,
+         THREAD_CREATE_STACKTEST,
+         [](void* arg)->void*{ return ((JointStatePublisher*)arg)->run(); },
+         (void*)this,
+         "jointstates");
+
+      DEBUG("JointStatePublisher::start(): Created thread %i...\n", pid);
+   }
+
+   void stop()
+   {
+      go=false;
+   }
+
+   void printStats() const
+   {
+      printf("joint states: %s, period=%lu us, published=%lu, failed=%lu, late=%lu, stale=%lu\n",
+         go ? "running" : "stopped", (unsigned long)period, (unsigned long)published, (unsigned long)failed,
+         (unsigned long)late, (unsigned long)stale);
+      printf("publish latency: mean=%lu us, max=%lu us\n",
+         (unsigned long)(published ? latency_sum / published : 0), (unsigned long)latency_max);
+   }
+
+   void resetStats()
+   {
+      published = failed = late = stale = 0;
+      latency_sum = 0;
+      latency_max = 0;
+   }
+
+private:
+   /// Whether the thread of an earlier start() has not exited yet, see
+   /// ActionServer::threadAlive()
+   bool threadAlive() const
+   {
+      const char* t = pid != KERNEL_PID_UNDEF ? (const char*)thread_get(pid) : NULL;
+      return t >= thread_stack && t < thread_stack + sizeof(thread_stack);
+   }
+
+   void* run()
+   {
+      DEBUG("JointStatePublisher::run(): Entering...\n");
+
+      uint32_t last_tick = controller.snapshot().tick;
+      xtimer_ticks32_t last_wakeup = xtimer_now();
+      while(go)
+      {
+         xtimer_periodic_wakeup(&last_wakeup, period);
+         const uint32_t wakeup = xtimer_now_usec();
+         if(wakeup - xtimer_usec_from_ticks(last_wakeup) > period) ++late;   // a whole period behind
+
+         const Controller::Snapshot s = controller.snapshot();
+         if(s.tick == last_tick) ++stale;   // control loop not running or starved
+         last_tick = s.tick;
+
+         rcl_time_point_value_t now = 0;
+         rcl_clock_get_now(&clock, &now);
+         msg.header.stamp.sec = RCL_NS_TO_S(now);
+         msg.header.stamp.nanosec = now % 1000000000;
+         msg.position.data[0] = s.position * deg2rad;
+         msg.velocity.data[0] = s.velocity * deg2rad;
+
+         if(rcl_publish(&publisher, &msg, NULL) != RCL_RET_OK) {
+            ++failed;
+            continue;
+         }
+
+         const uint32_t latency = xtimer_now_usec() - wakeup;
+         ++published;
+         latency_sum += latency;
+         if(latency > latency_max) latency_max = latency;
+      }
+
+      return NULL;
+   }
+
+   static constexpr double deg2rad = 3.14159265358979323846 / 180.0;
+
+   Controller& controller;
+   RosNode& ros;
+   const char* joint;
+   const char priority;
+
+   char thread_stack[2*THREAD_STACKSIZE_DEFAULT+THREAD_EXTRA_STACKSIZE_PRINTF];
+   bool go = false;
+   kernel_pid_t pid = KERNEL_PID_UNDEF;
+   bool initialized = false;
+   uint32_t period = 10000;
+
+   rcl_clock_t clock;
+   rcl_publisher_t publisher = rcl_get_zero_initialized_publisher();
+   sensor_msgs__msg__JointState msg;
+
+   uint32_t published = 0;
+   uint32_t failed = 0;
+   uint32_t late = 0;           // wakeups more than a period behind schedule
+   uint32_t stale = 0;          // no control tick since the last publish
+   uint64_t latency_sum = 0;    // us from wakeup to rcl_publish() returning
+   uint32_t latency_max = 0;
+};
+
+#endif
@@ -0,0 +1,156 @@
+/*
+ * Copyright (C) 2019 Florian Seybold
+ *
+ * This file is subject to the terms and conditions of the GNU Lesser
+ * General Public License v2.1. See the file LICENSE in the top level
+ * directory for more details.
+ */
+
+/**
+ * @ingroup     mechaduino_firmware
+ *
+ * @{
+ * @file
+ * @brief       Encoder lookup table generation from full step readings
+ *
+ * Shared between Encoder::calibrate() and the host side generator in
+ * tools/, so both produce the same table from the same readings. Keep this
+ * header free of RIOT includes.
+ *
+ * @author      Florian Seybold <florian@seybold.space>
+ */
+
+#ifndef LOOKUPBUILDER_HPP
+#define LOOKUPBUILDER_HPP
+
+#include <stdint.h>
+
+/// Raw calibration capture as streamed by 'calibrate capture' (little endian):
+/// header, spr averaged readings (int16_t), spr reading spreads (uint16_t),
+/// crc32 over everything before it.
+struct CalibrationFrameHeader {
+   uint32_t magic;
+   uint16_t version;
+   uint16_t spr;
+   uint16_t cpr;
+   uint16_t avg;      // readings averaged per full step
+};
+
+static const uint32_t calibration_frame_magic = 0x5041434d;   // "MCAP"
+static const uint16_t calibration_frame_version = 1;
+
+class LookupBuilder
+{
+public:
+   LookupBuilder(const int& spr_, const int& cpr_)
+      : spr(spr_),
+        cpr(cpr_),
+        aps(360.0/ spr_)
+   { }
+
+   /// Interpolates between full steps and hands one calibrated angle per
+   /// encoder count (in count order, starting at count 0) to store_lookup.
+   template<typename Sink>
+   void build(const int* fullStepReadings, Sink& store_lookup) const
+   {
+      int iStart = 0;     //encoder zero position index
+      int jStart = 0;
+      int stepNo = 0;
+      int ticks = 0;
+
+      // "ticks" represents the number of encoder counts between successive steps... these should be around 82 for a 1.8 degree stepper
+      for (int i = 0; i < spr; i++) {
+         ticks = fullStepReadings[mod((i + 1), spr)] - fullStepReadings[mod((i), spr)];
+         if (ticks < -15000) {
+            ticks += cpr;
+
+         }
+         else if (ticks > 15000) {
+            ticks -= cpr;
+         }
+
+         if (ticks > 1) {                                    //note starting point with iStart,jStart
+            for (int j = 0; j < ticks; j++) {
+               stepNo = (mod(fullStepReadings[i] + j, cpr));
+               if (stepNo == 0) {
+                  iStart = i;
+                  jStart = j;
+               }
+
+            }
+         }
+
+         if (ticks < 1) {                                    //note starting point with iStart,jStart
+            for (int j = -ticks; j > 0; j--) {
+               stepNo = (mod(fullStepReadings[spr - 1 - i] + j, cpr));
+               if (stepNo == 0) {
+                  iStart = i;
+                  jStart = j;
+               }
+
+            }
+         }
+
+      }
+
+      for (int i = iStart; i < (iStart + spr + 1); i++) {
+         ticks = fullStepReadings[mod((i + 1), spr)] - fullStepReadings[mod((i), spr)];
+
+         if (ticks < -15000) {           //check if current interval wraps over encoder's zero positon
+            ticks += cpr;
+         }
+         else if (ticks > 15000) {
+            ticks -= cpr;
+         }
+
+         //Here we store an interpolated angle corresponding to each encoder count (in order)
+         if (ticks > 1) {              //if encoder counts were increasing during cal routine...
+            if (i == iStart) { //this is an edge case
+               for (int j = jStart; j < ticks; j++) {
+                  store_lookup(0.001 * mod(1000 * ((aps * i) + ((aps * j ) / float(ticks))), 360000.0));
+               }
+            }
+
+            else if (i == (iStart + spr)) { //this is an edge case
+               for (int j = 0; j < jStart; j++) {
+                  store_lookup(0.001 * mod(1000 * ((aps * i) + ((aps * j ) / float(ticks))), 360000.0));
+               }
+            }
+            else {                        //this is the general case
+               for (int j = 0; j < ticks; j++) {
+                  store_lookup(0.001 * mod(1000 * ((aps * i) + ((aps * j ) / float(ticks))), 360000.0));
+               }
+            }
+         }
+
+         else if (ticks < 1) {             //similar to above... for case when encoder counts were decreasing during cal routine
+            if (i == iStart) {
+               for (int j = - ticks; j > (jStart); j--) {
+                  store_lookup(0.001 * mod(1000 * (aps * (i) + (aps * ((ticks + j)) / float(ticks))), 360000.0));
+               }
+            }
+            else if (i == iStart + spr) {
+               for (int j = jStart; j > 0; j--) {
+                  store_lookup(0.001 * mod(1000 * (aps * (i) + (aps * ((ticks + j)) / float(ticks))), 360000.0));
+               }
+            }
+            else {
+               for (int j = - ticks; j > 0; j--) {
+                  store_lookup(0.001 * mod(1000 * (aps * (i) + (aps * ((ticks + j)) / float(ticks))), 360000.0));
+               }
+            }
+         }
+      }
+   }
+
+private:
+   int mod(int xMod, int mMod) const {
+      return (xMod % mMod + mMod) % mMod;
+   }
+
+   const int spr;
+   const int cpr;
+   const float aps;       // angle per step, same rounding as Motor::aps
+};
+
+#endif
@@ -0,0 +1,68 @@
+/*
+ * Copyright (C) 2019 Florian Seybold
+ *
+ * This file is subject to the terms and conditions of the GNU Lesser
+ * General Public License v2.1. See the file LICENSE in the top level
+ * directory for more details.
+ */
+
+/**
+ * @ingroup     mechaduino_firmware
+ *
+ * @{
+ * @file
+ * @brief       RAM, flash and stack budget report
+ *
+ * Prints the size of each firmware object, of the tables in flash and
+ * the stack high-water mark of every thread, measured from the fill
+ * pattern THREAD_CREATE_STACKTEST leaves. The stack part needs DEVELHELP
+ * (build with MEMREPORT=1), which keeps a thread's name and stack bounds.
+ *
+ * @author      Florian Seybold <florian@seybold.space>
+ */
+
+#ifndef MEMREPORT_HPP
+#define MEMREPORT_HPP
+
+#include <stdio.h>
+#include <stddef.h>
+
+#include <thread.h>
+
+class MemReport
+{
+public:
+   struct Entry {
+      const char* name;
+      size_t bytes;
+   };
+
+   /// One block of entries with its total
+   static void print(const char* title, const Entry* entries, const unsigned& n)
+   {
+      size_t total = 0;
+      printf("%s:\n", title);
+      for(unsigned i = 0; i < n; ++i) {
+         printf("   %-24s %8u\n", entries[i].name, (unsigned)entries[i].bytes);
+         total += entries[i].bytes;
+      }
+      printf("   %-24s %8u\n", "total", (unsigned)total);
+   }
+
+   static void printStacks()
+   {
+#ifdef DEVELHELP
+      printf("thread stacks:\n   %-24s %8s %8s %8s\n", "", "size", "used", "free");
+      for(kernel_pid_t pid = KERNEL_PID_FIRST; pid <= KERNEL_PID_LAST; ++pid) {
+         const thread_t* t = (const thread_t*)thread_get(pid);
+         if(!t) continue;
+         const unsigned free = thread_measure_stack_free(t->stack_start);
+         printf("   %-24s %8u %8u %8u\n", t->name, (unsigned)t->stack_size, (unsigned)t->stack_size - free, free);
+      }
+#else
+      puts("thread stacks: no high-water marks without DEVELHELP, build with MEMREPORT=1");
+#endif
+   }
+};
+
+#endif
@@ -0,0 +1,99 @@
+/*
+ * Copyright (C) 2019 Florian Seybold
+ *
+ * This file is subject to the terms and conditions of the GNU Lesser
+ * General Public License v2.1. See the file LICENSE in the top level
+ * directory for more details.
+ */
+
+/**
+ * @ingroup     mechaduino_firmware
+ *
+ * @{
+ * @file
+ * @brief       Microbenchmarks of the control loop's hot path functions
+ *
+ * Each function is called in batches, every batch is timed with
+ * CycleCounter and yields one per call figure. The mean, standard deviation
+ * and minimum over the batches are reported. The empty loop is measured as
+ * well, its time is included in every other figure.
+ *
+ * Shared by the 'microbench' shell command and bench/microbench on the host.
+ * Motor::output() is called with zero effort, the coils stay off.
+ *
+ * @author      Florian Seybold <florian@seybold.space>
+ */
+
+#ifndef MICROBENCH_HPP
+#define MICROBENCH_HPP
+
+#include <stdio.h>
+#include <math.h>
+
+#include "CycleCounter.hpp"
+#include "Motor.hpp"
+#include "Encoder.hpp"
+
+class Microbench
+{
+public:
+   struct Stats {
+      unsigned batches;
+      float mean;          // CycleCounter units per call
+      float stddev;
+      float min;
+   };
+
+   /// Times f(i) for i in [0, calls) in each of batches batches
+   template<typename F>
+   static Stats measure(F f, const unsigned& calls, const unsigned& batches)
+   {
+      Stats s = { 0, 0.0, 0.0, 0.0 };
+      float m2 = 0.0;
+      for(unsigned b = 0; b < batches; ++b) {
+         const uint32_t t0 = CycleCounter::now();
+         for(unsigned i = 0; i < calls; ++i) {
+            f(i);
+            __asm__ volatile("" ::: "memory");   // no merging of calls across iterations
+         }
+         const float per_call = (float)CycleCounter::elapsed(t0) / calls;
+
+         // Welford's running mean and variance
+         ++s.batches;
+         const float delta = per_call - s.mean;
+         s.mean += delta / s.batches;
+         m2 += delta * (per_call - s.mean);
+         if(b == 0 || per_call < s.min) s.min = per_call;
+      }
+      s.stddev = s.batches > 1 ? sqrt(m2 / (s.batches - 1)) : 0.0;
+      return s;
+   }
+
+   static void print(const char* name, const Stats& s)
+   {
+      printf("%-16s %10.2f %10.2f %10.2f %s/call\n", name, s.mean, s.stddev, s.min, CycleCounter::unit());
+   }
+
+   static void printHeader()
+   {
+      printf("%-16s %10s %10s %10s\n", "function", "mean", "stddev", "min");
+   }
+
+   /// Runs the standard set, calls per batch times batches calls each
+   static void run(const Motor& motor, const Encoder& encoder, const unsigned& calls, const unsigned& batches)
+   {
+      CycleCounter::init();
+      printHeader();
+
+      print("empty", measure([](const unsigned& i) { sink = i; }, calls, batches));
+      print("Motor::mod", measure([&motor](const unsigned& i) { sink = motor.mod(i * 37 - 1800, 3600); }, calls, batches));
+      print("Motor::output", measure([&motor](const unsigned& i) { motor.output(i * 0.37f, 0); }, calls, batches));
+      print("Encoder::angle", measure([&encoder](const unsigned& i) { sink = encoder.angle((int16_t)((i * 4099) & 0x3fff)); }, calls, batches));
+   }
+
+   static volatile float sink;   // keeps the results alive
+};
+
+volatile float Microbench::sink = 0.0;
+
+#endif
@@ -0,0 +1,176 @@
+/*
+ * Copyright (C) 2019 Florian Seybold
+ *
+ * This file is subject to the terms and conditions of the GNU Lesser
+ * General Public License v2.1. See the file LICENSE in the top level
+ * directory for more details.
+ */
+
+/**
+ * @ingroup     mechaduino_firmware
+ *
+ * @{
+ * @file
+ * @brief       Queue of motion segments run back to back, with look-ahead
+ *
+ * Each segment is a move to an absolute target with its own velocity and
+ * acceleration limits. plan() gives every segment the highest end velocity
+ * from which all segments queued after it can still be run within their
+ * limits, ending the last one at standstill (backward pass as in grbl's
+ * planner). Consecutive segments in the same direction thus blend at speed,
+ * a reversal or an empty queue brings the axis to a stop.
+ *
+ * The segment being run stays in the plan, its end velocity rises when
+ * segments are queued behind it in time. A push that finds the queue empty
+ * while the running segment already slows down to stop counts as an
+ * underrun: it came too late to blend.
+ *
+ * The caller synchronizes, Controller pushes with interrupts disabled and
+ * plans and pops in the control loop.
+ *
+ * @author      Florian Seybold <florian@seybold.space>
+ */
+
+#ifndef MOTIONQUEUE_HPP
+#define MOTIONQUEUE_HPP
+
+#include <stdint.h>
+#include <cmath>
+
+class MotionQueue
+{
+public:
+   struct Segment {
+      float target;        // deg, absolute
+      float vmax;          // deg/s
+      float amax;          // deg/s^2
+      float vend;          // deg/s, planned end velocity (magnitude)
+   };
+
+   struct Stats {
+      uint32_t queued;
+      uint32_t executed;
+      uint32_t underruns;
+      unsigned max_depth;
+   };
+
+   static const unsigned capacity = 16;
+
+   /// Appends a segment, fails when full. stopping tells whether the running
+   /// segment has begun to decelerate to a stop at its target.
+   bool push(const float& target, const float& vmax, const float& amax, const bool& stopping)
+   {
+      if(count == capacity) return false;
+      if(count == 0 && running && stopping) ++stats.underruns;
+
+      segments[(head + count) % capacity] = { target, vmax, amax, 0.0 };
+      ++count;
+      ++stats.queued;
+      if(count > stats.max_depth) stats.max_depth = count;
+      dirty = true;
+      return true;
+   }
+
+   /// Takes the next segment to run, which starts at start (deg)
+   bool pop(Segment& s, const float& start)
+   {
+      if(count == 0) return false;
+      s = segments[head];
+      head = (head + 1) % capacity;
+      --count;
+      current = s;
+      current_start = start;
+      running = true;
+      ++stats.executed;
+      return true;
+   }
+
+   /// The running segment has ended
+   void done()
+   {
+      running = false;
+   }
+
+   /// Drops all queued segments, the running one is stopped by the caller
+   void clear()
+   {
+      count = 0;
+      running = false;
+      dirty = false;
+   }
+
+   /// Recomputes the end velocities after a push, from is where the first
+   /// queued segment starts when none is running. Returns the running
+   /// segment's new end velocity.
+   float plan(const float& from)
+   {
+      dirty = false;
+      const unsigned n = count;
+
+      float vnext = 0.0;               // highest entry velocity of the segment after
+      float next_dir = 0.0;
+      for(unsigned k = n; k > 0; --k) {
+         Segment& s = segments[(head + k - 1) % capacity];
+         const float start = k > 1 ? segments[(head + k - 2) % capacity].target : (running ? current.target : from);
+         const float dir = direction(s.target - start);
+         s.vend = (dir != 0.0 && dir == next_dir) ? limit(vnext, s.vmax) : 0.0;
+         vnext = limit(sqrt(s.vend * s.vend + 2.0 * s.amax * fabs(s.target - start)), s.vmax);
+         next_dir = dir;
+      }
+
+      if(!running) return 0.0;
+      const float dir = direction(current.target - current_start);
+      current.vend = (dir != 0.0 && dir == next_dir) ? limit(vnext, current.vmax) : 0.0;
+      return current.vend;
+   }
+
+   bool pending() const
+   {
+      return count > 0;
+   }
+
+   bool replan() const
+   {
+      return dirty;
+   }
+
+   bool active() const
+   {
+      return running || count > 0;
+   }
+
+   /// A segment is running, the next one continues at its velocity
+   bool chained() const
+   {
+      return running;
+   }
+
+   unsigned depth() const
+   {
+      return count;
+   }
+
+   Stats stats = { 0, 0, 0, 0 };
+
+private:
+   static float direction(const float& d)
+   {
+      return d > 0.0 ? 1.0 : (d < 0.0 ? -1.0 : 0.0);
+   }
+
+   static float limit(const float& v, const float& vmax)
+   {
+      return v < vmax ? v : vmax;
+   }
+
+   Segment segments[capacity];
+   unsigned head = 0;
+   volatile unsigned count = 0;
+   volatile bool dirty = false;
+
+   Segment current = { 0.0, 0.0, 0.0, 0.0 };
+   float current_start = 0.0;
+   volatile bool running = false;
+};
+
+#endif
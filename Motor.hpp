@@ -33,7 +33,14 @@
 #define ledPin  ARDUINO_PIN_13
 #define chipSelectPin ARDUINO_PIN_A2 //output to chip select
 
+#ifndef MECHADUINO_SIM
 #include <periph/pwm.h>
+#else
+#include <xtimer.h>
+#include <irq.h>
+
+#include "Plant.hpp"
+#endif
 
 #define ENABLE_DEBUG    (0)
 #include "debug.h"
@@ -46,6 +53,7 @@ public:
    {
       DEBUG("Initializing motor...\n");
 
+#ifndef MECHADUINO_SIM
       gpio_init(IN_4, GPIO_OUT);
       gpio_init(IN_3, GPIO_OUT);
       gpio_init(IN_2, GPIO_OUT);
@@ -60,13 +68,23 @@ public:
       gpio_clear(IN_3);
       gpio_set(IN_2);
       gpio_clear(IN_1);
+#else
+      drive(0.33 * uMax, 0.33 * uMax);
+#endif
    }
 
    int mod(int xMod, int mMod) const {
       return (xMod % mMod + mMod) % mMod;
    }
 
-   void output(const float& theta, const int& effort) const
+   /// Coil voltages, signed, in PWM counts
+   struct Phases {
+      int A;
+      int B;
+   };
+
+   /// Commutation: the coil voltages for electrical angle theta and magnitude effort
+   Phases commutate(const float& theta, const int& effort) const
    {
       const int phase_multiplier = 10 * spr / 4;
 
@@ -80,10 +98,17 @@ public:
       int v_coil_B = ((effort * sin_coil_B) / 1024);
       //DEBUG("Compute angle_1=%i, angle_2=%i, sin_coil_A=%i, sin_coil_B=%i, v_coil_A=%i, v_coil_B=%i\n", angle_1, angle_2, sin_coil_A, sin_coil_B, v_coil_A, v_coil_B);
 
-      pwm_set(PWM_DEV(1), 0, abs(v_coil_A)); //VREF_1
-      pwm_set(PWM_DEV(0), 0, abs(v_coil_B)); //VREF_2
+      return { v_coil_A, v_coil_B };
+   }
+
+   /// Writes the coil voltages to the driver (PWM and direction pins)
+   void apply(const Phases& v) const
+   {
+#ifndef MECHADUINO_SIM
+      pwm_set(PWM_DEV(1), 0, abs(v.A)); //VREF_1
+      pwm_set(PWM_DEV(0), 0, abs(v.B)); //VREF_2
 
-      if (v_coil_A >= 0)  {
+      if (v.A >= 0)  {
          gpio_set(IN_2);  //REG_PORT_OUTSET0 = PORT_PA21;     //write IN_2 HIGH
          gpio_clear(IN_1);   //REG_PORT_OUTCLR0 = PORT_PA06;     //write IN_1 LOW
       }
@@ -92,7 +117,7 @@ public:
          gpio_set(IN_1);  //REG_PORT_OUTSET0 = PORT_PA06;     //write IN_1 HIGH
       }
 
-      if (v_coil_B >= 0)  {
+      if (v.B >= 0)  {
          gpio_set(IN_4);  //REG_PORT_OUTSET0 = PORT_PA20;     //write IN_4 HIGH
          gpio_clear(IN_3);   //REG_PORT_OUTCLR0 = PORT_PA15;     //write IN_3 LOW
       }
@@ -100,19 +125,52 @@ public:
          gpio_clear(IN_4);     //REG_PORT_OUTCLR0 = PORT_PA20;     //write IN_4 LOW
          gpio_set(IN_3);    //REG_PORT_OUTSET0 = PORT_PA15;     //write IN_3 HIGH
       }
+#else
+      drive(v.A, v.B);
+#endif
+   }
+
+   void output(const float& theta, const int& effort) const
+   {
+      apply(commutate(theta, effort));
+   }
+
+   /// Sets the peak phase current in A (iMax parameter) and with it uMax
+   void setCurrentLimit(const float& iMax_)
+   {
+      iMax = iMax_;
+      uMax = (int)((255.0/3.3)*(iMax*10.0*rSense));
    }
 
    const int spr = 200;                // 200 steps per revolution  -- for 400 step/rev, you should only need to edit this value
-   const int uMax = (int)((255.0/3.3)*(iMax*10.0*rSense));   // 255 for 8-bit pwm, 1023 for 10 bit, must also edit analogFastWrite
    const float aps = 360.0/ spr;       // angle per step
 
 private:
-   const float iMax = 1.0;             // Be careful adjusting this.  While the A4954 driver is rated for 2.0 Amp peak currents, it cannot handle these currents continuously.  Depending on how you operate the Mechaduino, you may be able to safely raise this value...please refer to the A4954 datasheet for more info
+   float iMax = 1.0;             // Be careful adjusting this.  While the A4954 driver is rated for 2.0 Amp peak currents, it cannot handle these currents continuously.  Depending on how you operate the Mechaduino, you may be able to safely raise this value...please refer to the A4954 datasheet for more info
    const float rSense = 0.150;
 
+public:
+   int uMax = (int)((255.0/3.3)*(iMax*10.0*rSense));   // 255 for 8-bit pwm, 1023 for 10 bit, must also edit analogFastWrite
+
    static const int sin_1[];
+
+#ifdef MECHADUINO_SIM
+   static Plant plant;           // stands in for the driver, the motor and its load
+
+private:
+   void drive(const int& v_coil_A, const int& v_coil_B) const
+   {
+      const unsigned state = irq_disable();
+      plant.drive(xtimer_now_usec64(), v_coil_A, v_coil_B);
+      irq_restore(state);
+   }
+#endif
 };
 
+#ifdef MECHADUINO_SIM
+Plant Motor::plant;
+#endif
+
 const int Motor::sin_1[] = {
     +0,    +2,    +4,    +5,    +7,    +9,   +11,   +13,   +14,   +16,
    +18,   +20,   +21,   +23,   +25,   +27,   +29,   +30,   +32,   +34,
@@ -0,0 +1,281 @@
+/*
+ * Copyright (C) 2019 Florian Seybold
+ *
+ * This file is subject to the terms and conditions of the GNU Lesser
+ * General Public License v2.1. See the file LICENSE in the top level
+ * directory for more details.
+ */
+
+/**
+ * @ingroup     mechaduino_firmware
+ *
+ * @{
+ * @file
+ * @brief       Runtime parameter registry, persisted in one flash page
+ *
+ * ParamValues is the single copy of the tunable parameters. Shell and
+ * protocol change them through set(), which bumps a change counter; the
+ * control loop picks changes up at the start of its next tick. save()
+ * writes the values with a layout version and crc to a dedicated flash
+ * page, load() restores them at boot and falls back to the defaults if
+ * the page is blank, corrupt or from another layout.
+ *
+ * @author      Florian Seybold <florian@seybold.space>
+ */
+
+#ifndef PARAMS_HPP
+#define PARAMS_HPP
+
+#include <periph/flashpage.h>
+#include <irq.h>
+#include <xtimer.h>
+
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "Crc.hpp"
+#include "ScratchArena.hpp"
+
+#define ENABLE_DEBUG    (0)
+#include "debug.h"
+
+struct ParamValues {
+   float Fs;            // control loop sample frequency in Hz
+   float pKp;           // position loop gains
+   float pKi;
+   float pKd;
+   float pLPF;          // D term low pass break frequency in Hz
+   float vKp;           // velocity loop gains
+   float vKi;
+   float vKd;
+   float vLPF;          // velocity low pass break frequency in Hz
+   float iMax;          // peak phase current in A
+   int32_t max_jump;    // encoder counts per tick beyond the prediction
+   int32_t max_rejects; // encoder samples replaced in a row before resync or fault
+};
+
+struct ParamDesc {
+   enum Type { Float, Int };
+
+   const char* name;
+   Type type;
+   size_t offset;
+   float min;
+   float max;
+
+   bool accepts(const float& value) const
+   {
+      return value >= min && value <= max;
+   }
+};
+
+class Params
+{
+   struct Record {
+      uint32_t magic;
+      uint16_t layout;
+      uint16_t size;
+      ParamValues values;
+      uint32_t crc;
+   };
+
+   union Page {
+      Record rec;
+      uint8_t raw[FLASHPAGE_SIZE];
+   };
+
+public:
+   Params()
+      : values(defaults)
+   { }
+
+   /// Restores the saved values, returns false (keeping the defaults) if the
+   /// page holds no valid record of this layout
+   bool load()
+   {
+      const uint32_t t0 = xtimer_now_usec();
+      const Record& rec = record();
+      const bool ok = rec.magic == magic && rec.layout == layout && rec.size == sizeof(ParamValues)
+         && rec.crc == crc32(&rec, offsetof(Record, crc));
+      if(ok) {
+         unsigned state = irq_disable();
+         values = rec.values;
+         ++changes;
+         irq_restore(state);
+      }
+      load_time = xtimer_now_usec() - t0;
+      loaded = ok;
+      return ok;
+   }
+
+   /// Writes the current values to flash, skipped if the page already holds them
+   bool save()
+   {
+      static_assert(sizeof(Record) <= FLASHPAGE_SIZE, "parameter record exceeds one flash page");
+
+      ScratchArena::Lease scratch("param save");
+      Page* page = scratch.alloc<Page>(1);
+      if(!page) return false;
+      memset(page->raw, 0xff, sizeof(page->raw));
+      Record& rec = page->rec;
+      rec.magic = magic;
+      rec.layout = layout;
+      rec.size = sizeof(ParamValues);
+      rec.values = get();
+      rec.crc = crc32(&rec, offsetof(Record, crc));
+
+      const int number = flashpage_page((void*)&record());
+      if(flashpage_verify(number, page->raw) == FLASHPAGE_OK) return true;
+      flashpage_write(number, page->raw);
+      return flashpage_verify(number, page->raw) == FLASHPAGE_OK;
+   }
+
+   /// Returns to the compiled in defaults, the flash page is kept until save()
+   void reset()
+   {
+      unsigned state = irq_disable();
+      values = defaults;
+      ++changes;
+      irq_restore(state);
+   }
+
+   /// Consistent copy of all values
+   ParamValues get() const
+   {
+      unsigned state = irq_disable();
+      const ParamValues v = values;
+      irq_restore(state);
+      return v;
+   }
+
+   /// Counts changes, compare with a previous count to see if get() differs
+   uint32_t version() const
+   {
+      return changes;
+   }
+
+   static const ParamDesc* find(const char* name)
+   {
+      for(const ParamDesc& d : table)
+         if(strcmp(d.name, name) == 0) return &d;
+      return NULL;
+   }
+
+   /// Sets a parameter within its range, applied by the control loop at its next tick
+   bool set(const ParamDesc& d, const float& value)
+   {
+      if(!d.accepts(value)) return false;
+
+      unsigned state = irq_disable();
+      store(d, value);
+      ++changes;
+      irq_restore(state);
+      return true;
+   }
+
+   /// Sets n parameters as one change, all of them or, if any is out of
+   /// range, none, so the control loop never runs with only some applied
+   bool set(const ParamDesc* const* d, const float* value, const unsigned& n)
+   {
+      for(unsigned i = 0; i < n; ++i)
+         if(!d[i]->accepts(value[i])) return false;
+
+      unsigned state = irq_disable();
+      for(unsigned i = 0; i < n; ++i) store(*d[i], value[i]);
+      ++changes;
+      irq_restore(state);
+      return true;
+   }
+
+   bool set(const char* name, const char* text)
+   {
+      const ParamDesc* d = find(name);
+      if(!d) return false;
+      char* end;
+      const float value = d->type == ParamDesc::Float ? strtof(text, &end) : strtol(text, &end, 0);
+      return *end == '\0' && set(*d, value);
+   }
+
+   void print(const ParamDesc& d) const
+   {
+      const ParamValues v = get();
+      const uint8_t* p = (const uint8_t*)&v + d.offset;
+      if(d.type == ParamDesc::Float) printf("%s = %f [%g, %g]\n", d.name, *(const float*)p, d.min, d.max);
+      else printf("%s = %li [%g, %g]\n", d.name, (long)*(const int32_t*)p, d.min, d.max);
+   }
+
+   void printAll() const
+   {
+      for(const ParamDesc& d : table) print(d);
+   }
+
+   /// Flash taken by the stored record's page
+   static size_t flashBytes()
+   {
+      return sizeof(stored);
+   }
+
+   void printInfo() const
+   {
+      printf("parameters: %s, boot load took %lu us\n", loaded ? "loaded from flash" : "defaults", (unsigned long)load_time);
+   }
+
+private:
+   /// Writes one value, with interrupts disabled
+   void store(const ParamDesc& d, const float& value)
+   {
+      uint8_t* p = (uint8_t*)&values + d.offset;
+      if(d.type == ParamDesc::Float) *(float*)p = value;
+      else *(int32_t*)p = (int32_t)value;
+   }
+
+   /// The page the record lives in, laundered so the blank initializer is
+   /// not folded into reads
+   static const Record& record()
+   {
+      const Record* p = &stored.rec;
+      __asm__ ("" : "+r" (p));
+      return *p;
+   }
+
+   static const uint32_t magic = 0x4d505250;    // "PRPM"
+   static const uint16_t layout = 1;            // bump when ParamValues changes
+   static const ParamValues defaults;
+   static const unsigned count = 12;
+   static const ParamDesc table[count];
+   static const Page stored;
+
+   ParamValues values;
+   volatile uint32_t changes = 0;
+   uint32_t load_time = 0;
+   bool loaded = false;
+};
+
+const ParamValues Params::defaults = {
+   2000.0,                    // Fs
+   15.0, 0.2, 250.0, 30.0,    // pKp, pKi, pKd, pLPF
+   0.001, 0.001, 0.0, 100.0,  // vKp, vKi, vKd, vLPF
+   1.0,                       // iMax, the A4954 handles 2.0 A peak but not continuously
+   400, 8                     // max_jump, max_rejects
+};
+
+const ParamDesc Params::table[Params::count] = {
+   { "Fs",          ParamDesc::Float, offsetof(ParamValues, Fs),          500.0, 6500.0 },
+   { "pKp",         ParamDesc::Float, offsetof(ParamValues, pKp),         0.0, 1000.0 },
+   { "pKi",         ParamDesc::Float, offsetof(ParamValues, pKi),         0.0, 100.0 },
+   { "pKd",         ParamDesc::Float, offsetof(ParamValues, pKd),         0.0, 10000.0 },
+   { "pLPF",        ParamDesc::Float, offsetof(ParamValues, pLPF),        1.0, 1000.0 },
+   { "vKp",         ParamDesc::Float, offsetof(ParamValues, vKp),         0.0, 100.0 },
+   { "vKi",         ParamDesc::Float, offsetof(ParamValues, vKi),         0.0, 100.0 },
+   { "vKd",         ParamDesc::Float, offsetof(ParamValues, vKd),         0.0, 100.0 },
+   { "vLPF",        ParamDesc::Float, offsetof(ParamValues, vLPF),        1.0, 1000.0 },
+   { "iMax",        ParamDesc::Float, offsetof(ParamValues, iMax),        0.0, 2.0 },
+   { "max_jump",    ParamDesc::Int,   offsetof(ParamValues, max_jump),    1.0, 8192.0 },
+   { "max_rejects", ParamDesc::Int,   offsetof(ParamValues, max_rejects), 0.0, 1000.0 },
+};
+
+const Params::Page __attribute__((__aligned__(FLASHPAGE_SIZE))) Params::stored = { };
+
+#endif
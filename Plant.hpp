@@ -0,0 +1,301 @@
+/*
+ * Copyright (C) 2019 Florian Seybold
+ *
+ * This file is subject to the terms and conditions of the GNU Lesser
+ * General Public License v2.1. See the file LICENSE in the top level
+ * directory for more details.
+ */
+
+/**
+ * @ingroup     mechaduino_firmware
+ *
+ * @{
+ * @file
+ * @brief       Simulated motor, load and encoder for native builds
+ *
+ * Two-phase hybrid stepper driven by the A4954 in current mode, with rotor
+ * and load inertia, Coulomb and viscous friction, detent torque, an
+ * external load torque and optional hard stops at the ends of the travel.
+ * The load is rigidly coupled unless a belt stiffness is set, then it is a
+ * second inertia on a spring and damper, ringing after fast changes.
+ * Motor::output() feeds the coil duties and the simulated AS5047D in
+ * Encoder samples the rotor angle.
+ *
+ * The model is integrated up to the time passed in by the caller, so it runs
+ * in real time on the xtimer clock and faster than real time on a virtual
+ * one. Keep this header free of RIOT includes.
+ *
+ * Angles are in the frame of the encoder lookup table: the rotor settles at
+ * angle y for a commanded electrical angle of -50*y, as in Controller.
+ *
+ * @author      Florian Seybold <florian@seybold.space>
+ */
+
+#ifndef PLANT_HPP
+#define PLANT_HPP
+
+#include <stdint.h>
+#include <stdio.h>
+#include <cmath>
+
+class Plant
+{
+public:
+   /// Drives the coils from time now (us) on. The duties are signed: VREF_1
+   /// duty with the polarity of IN_1/IN_2 for coil A, VREF_2 and IN_3/IN_4
+   /// for coil B.
+   void drive(const uint64_t& now, const int& duty_A, const int& duty_B)
+   {
+      advance(now);
+      iref_A = duty_A * amps_per_duty;
+      iref_B = duty_B * amps_per_duty;
+   }
+
+   /// Encoder count the AS5047D reports at time now (us)
+   int16_t count(const uint64_t& now)
+   {
+      advance(now);
+
+      float y = fmod(angle() + slip, 360.0);
+      if(y < 0.0) y += 360.0;
+
+      int c = first < 0 ? (int)lround(y * cpr / 360.0) : invert(y);
+      if(noise > 0) c += (int)(next_random() % (2*noise + 1)) - (int)noise;
+      return (int16_t)(c & (cpr - 1));
+   }
+
+   /// Mounts the sensor so that table (angle per count, as built by
+   /// LookupBuilder) is its exact calibration. The table is copied, later
+   /// calibrations measure the sensor instead of redefining it.
+   void mount(const float* table)
+   {
+      first = 0;
+      for(int c = 0; c < cpr; ++c) {
+         map[c] = table[c];
+         if(map[c] < map[first]) first = c;
+      }
+
+      for(int k = 0; k + 1 < cpr; ++k) {
+         if(map[(first + k + 1) % cpr] < map[(first + k) % cpr]) {
+            first = -1;     // not a calibration, fall back to a linear sensor
+            break;
+         }
+      }
+   }
+
+   /// Places the rotor and the load at rest at angle (deg)
+   void reset(const float& angle_)
+   {
+      position = angle_ * (M_PI / 180.0);
+      omega = 0.0;
+      load_position = position;
+      load_omega = 0.0;
+   }
+
+   /// Rotor angle in deg, not wrapped
+   double angle() const
+   {
+      return position * (180.0 / M_PI);
+   }
+
+   /// Load angle in deg, the rotor's unless the load is on a belt
+   double loadAngle() const
+   {
+      return (belted() ? load_position : position) * (180.0 / M_PI);
+   }
+
+   /// Puts the load inertia on a belt of stiffness (Nm/rad) and damping
+   /// (Nm s/rad), 0 couples it rigidly. The load starts where the rotor is.
+   void belt(const float& stiffness, const float& damping)
+   {
+      belt_stiffness = stiffness;
+      belt_damping = damping;
+      load_position = position;
+      load_omega = omega;
+   }
+
+   /// Rotor velocity in deg/s
+   float velocity() const
+   {
+      return omega * (180.0 / M_PI);
+   }
+
+   void print() const
+   {
+      printf("angle: %f deg, velocity: %f deg/s, torque: %f Nm\n", angle(), velocity(), torque);
+      printf("coil A: %f A (ref %f A), coil B: %f A (ref %f A)\n", i_A, iref_A, i_B, iref_B);
+      printf("load: %f Nm, load inertia: %g kg m^2, friction: %f Nm + %g Nm s/rad, detent: %f Nm, noise: %u counts\n",
+             load_torque, load_inertia, coulomb, viscous, detent, noise);
+      printf("belt: %g Nm/rad, %g Nm s/rad, load at %f deg\n", belt_stiffness, belt_damping, loadAngle());
+      printf("stops: %f deg to %f deg, %g Nm/rad, %g Nm s/rad\n", stop_low, stop_high, stop_stiffness, stop_damping);
+      printf("sensor: %s\n", first < 0 ? "linear" : "lookup table");
+   }
+
+   // Motor, 17HS16-2004S as shipped with the Mechaduino
+   float Kt = 0.22;              // Nm/A, also the back-EMF constant in V s/rad
+   float R = 1.1;                // Ohm per phase
+   float L = 2.6e-3;             // H per phase
+   float supply = 12.0;          // V
+   float J = 5.4e-6;             // kg m^2 rotor inertia
+   float detent = 0.015;         // Nm detent torque amplitude
+
+   // Load
+   float load_inertia = 0.0;     // kg m^2
+   float load_torque = 0.0;      // Nm, positive along increasing angle
+   float coulomb = 0.006;        // Nm
+   float viscous = 2e-5;         // Nm s/rad
+
+   // Belt to the load inertia, rigid while the stiffness is 0
+   float belt_stiffness = 0.0;   // Nm/rad
+   float belt_damping = 0.0;     // Nm s/rad
+
+   // Hard stops, the rotor presses into them like into a stiff spring
+   double stop_low = -INFINITY;  // deg, not wrapped
+   double stop_high = INFINITY;
+   float stop_stiffness = 50.0;  // Nm/rad
+   float stop_damping = 0.01;    // Nm s/rad, about 0.3 of critical with the rotor alone
+
+   unsigned noise = 0;           // counts of uniform encoder noise, +/-
+   float slip = 0.0;             // deg the magnet has slipped on the shaft, the sensor reads this much ahead
+   uint32_t max_step = 10;       // us per integration step
+   uint32_t max_gap = 100000;    // us, longer gaps are skipped instead of integrated
+
+   float torque = 0.0;           // Nm, last electromagnetic torque
+   float i_A = 0.0;              // A
+   float i_B = 0.0;
+
+private:
+   void advance(const uint64_t& now)
+   {
+      if(!started) {
+         t = now;
+         started = true;
+      }
+      if(now <= t) return;
+      if(now - t > max_gap) t = now - max_gap;   // the process was not scheduled
+
+      while(t < now) {
+         const uint32_t dt = now - t < max_step ? now - t : max_step;
+         step(dt * 1e-6);
+         t += dt;
+      }
+   }
+
+   void step(const double& h)
+   {
+      const double theta = pole_pairs * position;
+      const float c = cos(theta);
+      const float s = sin(theta);
+
+      // The chopper applies the full supply until the sense voltage reaches
+      // VREF, back-EMF limits how fast the current follows at speed
+      i_A = chop(i_A, iref_A, -Kt * omega * c, h);
+      i_B = chop(i_B, iref_B, -Kt * omega * s, h);
+
+      torque = -Kt * (i_A * c + i_B * s);
+      float T = torque - detent * sin(4.0 * theta) + load_torque - viscous * omega + stop_torque();
+      float inertia = J + load_inertia;
+      if(belted()) {
+         const float Tb = belt_stiffness * (load_position - position) + belt_damping * (load_omega - omega);
+         load_omega -= Tb / load_inertia * h;
+         load_position += load_omega * h;
+         T += Tb;
+         inertia = J;
+      }
+
+      // Static friction holds the rotor until the torque breaks it loose,
+      // kinetic friction slows it down but never reverses it
+      if(omega == 0.0 && fabs(T) <= coulomb) return;
+      const float dir = omega != 0.0 ? (omega > 0.0 ? 1.0 : -1.0) : (T > 0.0 ? 1.0 : -1.0);
+      T -= dir * coulomb;
+
+      const double omega_1 = omega;
+      omega += T / inertia * h;
+      if(omega_1 != 0.0 && omega * omega_1 < 0.0) omega = 0.0;
+
+      position += omega * h;
+   }
+
+   /// Reaction of a hard stop the rotor has run into, pushes but never pulls
+   float stop_torque() const
+   {
+      const double low = stop_low * (M_PI / 180.0);
+      const double high = stop_high * (M_PI / 180.0);
+      if(position < low) {
+         const float T = -stop_stiffness * (position - low) - stop_damping * omega;
+         return T > 0.0 ? T : 0.0;
+      }
+      if(position > high) {
+         const float T = -stop_stiffness * (position - high) - stop_damping * omega;
+         return T < 0.0 ? T : 0.0;
+      }
+      return 0.0;
+   }
+
+   bool belted() const
+   {
+      return belt_stiffness > 0.0 && load_inertia > 0.0;
+   }
+
+   float chop(const float& i, const float& iref, const float& emf, const double& h) const
+   {
+      const float v = i < iref ? supply : -supply;
+      const float i_1 = i + (v - R * i - emf) / L * h;
+      return (iref - i) * (iref - i_1) < 0.0 ? iref : i_1;
+   }
+
+   /// Count whose calibrated angle is closest to y, by binary search over
+   /// the table rotated to start at its smallest angle
+   int invert(const float& y) const
+   {
+      int lo = 0;
+      int hi = cpr;
+      if(y < map[first]) {
+         lo = cpr - 1;      // between the largest angle and the wrap
+      }
+      else {
+         while(hi - lo > 1) {
+            const int mid = (lo + hi) / 2;
+            if(map[(first + mid) % cpr] <= y) lo = mid;
+            else hi = mid;
+         }
+      }
+
+      const float here = map[(first + lo) % cpr];
+      float next = map[(first + lo + 1) % cpr];
+      if(lo == cpr - 1) next += 360.0;
+      const float yu = (lo == cpr - 1 && y < here) ? y + 360.0 : y;
+      if(next - yu < yu - here) ++lo;
+
+      return (first + lo) % cpr;
+   }
+
+   uint32_t next_random()
+   {
+      random ^= random << 13;
+      random ^= random >> 17;
+      random ^= random << 5;
+      return random;
+   }
+
+   static constexpr float rSense = 0.150;
+   static constexpr float amps_per_duty = 3.3 / 255.0 / (10.0 * rSense);
+   static const int pole_pairs = 50;
+   static const int cpr = 16384;
+
+   double position = 0.0;        // rad
+   double omega = 0.0;           // rad/s
+   double load_position = 0.0;   // rad, on the belt
+   double load_omega = 0.0;
+   float iref_A = 0.0;
+   float iref_B = 0.0;
+
+   uint64_t t = 0;
+   bool started = false;
+   uint32_t random = 2463534242;
+
+   float map[cpr] = { };
+   int first = -1;               // count with the smallest angle, -1 for a linear sensor
+};
+
+#endif
@@ -0,0 +1,139 @@
+/*
+ * Copyright (C) 2019 Florian Seybold
+ *
+ * This file is subject to the terms and conditions of the GNU Lesser
+ * General Public License v2.1. See the file LICENSE in the top level
+ * directory for more details.
+ */
+
+/**
+ * @ingroup     mechaduino_firmware
+ *
+ * @{
+ * @file
+ * @brief       Trapezoidal setpoint profile, advanced once per control tick
+ *
+ * A move can end at a nonzero velocity (vend), it then hands over as soon
+ * as it passes its target and keeps its velocity for the next move, which
+ * is how MotionQueue blends segments.
+ *
+ * @author      Florian Seybold <florian@seybold.space>
+ */
+
+#ifndef PROFILE_HPP
+#define PROFILE_HPP
+
+#include <cmath>
+
+class Profile
+{
+public:
+   /// Starts a move from the current profile state. Starting while a move is
+   /// running keeps the current velocity, so goals can be preempted smoothly.
+   /// The move ends passing the target at vend_ (magnitude) if it is nonzero.
+   void start(const float& target_, const float& vmax_, const float& amax_, const float& vend_ = 0.0)
+   {
+      target = target_;
+      vmax = vmax_;
+      amax = amax_;
+      vend = vend_;
+      running = true;
+      decelerating = false;
+   }
+
+   /// Changes the end velocity of the running move
+   void setEnd(const float& vend_)
+   {
+      vend = vend_;
+   }
+
+   /// Places the profile at position p, moving with velocity v
+   void reset(const float& p, const float& v = 0.0)
+   {
+      position = p;
+      velocity = v;
+      running = false;
+      decelerating = false;
+   }
+
+   /// Ramps down to standstill from the current velocity
+   void brake()
+   {
+      if(!running) return;
+      target = position + velocity * fabs(velocity) / (2.0 * amax);
+      vend = 0.0;
+   }
+
+   void stop()
+   {
+      running = false;
+      velocity = 0.0;
+      vend = 0.0;
+   }
+
+   /// Advances by one tick of length dt and returns the new setpoint
+   float next(const float& dt)
+   {
+      if(!running) return position;
+
+      const float dist = target - position;
+      const float dv = amax * dt;
+
+      if(vend > 0.0) {
+         // Hands over in the tick that passes the target, at speed
+         if(fabs(dist) <= fabs(velocity) * dt && velocity * dist >= 0.0) {
+            position += velocity * dt;
+            running = false;
+            return position;
+         }
+      }
+      // Done when the target is reachable within this tick at a velocity the
+      // ramp could have stopped from
+      else if(fabs(dist) <= fabs(velocity) * dt + 0.5 * dv * dt && fabs(velocity) <= dv) {
+         position = target;
+         velocity = 0.0;
+         running = false;
+         return position;
+      }
+
+      // Highest velocity from which braking in steps of dv still slows down
+      // to vend at the target (v*dt + (v^2-vend^2)/(2*amax) <= |dist|),
+      // approached with at most amax
+      const float dir = dist > 0.0 ? 1.0 : -1.0;
+      const float vstop = sqrt(0.25 * dv * dv + 2.0 * amax * fabs(dist) + vend * vend) - 0.5 * dv;
+      const float vdes = dir * (vstop < vmax ? vstop : vmax);
+
+      const float speed = fabs(velocity);
+      if(velocity < vdes) velocity = (velocity + dv < vdes) ? velocity + dv : vdes;
+      else velocity = (velocity - dv > vdes) ? velocity - dv : vdes;
+      decelerating = vstop < vmax && fabs(velocity) < speed;
+
+      position += velocity * dt;
+      return position;
+   }
+
+   bool active() const
+   {
+      return running;
+   }
+
+   /// Slowing down to stop at the target, a move started now can no longer
+   /// continue at the speed this one had
+   bool stopping() const
+   {
+      return running && vend == 0.0 && decelerating;
+   }
+
+   float position = 0.0;
+   float velocity = 0.0;
+   float target = 0.0;
+
+private:
+   float vmax = 0.0;
+   float amax = 0.0;
+   float vend = 0.0;
+   bool running = false;
+   bool decelerating = false;    // the last tick slowed down for the target
+};
+
+#endif
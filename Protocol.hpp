@@ -0,0 +1,345 @@
+/*
+ * Copyright (C) 2019 Florian Seybold
+ *
+ * This file is subject to the terms and conditions of the GNU Lesser
+ * General Public License v2.1. See the file LICENSE in the top level
+ * directory for more details.
+ */
+
+/**
+ * @ingroup     mechaduino_firmware
+ *
+ * @{
+ * @file
+ * @brief       Binary command channel next to the shell
+ *
+ * Receives COBS framed requests (see ProtocolFormat.hpp) on PROTOCOL_UART,
+ * the shell keeps the stdio UART. Every request with a valid crc is
+ * answered with an ack carrying its sequence number and the device time,
+ * frames with a bad crc are dropped and counted.
+ *
+ * Sync samples from the master (tools/sync_master) steer a ClockSync,
+ * timed setpoints are converted to local time on arrival and queued in
+ * the controller, which applies them on the tick nearest to their time.
+ *
+ * @author      Florian Seybold <florian@seybold.space>
+ */
+
+#ifndef PROTOCOL_HPP
+#define PROTOCOL_HPP
+
+#include <periph/uart.h>
+#include <thread.h>
+#include <thread_flags.h>
+#include <tsrb.h>
+#include <xtimer.h>
+
+#include <cmath>
+#include <stdio.h>
+
+#include "Cobs.hpp"
+#include "ProtocolFormat.hpp"
+#include "ClockSync.hpp"
+#include "Controller.hpp"
+#include "Params.hpp"
+
+#define ENABLE_DEBUG    (0)
+#include "debug.h"
+
+#ifndef PROTOCOL_UART
+#define PROTOCOL_UART      UART_DEV(0)
+#endif
+#ifndef PROTOCOL_BAUDRATE
+#define PROTOCOL_BAUDRATE  (115200U)
+#endif
+
+
+class Protocol
+{
+public:
+   Protocol(Controller& controller_, Params& params_, const char& priority_ = THREAD_PRIORITY_MAIN - 1)
+      : controller(controller_),
+        params(params_),
+        priority(priority_)
+   { }
+
+   void start()
+   {
+      if(go==true) return;
+
+      tsrb_init(&rx, rx_buf, sizeof(rx_buf));
+
+      // The thread only exists once the UART works, a failed start can be
+      // retried without a second thread on the same stack
+      if(uart_init(PROTOCOL_UART, PROTOCOL_BAUDRATE, rx_cb, this) != UART_OK) {
+         puts("[Init of protocol UART failed]");
+         return;
+      }
+
+      go=true;
+      pid = thread_create(thread_stack, sizeof(thread_stack),
+         priority,
+         THREAD_CREATE_STACKTEST,
+         [](void* arg)->void*{ return ((Protocol*)arg)->run(); },
+         (void*)this,
+         "protocol");
+
+      DEBUG("Protocol::start(): Created thread %i...\n", pid);
+   }
+
+   void printStats() const
+   {
+      printf("protocol: frames=%lu, bad frames=%lu, rx overruns=%lu\n",
+         (unsigned long)frames, (unsigned long)bad_frames, (unsigned long)overruns);
+   }
+
+   void printSync() const
+   {
+      const Controller::TimedStats t = controller.timedStats();
+      printf("clock: %s, samples=%lu, restarts=%lu, drift=%li ppb, last residual=%li us\n",
+         clock.synced() ? "synced" : "not synced", (unsigned long)clock.sampleCount(), (unsigned long)clock.stepCount(),
+         (long)clock.driftPpb(), (long)clock.lastResidual());
+      printf("timed setpoints: applied=%lu, rejected=%lu, max tick error=%lu us\n",
+         (unsigned long)t.applied, (unsigned long)timed_rejected, (unsigned long)t.max_error);
+   }
+
+private:
+   static void rx_cb(void* arg, uint8_t c)
+   {
+      Protocol* p = (Protocol*)arg;
+      if(tsrb_add_one(&p->rx, c) < 0) ++p->overruns;
+      if(c == 0 && p->pid != KERNEL_PID_UNDEF) thread_flags_set(thread_get(p->pid), flag_frame);   // bytes before the thread wait for the next frame
+   }
+
+   void* run()
+   {
+      DEBUG("Protocol::run(): Entering...\n");
+
+      while(go)
+      {
+         thread_flags_wait_any(flag_frame);
+
+         int c;
+         while((c = tsrb_get_one(&rx)) >= 0) {
+            if(c != 0) {
+               if(frame_len < sizeof(frame)) frame[frame_len++] = c;
+               else overlong = true;
+               continue;
+            }
+
+            if(overlong) ++bad_frames;
+            else if(frame_len > 0) handle_frame();
+            frame_len = 0;
+            overlong = false;
+         }
+      }
+
+      return NULL;
+   }
+
+   void handle_frame()
+   {
+      uint8_t req[sizeof(frame)];
+      const int len = cobs_decode(frame, frame_len, req);
+      const size_t n = len > 0 ? protocol_check(req, len) : 0;
+      if(n == 0) {
+         ++bad_frames;      // no trustworthy sequence number to ack
+         return;
+      }
+      ++frames;
+
+      ProtocolAck ack;
+      memcpy(&ack.seq, req + 1, sizeof(ack.seq));
+      ack.result = result_ok;
+      ack.failed_op = 0;
+      ack.has_status = false;
+      ack.has_clock = false;
+
+      // Check the whole frame, structure and arguments, before applying
+      // anything, so a batch is applied completely or not at all
+      uint8_t count = 0;
+      Batch batch = { controller.running(), controller.timedFree() };
+      for(size_t pos = 3; pos < n; ++count) {
+         const int size = protocol_op_size(req[pos]);
+         if(size < 0 || pos + 1 + size > n) {
+            ack.result = size < 0 ? result_unknown_op : result_malformed;
+            ack.failed_op = count;
+            break;
+         }
+         if(!check(req[pos], req + pos + 1, batch)) {
+            ack.result = result_rejected;
+            ack.failed_op = count;
+            break;
+         }
+         pos += 1 + size;
+      }
+
+      if(ack.result == result_ok) {
+         size_t pos = 3;
+         for(uint8_t i = 0; i < count; ++i) {
+            const uint8_t op = req[pos];
+            if(!apply(op, req + pos + 1, ack)) {
+               ack.result = result_rejected;
+               ack.failed_op = i;
+               break;
+            }
+            pos += 1 + protocol_op_size(op);
+         }
+      }
+
+      ack.timestamp = xtimer_now_usec();
+      if(ack.has_status) {
+         ack.status.position = controller.position();
+         ack.status.error = controller.error();
+         ack.status.setpoint = controller.setpoint();
+         ack.status.flags = (controller.running() ? flag_running : 0) | (controller.moving() ? flag_moving : 0)
+                          | (clock.synced() ? flag_synced : 0);
+      }
+      if(ack.has_clock) {
+         ack.master_time = clock.synced() ? clock.to_master(local_time(ack.timestamp)) : 0;
+      }
+
+      uint8_t packet[protocol_ack_size];
+      uint8_t out[protocol_ack_size + protocol_ack_size / 254 + 2];
+      size_t m = cobs_encode(packet, protocol_pack_ack(ack, packet), out);
+      out[m++] = 0;
+      uart_write(PROTOCOL_UART, out, m);
+   }
+
+   /// Controller state as the ops checked so far leave it. A sync sample in
+   /// the same batch does not count yet, timed setpoints need the clock
+   /// synced before the frame.
+   struct Batch {
+      bool running;
+      unsigned timed_free;    // slots for timed setpoints
+   };
+
+   /// Whether apply() will accept op with arguments p after the ops before
+   /// it in the batch
+   bool check(const uint8_t& op, const uint8_t* p, Batch& batch) const
+   {
+      float f[3];
+      uint64_t master;
+      switch(op) {
+         case op_setpoint:
+            memcpy(f, p, 4);
+            return std::isfinite(f[0]);
+         case op_move:
+            memcpy(f, p, 12);
+            return batch.running && std::isfinite(f[0]) && f[1] >= 0.0 && f[2] >= 0.0;
+         case op_mode:
+            if(p[0] == mode_stop) batch.running = false;
+            else if(p[0] == mode_start) batch.running = true;
+            else if(p[0] != mode_halt) return false;
+            return true;
+         case op_gains:
+            memcpy(f, p, 12);
+            return Params::find("pKp")->accepts(f[0]) && Params::find("pKi")->accepts(f[1]) && Params::find("pKd")->accepts(f[2]);
+         case op_setpoint_at:
+         case op_move_at:
+         {
+            memcpy(&master, p, 8);
+            memcpy(f, p + 8, op == op_move_at ? 12 : 4);
+            if(!clock.synced() || !batch.running || batch.timed_free == 0 || !std::isfinite(f[0])) return false;
+            if(op == op_move_at && !(f[1] >= 0.0 && f[2] >= 0.0)) return false;
+            const uint32_t t = (uint32_t)clock.to_local(master);
+            if((int32_t)(t - xtimer_now_usec()) < -(int32_t)controller.tickPeriod()) return false;    // too late
+            --batch.timed_free;
+            return true;
+         }
+         default:
+            return true;
+      }
+   }
+
+   bool apply(const uint8_t& op, const uint8_t* p, ProtocolAck& ack)
+   {
+      float f[3];
+      uint32_t t;
+      uint64_t master;
+      switch(op) {
+         case op_setpoint:
+            memcpy(f, p, 4);
+            if(!std::isfinite(f[0])) return false;
+            controller.set(f[0]);
+            return true;
+         case op_move:
+            memcpy(f, p, 12);
+            if(!controller.running() || !std::isfinite(f[0]) || !(f[1] >= 0.0) || !(f[2] >= 0.0)) return false;
+            controller.move_to(f[0], f[1], f[2]);
+            return true;
+         case op_mode:
+            if(p[0] == mode_stop) controller.stop();
+            else if(p[0] == mode_start) controller.start();
+            else if(p[0] == mode_halt) controller.halt();
+            else return false;
+            return true;
+         case op_gains:
+         {
+            memcpy(f, p, 12);
+            const ParamDesc* d[3] = { Params::find("pKp"), Params::find("pKi"), Params::find("pKd") };
+            return params.set(d, f, 3);     // one change, the loop never runs with a mix of old and new gains
+         }
+         case op_status:
+            ack.has_status = true;
+            return true;
+         case op_sync:
+            memcpy(&t, p, 4);
+            memcpy(&master, p + 4, 8);
+            clock.sample(local_time(t), master);
+            return true;
+         case op_setpoint_at:
+         case op_move_at:
+            memcpy(&master, p, 8);
+            memcpy(f, p + 8, op == op_move_at ? 12 : 4);
+            if(clock.synced() && controller.running() && std::isfinite(f[0])) {
+               t = (uint32_t)clock.to_local(master);
+               if(op == op_setpoint_at && controller.set_at(t, f[0])) return true;
+               if(op == op_move_at && f[1] >= 0.0 && f[2] >= 0.0 && controller.move_at(t, f[0], f[1], f[2])) return true;
+            }
+            ++timed_rejected;
+            return false;
+         case op_clock:
+            ack.has_clock = true;
+            return true;
+         case op_master:
+            memcpy(&t, p, 4);
+            controller.gearing.stream(t);
+            return true;
+         default:
+            return false;
+      }
+   }
+
+   /// Extends a 32 bit xtimer_now_usec() time from the recent past to 64 bit
+   static uint64_t local_time(const uint32_t& t)
+   {
+      const uint64_t now = xtimer_now_usec64();
+      return now - (uint32_t)((uint32_t)now - t);
+   }
+
+   static const thread_flags_t flag_frame = 0x1;
+
+   Controller& controller;
+   Params& params;
+   const char priority;
+
+   char thread_stack[THREAD_STACKSIZE_DEFAULT];
+   bool go = false;
+   kernel_pid_t pid = KERNEL_PID_UNDEF;
+
+   tsrb_t rx;
+   uint8_t rx_buf[256];            // power of two, tsrb requirement
+   uint8_t frame[cobs_max_size(protocol_max_request)];
+   size_t frame_len = 0;
+   bool overlong = false;
+
+   uint32_t frames = 0;
+   uint32_t bad_frames = 0;
+   uint32_t timed_rejected = 0;
+
+   ClockSync clock;
+   volatile uint32_t overruns = 0;
+};
+
+#endif
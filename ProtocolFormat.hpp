@@ -0,0 +1,298 @@
+/*
+ * Copyright (C) 2019 Florian Seybold
+ *
+ * This file is subject to the terms and conditions of the GNU Lesser
+ * General Public License v2.1. See the file LICENSE in the top level
+ * directory for more details.
+ */
+
+/**
+ * @ingroup     mechaduino_firmware
+ *
+ * @{
+ * @file
+ * @brief       Binary command protocol frame layout
+ *
+ * Shared between the firmware and host side tools, keep this header free of
+ * RIOT includes. All frames are COBS framed, zero delimited and little
+ * endian, with a crc32 over everything before it.
+ *
+ * Request: version, seq (u16), any number of operations (opcode followed
+ * by its fixed size payload), crc. Operations are applied in order after
+ * the whole frame, with every operation's arguments, has been checked; a
+ * rejected frame changes nothing.
+ *
+ * Ack: version, seq (u16), result, index of the failing operation,
+ * device time (u32 us), flags (ProtocolAckFlags) and the blocks they
+ * announce: status (position, error, setpoint as floats, controller flags)
+ * and clock (the device's estimate of master time at the ack's device
+ * time, u64 us), crc.
+ *
+ * Master times are the master's clock in us, see ClockSync.hpp.
+ *
+ * @author      Florian Seybold <florian@seybold.space>
+ */
+
+#ifndef PROTOCOLFORMAT_HPP
+#define PROTOCOLFORMAT_HPP
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "Crc.hpp"
+
+enum ProtocolOp {
+   op_setpoint = 1,     // float target, steps the setpoint
+   op_move = 2,         // float target, vmax, amax, profiled move
+   op_mode = 3,         // u8 ProtocolMode
+   op_gains = 4,        // float Kp, Ki, Kd
+   op_status = 5,       // no payload, adds a status snapshot to the ack
+   op_sync = 6,         // u32 device time, u64 master time read at that device time
+   op_setpoint_at = 7,  // u64 master time, float target
+   op_move_at = 8,      // u64 master time, float target, vmax, amax
+   op_clock = 9,        // no payload, adds the device's master time estimate to the ack
+   op_master = 10       // u32 master axis position in counts for gearing, wraps
+};
+
+enum ProtocolMode {
+   mode_stop = 0,
+   mode_start = 1,
+   mode_halt = 2
+};
+
+enum ProtocolResult {
+   result_ok = 0,
+   result_malformed = 1,     // truncated operation or bad version
+   result_unknown_op = 2,
+   result_rejected = 3       // operation not possible in the current state
+};
+
+enum ProtocolFlags {
+   flag_running = 1,
+   flag_moving = 2,
+   flag_synced = 4
+};
+
+enum ProtocolAckFlags {
+   ack_status = 1,
+   ack_clock = 2
+};
+
+static const uint8_t protocol_version = 1;
+static const size_t protocol_max_request = 128;    // before framing
+static const size_t protocol_ack_size = 1 + 2 + 1 + 1 + 4 + 1 + 3 * 4 + 1 + 8 + 4;
+
+/// Payload size of an operation, -1 for unknown opcodes
+inline int protocol_op_size(const uint8_t& op)
+{
+   switch(op) {
+      case op_setpoint: return 4;
+      case op_move:     return 12;
+      case op_mode:     return 1;
+      case op_gains:    return 12;
+      case op_status:   return 0;
+      case op_sync:     return 12;
+      case op_setpoint_at: return 12;
+      case op_move_at:  return 20;
+      case op_clock:    return 0;
+      case op_master:   return 4;
+      default:          return -1;
+   }
+}
+
+/// Checks version and crc, returns the length without the crc or 0
+inline size_t protocol_check(const uint8_t* in, const size_t& len)
+{
+   if(len < 1 + 2 + 4 || in[0] != protocol_version) return 0;
+   uint32_t crc;
+   memcpy(&crc, in + len - 4, sizeof(crc));
+   return crc == crc32(in, len - 4) ? len - 4 : 0;
+}
+
+struct ProtocolStatus {
+   float position;
+   float error;
+   float setpoint;
+   uint8_t flags;
+};
+
+struct ProtocolAck {
+   uint16_t seq;
+   uint8_t result;
+   uint8_t failed_op;      // index of the operation the result refers to
+   uint32_t timestamp;     // device time in us when the frame was applied
+   bool has_status;
+   ProtocolStatus status;
+   bool has_clock;
+   uint64_t master_time;   // device estimate of master time at timestamp, 0 if not synced
+};
+
+/// Builds request frames (before COBS), used by host tools
+class ProtocolRequest
+{
+public:
+   explicit ProtocolRequest(const uint16_t& seq)
+   {
+      buf[n++] = protocol_version;
+      put(&seq, 2);
+   }
+
+   ProtocolRequest& setpoint(const float& target)
+   {
+      op(op_setpoint);
+      put(&target, 4);
+      return *this;
+   }
+
+   ProtocolRequest& move(const float& target, const float& vmax = 0.0, const float& amax = 0.0)
+   {
+      op(op_move);
+      put(&target, 4);
+      put(&vmax, 4);
+      put(&amax, 4);
+      return *this;
+   }
+
+   ProtocolRequest& mode(const uint8_t& m)
+   {
+      op(op_mode);
+      put(&m, 1);
+      return *this;
+   }
+
+   ProtocolRequest& gains(const float& Kp, const float& Ki, const float& Kd)
+   {
+      op(op_gains);
+      put(&Kp, 4);
+      put(&Ki, 4);
+      put(&Kd, 4);
+      return *this;
+   }
+
+   ProtocolRequest& status()
+   {
+      op(op_status);
+      return *this;
+   }
+
+   ProtocolRequest& sync(const uint32_t& device_time, const uint64_t& master_time)
+   {
+      op(op_sync);
+      put(&device_time, 4);
+      put(&master_time, 8);
+      return *this;
+   }
+
+   ProtocolRequest& setpoint_at(const uint64_t& master_time, const float& target)
+   {
+      op(op_setpoint_at);
+      put(&master_time, 8);
+      put(&target, 4);
+      return *this;
+   }
+
+   ProtocolRequest& move_at(const uint64_t& master_time, const float& target, const float& vmax = 0.0, const float& amax = 0.0)
+   {
+      op(op_move_at);
+      put(&master_time, 8);
+      put(&target, 4);
+      put(&vmax, 4);
+      put(&amax, 4);
+      return *this;
+   }
+
+   ProtocolRequest& clock()
+   {
+      op(op_clock);
+      return *this;
+   }
+
+   ProtocolRequest& master(const uint32_t& position)
+   {
+      op(op_master);
+      put(&position, 4);
+      return *this;
+   }
+
+   /// Appends the crc and returns the finished frame length, 0 on overflow
+   size_t finish()
+   {
+      const uint32_t crc = crc32(buf, n);
+      put(&crc, 4);
+      return overflow ? 0 : n;
+   }
+
+   uint8_t buf[protocol_max_request];
+
+private:
+   void op(const uint8_t& code)
+   {
+      put(&code, 1);
+   }
+
+   void put(const void* p, const size_t& len)
+   {
+      if(n + len > sizeof(buf)) {
+         overflow = true;
+         return;
+      }
+      memcpy(buf + n, p, len);
+      n += len;
+   }
+
+   size_t n = 0;
+   bool overflow = false;
+};
+
+/// Packs an ack (before COBS), returns its length
+inline size_t protocol_pack_ack(const ProtocolAck& a, uint8_t* out)
+{
+   size_t n = 0;
+   out[n++] = protocol_version;
+   memcpy(out + n, &a.seq, 2); n += 2;
+   out[n++] = a.result;
+   out[n++] = a.failed_op;
+   memcpy(out + n, &a.timestamp, 4); n += 4;
+   out[n++] = (a.has_status ? ack_status : 0) | (a.has_clock ? ack_clock : 0);
+   if(a.has_status) {
+      memcpy(out + n, &a.status.position, 4); n += 4;
+      memcpy(out + n, &a.status.error, 4); n += 4;
+      memcpy(out + n, &a.status.setpoint, 4); n += 4;
+      out[n++] = a.status.flags;
+   }
+   if(a.has_clock) {
+      memcpy(out + n, &a.master_time, 8); n += 8;
+   }
+   const uint32_t crc = crc32(out, n);
+   memcpy(out + n, &crc, 4);
+   return n + 4;
+}
+
+/// Unpacks an ack frame (after COBS), used by host tools
+inline bool protocol_unpack_ack(const uint8_t* in, const size_t& len, ProtocolAck& a)
+{
+   const size_t n = protocol_check(in, len);
+   if(n < 10) return false;
+
+   memcpy(&a.seq, in + 1, 2);
+   a.result = in[3];
+   a.failed_op = in[4];
+   memcpy(&a.timestamp, in + 5, 4);
+   a.has_status = in[9] & ack_status;
+   a.has_clock = in[9] & ack_clock;
+   if(n != 10u + (a.has_status ? 13 : 0) + (a.has_clock ? 8 : 0)) return false;
+
+   size_t p = 10;
+   if(a.has_status) {
+      memcpy(&a.status.position, in + p, 4);
+      memcpy(&a.status.error, in + p + 4, 4);
+      memcpy(&a.status.setpoint, in + p + 8, 4);
+      a.status.flags = in[p + 12];
+      p += 13;
+   }
+   if(a.has_clock) memcpy(&a.master_time, in + p, 8);
+   return true;
+}
+
+#endif
@@ -0,0 +1,67 @@
+/*
+ * Copyright (C) 2019 Florian Seybold
+ *
+ * This file is subject to the terms and conditions of the GNU Lesser
+ * General Public License v2.1. See the file LICENSE in the top level
+ * directory for more details.
+ */
+
+/**
+ * @ingroup     mechaduino_firmware
+ *
+ * @{
+ * @file
+ * @brief       Binary layout of control loop recordings
+ *
+ * Shared between Recorder and tools/replay. A recording is streamed by
+ * 'record dump' as one frame (little endian): header, entries oldest
+ * first, crc32 over everything before it. Keep this header free of RIOT
+ * includes.
+ *
+ * @author      Florian Seybold <florian@seybold.space>
+ */
+
+#ifndef RECORDFORMAT_HPP
+#define RECORDFORMAT_HPP
+
+#include <stdint.h>
+
+#include "ServoLoop.hpp"
+
+/// Loop state and settings before an entry, replay starts from one
+struct RecordKeyframe {
+   ServoLoop::State state;
+   ServoLoop::Gains gains;
+   float Fs;               // Hz
+   int32_t uMax;           // the motor's effort limit, a tick's can be lower
+   uint32_t params_version;
+};
+
+/// One control tick
+struct RecordEntry {
+   uint16_t count;         // encoder count the loop used, record_rejected and record_loop_changed flags
+   uint16_t dt;            // us since the previous tick, saturated
+   float setpoint;         // deg, rk of the tick
+   float feedforward;      // effort added to the loop output, learning and cogging compensation
+   int16_t uMax;           // effort limit of the tick, lowered while homing seeks
+};
+
+struct RecordHeader {
+   uint32_t magic;
+   uint16_t version;
+   uint16_t entries;
+   uint32_t lookup_crc;    // crc32 over the lookup table in use
+   uint32_t start;         // us, local time of the first entry
+   uint32_t flags;
+   RecordKeyframe keyframe;  // before the first entry
+};
+
+static const uint32_t record_magic = 0x4345524d;   // "MREC"
+static const uint16_t record_version = 4;   // 2: loop state with origin, 3: feedforward, 4: effort limit per tick
+
+static const uint16_t record_rejected = 0x8000;
+static const uint16_t record_loop_changed = 0x4000;   // the loop state was changed outside its tick (homing) before this one
+
+static const uint32_t record_params_changed = 1;   // parameters were changed within the recording
+
+#endif
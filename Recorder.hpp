@@ -0,0 +1,187 @@
+/*
+ * Copyright (C) 2019 Florian Seybold
+ *
+ * This file is subject to the terms and conditions of the GNU Lesser
+ * General Public License v2.1. See the file LICENSE in the top level
+ * directory for more details.
+ */
+
+/**
+ * @ingroup     mechaduino_firmware
+ *
+ * @{
+ * @file
+ * @brief       Recording of the control loop's inputs for offline replay
+ *
+ * Records encoder count, setpoint, feedforward and tick timing of every tick into a
+ * ring in RAM until stopped, so the last ticks before a bad move can be
+ * kept. Every block of entries starts with a keyframe of the loop state,
+ * the dump starts at the oldest complete block. tools/replay feeds the
+ * dump through ServoLoop again.
+ *
+ * The ring is leased from the ScratchArena when recording starts and kept
+ * until clear(), a recording waiting to be dumped blocks calibration,
+ * parameter saves and the cogging sweep.
+ *
+ * @author      Florian Seybold <florian@seybold.space>
+ */
+
+#ifndef RECORDER_HPP
+#define RECORDER_HPP
+
+#include <stdio.h>
+
+#include "Crc.hpp"
+#include "RecordFormat.hpp"
+#include "ScratchArena.hpp"
+#include "ServoLoop.hpp"
+
+class Recorder
+{
+public:
+   enum State { Idle, Recording, Done };
+
+   /// Starts recording, lookup_crc identifies the lookup table in use.
+   /// Fails while another operation holds the scratch arena.
+   bool start(const uint32_t& lookup_crc_)
+   {
+      clear();
+      if(!lease.take("record")) return false;
+      entries = lease.alloc<RecordEntry>(capacity);
+      keyframes = lease.alloc<RecordKeyframe>(blocks);
+      starts = lease.alloc<uint32_t>(blocks);
+      if(!starts) {
+         lease.drop();
+         return false;
+      }
+
+      lookup_crc = lookup_crc_;
+      pos = 0;
+      filled = 0;
+      first = true;
+      loop_changed = false;
+      state = Recording;
+      return true;
+   }
+
+   /// Called by the control loop when it changes the loop state outside
+   /// the tick, replay cannot follow from the next entry on
+   void loopChanged()
+   {
+      loop_changed = true;
+   }
+
+   /// Drops the recording and hands the arena back
+   void clear()
+   {
+      state = Idle;
+      lease.drop();
+   }
+
+   /// Freezes the recording
+   void stop()
+   {
+      if(state == Recording) state = Done;
+   }
+
+   bool recording() const
+   {
+      return state == Recording;
+   }
+
+   State status() const
+   {
+      return state;
+   }
+
+   /// Called by the control loop each tick, with the loop state before the
+   /// tick, the tick's effort limit uMax and the motor's motor_uMax
+   void push(const uint32_t& now, const int16_t& count, const bool& rejected, const float& rk, const float& uff, const int& uMax,
+             const ServoLoop& loop, const float& Fs, const int& motor_uMax, const uint32_t& params_version)
+   {
+      if(state != Recording) return;
+
+      if(pos % block == 0) {
+         keyframes[pos / block] = { loop.state, loop.gains, Fs, motor_uMax, params_version };
+         starts[pos / block] = now;
+      }
+
+      const uint32_t dt = first ? 0 : now - last;
+      const uint16_t flags = (rejected ? record_rejected : 0) | (loop_changed ? record_loop_changed : 0);
+      entries[pos] = { (uint16_t)((count & 0x3fff) | flags), (uint16_t)(dt < 0xffff ? dt : 0xffff), rk, uff, (int16_t)uMax };
+      loop_changed = false;
+      last = now;
+      last_version = params_version;
+      first = false;
+
+      pos = pos + 1 < capacity ? pos + 1 : 0;
+      if(filled < capacity) ++filled;
+   }
+
+   /// Streams the frozen recording as one binary frame (see RecordHeader)
+   void dump() const
+   {
+      if(state != Done) {
+         printf("Recording not complete (%s).\n", state == Idle ? "idle" : "running");
+         return;
+      }
+
+      // Without wrapping all entries are kept, after it the oldest block
+      // that was not partly overwritten starts the dump
+      unsigned s = 0;
+      unsigned n = filled;
+      if(filled == capacity) {
+         s = (pos + block - 1) / block % blocks * block;
+         n = (pos + capacity - s) % capacity;
+         if(n == 0) n = capacity;
+      }
+
+      RecordHeader header;
+      header.magic = record_magic;
+      header.version = record_version;
+      header.entries = n;
+      header.lookup_crc = lookup_crc;
+      header.start = starts[s / block];
+      header.flags = keyframes[s / block].params_version != last_version ? record_params_changed : 0;
+      header.keyframe = keyframes[s / block];
+
+      const unsigned n1 = s + n <= capacity ? n : capacity - s;    // up to the end of the ring
+      uint32_t crc = crc32(&header, sizeof(header));
+      crc = crc32(&entries[s], n1 * sizeof(RecordEntry), crc);
+      crc = crc32(&entries[0], (n - n1) * sizeof(RecordEntry), crc);
+
+      fwrite(&header, sizeof(header), 1, stdout);
+      fwrite(&entries[s], sizeof(RecordEntry), n1, stdout);
+      fwrite(&entries[0], sizeof(RecordEntry), n - n1, stdout);
+      fwrite(&crc, sizeof(crc), 1, stdout);
+      fflush(stdout);
+      puts("");
+   }
+
+   void printStatus() const
+   {
+      static const char* const states[] = { "idle", "recording", "done" };
+      printf("record: %s, %u of %u ticks\n", states[state], filled, capacity);
+   }
+
+private:
+   static const unsigned block = 32;      // entries per keyframe
+   static const unsigned blocks = ScratchArena::size / (block * sizeof(RecordEntry) + sizeof(RecordKeyframe) + sizeof(uint32_t));
+   static const unsigned capacity = block * blocks;
+
+   ScratchArena::Lease lease;    // held from start() to clear()
+   RecordEntry* entries = NULL;
+   RecordKeyframe* keyframes = NULL;
+   uint32_t* starts = NULL;
+
+   volatile State state = Idle;
+   uint32_t lookup_crc = 0;
+   unsigned pos = 0;
+   unsigned filled = 0;
+   uint32_t last = 0;
+   uint32_t last_version = 0;
+   bool first = true;
+   bool loop_changed = false;
+};
+
+#endif
@@ -0,0 +1,69 @@
+/*
+ * Copyright (C) 2019 Florian Seybold
+ *
+ * This file is subject to the terms and conditions of the GNU Lesser
+ * General Public License v2.1. See the file LICENSE in the top level
+ * directory for more details.
+ */
+
+/**
+ * @ingroup     mechaduino_firmware
+ *
+ * @{
+ * @file
+ * @brief       Mechaduino ROS2 node, shared by the ROS2 interfaces
+ *
+ * @author      Florian Seybold <florian@seybold.space>
+ */
+
+#ifndef ROSNODE_HPP
+#define ROSNODE_HPP
+
+#include <rcl/rcl.h>
+
+#include <stdio.h>
+
+class RosNode
+{
+public:
+   RosNode(const char* name_)
+      : name(name_)
+   { }
+
+   /// Initializes rcl and the node on first use
+   bool init()
+   {
+      if(initialized) return true;
+
+      rcl_init_options_t init_options = rcl_get_zero_initialized_init_options();
+      if(rcl_init_options_init(&init_options, rcl_get_default_allocator()) != RCL_RET_OK) {
+         puts("[Init of rcl options failed]");
+         return false;
+      }
+
+      rcl_ret_t rc = rcl_init(0, NULL, &init_options, &context);
+      rcl_init_options_fini(&init_options);
+      if(rc != RCL_RET_OK) {
+         puts("[Init of rcl failed]");
+         return false;
+      }
+
+      rcl_node_options_t node_ops = rcl_node_get_default_options();
+      if(rcl_node_init(&node, name, "", &context, &node_ops) != RCL_RET_OK) {
+         puts("[Init of rcl node failed]");
+         return false;
+      }
+
+      initialized = true;
+      return true;
+   }
+
+   rcl_context_t context = rcl_get_zero_initialized_context();
+   rcl_node_t node = rcl_get_zero_initialized_node();
+
+private:
+   const char* name;
+   bool initialized = false;
+};
+
+#endif
@@ -0,0 +1,177 @@
+/*
+ * Copyright (C) 2019 Florian Seybold
+ *
+ * This file is subject to the terms and conditions of the GNU Lesser
+ * General Public License v2.1. See the file LICENSE in the top level
+ * directory for more details.
+ */
+
+/**
+ * @ingroup     mechaduino_firmware
+ *
+ * @{
+ * @file
+ * @brief       Triggered capture of control loop samples in RAM
+ *
+ * Records the selected channels of every tick into a circular buffer while
+ * armed and freezes a fixed number of ticks after the trigger, keeping the
+ * configured pre-trigger history. The capture is dumped from the shell
+ * after it froze, so the loop never waits for the UART. The buffer is
+ * leased from the ScratchArena when armed and kept until clear().
+ *
+ * @author      Florian Seybold <florian@seybold.space>
+ */
+
+#ifndef SCOPE_HPP
+#define SCOPE_HPP
+
+#include <stdio.h>
+#include <math.h>
+
+#include "ScratchArena.hpp"
+#include "TelemetryFormat.hpp"
+
+class Scope
+{
+public:
+   enum Trigger { Manual, Setpoint, Error, Saturation, Fault };
+   enum State { Idle, Armed, Triggered, Done };
+
+   /// Starts recording. level is the setpoint step or error magnitude in deg
+   /// for the Setpoint and Error triggers, pre the number of ticks kept
+   /// before the trigger (clamped to the depth left by the channel count).
+   /// Fails while another operation holds the scratch arena.
+   bool arm(const Trigger& trigger_, const float& level_, const unsigned& pre_, const uint8_t& mask_ = telemetry_all)
+   {
+      clear();
+      if(!lease.take("scope") || !(pool = lease.alloc<float>(pool_size))) {
+         lease.drop();
+         return false;
+      }
+
+      mask = mask_ & telemetry_all;
+      if(mask == 0) mask = telemetry_all;
+      channels = 0;
+      for(int c = 0; c < telemetry_channels; ++c)
+         if(mask & (1 << c)) ++channels;
+
+      depth = pool_size / (channels + 1);    // +1 for the tick
+      trigger = trigger_;
+      level = level_;
+      pre = pre_ < depth ? pre_ : depth - 1;
+      pos = 0;
+      filled = 0;
+      first = true;
+
+      state = Armed;
+      return true;
+   }
+
+   /// Drops the capture and hands the arena back
+   void clear()
+   {
+      state = Idle;
+      lease.drop();
+      pool = NULL;
+   }
+
+   /// Triggers an armed capture from the shell
+   void force()
+   {
+      if(state == Armed) forced = true;
+   }
+
+   /// Called by the control loop each tick
+   void push(const TelemetrySample& s, const bool& saturated, const bool& fault)
+   {
+      if(state != Armed && state != Triggered) return;
+
+      float* slot = &pool[pos * (channels + 1)];
+      memcpy(slot, &s.tick, sizeof(float));
+      for(int c = 0; c < telemetry_channels; ++c)
+         if(mask & (1 << c)) *++slot = s.channel[c];
+      pos = pos + 1 < depth ? pos + 1 : 0;
+      if(filled < depth) ++filled;
+
+      if(state == Triggered) {
+         if(--remaining == 0) state = Done;
+      }
+      else if(filled > pre && triggered(s, saturated, fault)) {
+         trigger_tick = s.tick;
+         remaining = depth - pre - 1;
+         state = remaining == 0 ? Done : Triggered;
+      }
+
+      r_1 = s.channel[telemetry_r];
+      first = false;
+   }
+
+   State status() const
+   {
+      return state;
+   }
+
+   /// Prints the frozen capture as CSV, oldest tick first
+   void dump() const
+   {
+      if(state != Done) {
+         printf("Capture not complete (%s).\n", state == Idle ? "idle" : "waiting for trigger");
+         return;
+      }
+
+      printf("# trigger at tick %lu, %u ticks before\n", (unsigned long)trigger_tick, pre);
+      printf("tick");
+      for(int c = 0; c < telemetry_channels; ++c)
+         if(mask & (1 << c)) printf(",%s", telemetry_channel_names[c]);
+      printf("\n");
+
+      unsigned p = filled < depth ? 0 : pos;
+      for(unsigned i = 0; i < filled; ++i) {
+         const float* slot = &pool[p * (channels + 1)];
+         uint32_t tick;
+         memcpy(&tick, slot, sizeof(tick));
+         printf("%lu", (unsigned long)tick);
+         for(unsigned c = 0; c < channels; ++c) printf(",%f", *++slot);
+         printf("\n");
+         p = p + 1 < depth ? p + 1 : 0;
+      }
+   }
+
+private:
+   bool triggered(const TelemetrySample& s, const bool& saturated, const bool& fault)
+   {
+      if(forced) {
+         forced = false;
+         return true;
+      }
+
+      switch(trigger) {
+         case Setpoint: return !first && fabs(s.channel[telemetry_r] - r_1) > level;
+         case Error:    return fabs(s.channel[telemetry_e]) > level;
+         case Saturation: return saturated;
+         case Fault:    return fault;
+         default:       return false;
+      }
+   }
+
+   static const unsigned pool_size = ScratchArena::size / sizeof(float);   // shared by the selected channels
+   ScratchArena::Lease lease;    // held from arm() to clear()
+   float* pool = NULL;
+
+   volatile State state = Idle;
+   volatile bool forced = false;
+   Trigger trigger = Manual;
+   float level = 0.0;
+   uint8_t mask = telemetry_all;
+   unsigned channels = telemetry_channels;
+   unsigned depth = 0;
+   unsigned pre = 0;
+   unsigned pos = 0;
+   unsigned filled = 0;
+   unsigned remaining = 0;
+   uint32_t trigger_tick = 0;
+   float r_1 = 0.0;
+   bool first = true;
+};
+
+#endif
@@ -0,0 +1,143 @@
+/*
+ * Copyright (C) 2019 Florian Seybold
+ *
+ * This file is subject to the terms and conditions of the GNU Lesser
+ * General Public License v2.1. See the file LICENSE in the top level
+ * directory for more details.
+ */
+
+/**
+ * @ingroup     mechaduino_firmware
+ *
+ * @{
+ * @file
+ * @brief       Scratch RAM shared by the occasional operations
+ *
+ * Calibration, its capture, the cogging sweep, the flash page staging, the
+ * scope capture and recordings only need their buffers while they run, and
+ * never run at the same time.
+ * Instead of each holding its own (or putting them on the main thread
+ * stack), they lease this one arena. A Lease owns the whole arena until it
+ * goes out of scope or is dropped and hands out aligned blocks from it; a
+ * second lease while one is held is refused. A default constructed Lease
+ * holds nothing until take(), for owners that keep it across calls.
+ *
+ * @author      Florian Seybold <florian@seybold.space>
+ */
+
+#ifndef SCRATCHARENA_HPP
+#define SCRATCHARENA_HPP
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <irq.h>
+
+class ScratchArena
+{
+public:
+   static const size_t size = 4096;    // the cogging sweep needs 4 kB, scope and recorder take all of it
+
+   class Lease
+   {
+   public:
+      /// Takes the arena for owner, check valid() before use
+      Lease(const char* owner_)
+         : owner(acquire(owner_) ? owner_ : NULL)
+      { }
+
+      Lease()
+         : owner(NULL)
+      { }
+
+      ~Lease()
+      {
+         drop();
+      }
+
+      /// Takes the arena for owner if this lease holds nothing yet
+      bool take(const char* owner_)
+      {
+         if(!owner && acquire(owner_)) owner = owner_;
+         return owner == owner_;
+      }
+
+      /// Hands the arena back, the blocks from it are gone
+      void drop()
+      {
+         if(owner) release();
+         owner = NULL;
+      }
+
+      Lease(const Lease&) = delete;
+      Lease& operator=(const Lease&) = delete;
+
+      bool valid() const
+      {
+         return owner != NULL;
+      }
+
+      /// n uninitialized objects of type T, NULL if the arena is exhausted
+      template<typename T>
+      T* alloc(const size_t& n)
+      {
+         if(!owner) return NULL;
+         const size_t start = (used + alignof(T) - 1) & ~(alignof(T) - 1);
+         if(start + n * sizeof(T) > size) {
+            printf("ScratchArena: %s needs %u more bytes than the %u available\n", owner,
+                   (unsigned)(start + n * sizeof(T) - size), (unsigned)size);
+            return NULL;
+         }
+         used = start + n * sizeof(T);
+         if(used > high_water) high_water = used;
+         return (T*)&pool[start];
+      }
+
+   private:
+      const char* owner;
+   };
+
+   /// Who holds the arena and the most any lease has used
+   static void printStatus()
+   {
+      printf("scratch arena: %u bytes, %u used at most, %s%s\n", (unsigned)size, (unsigned)high_water,
+             holder ? "leased by " : "free", holder ? holder : "");
+   }
+
+   static size_t highWater()
+   {
+      return high_water;
+   }
+
+private:
+   static bool acquire(const char* owner)
+   {
+      const unsigned state = irq_disable();
+      const bool free = holder == NULL;
+      if(free) {
+         holder = owner;
+         used = 0;
+      }
+      irq_restore(state);
+      if(!free) printf("ScratchArena: %s cannot run while %s holds the arena\n", owner, holder);
+      return free;
+   }
+
+   static void release()
+   {
+      holder = NULL;
+   }
+
+   static uint8_t __attribute__((__aligned__(8))) pool[size];
+   static const char* volatile holder;
+   static size_t used;
+   static size_t high_water;
+};
+
+uint8_t ScratchArena::pool[ScratchArena::size];
+const char* volatile ScratchArena::holder = NULL;
+size_t ScratchArena::used = 0;
+size_t ScratchArena::high_water = 0;
+
+#endif
@@ -0,0 +1,152 @@
+/*
+ * Copyright (C) 2019 Florian Seybold
+ *
+ * This file is subject to the terms and conditions of the GNU Lesser
+ * General Public License v2.1. See the file LICENSE in the top level
+ * directory for more details.
+ */
+
+/**
+ * @ingroup     mechaduino_firmware
+ *
+ * @{
+ * @file
+ * @brief       Position PID and commutation math of one control tick
+ *
+ * Shared between Controller::run() and tools/replay, which feeds recorded
+ * ticks through it offline. Keep this header free of RIOT includes.
+ *
+ * @author      Florian Seybold <florian@seybold.space>
+ */
+
+#ifndef SERVOLOOP_HPP
+#define SERVOLOOP_HPP
+
+#include <stdint.h>
+#include <cmath>
+
+class ServoLoop
+{
+public:
+   /// Gains as applied, with the derivative filter coefficients derived
+   /// from its corner frequency
+   struct Gains {
+      float pKp;
+      float pKi;
+      float pKd;
+      float pLPFa;
+      float pLPFb;
+   };
+
+   /// Carried from tick to tick
+   struct State {
+      int32_t wrap_count;  //keeps track of how many revolutions the motor has gone though (so you can command angles outside of 0-360)
+      float y_1;
+      float yw_1;
+      float ITerm;
+      float DTerm;
+      float origin;        // deg, measured angle of position zero, set by homing
+   };
+
+   /// Intermediate terms of the last tick
+   struct Terms {
+      float y;             // measured angle, deg
+      float yw;            // wrapped angle, can exceed one revolution
+      float e;
+      float ITerm;
+      float DTerm;
+      float u;             // control effort, saturated
+      float angle;         // commutation angle handed to Motor::output()
+      int effort;          // magnitude handed to Motor::output()
+   };
+
+   /// pLPF is the corner of the derivative low pass in Hz, Fs the tick rate
+   void configure(const float& Fs, const float& pKp, const float& pKi, const float& pKd, const float& pLPF)
+   {
+      gains.pKp = pKp;
+      gains.pKi = pKi;
+      gains.pKd = pKd;
+      gains.pLPFa = exp(pLPF*-2.0*3.14159/Fs); // z = e^st pole mapping
+      gains.pLPFb = (1.0-gains.pLPFa);
+   }
+
+   void reset()
+   {
+      state = { 0, 0.0, 0.0, 0.0, 0.0, 0.0 };
+      terms = { 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0 };
+   }
+
+   /// Moves position zero to shift (deg) in the current frame
+   void shift(const float& shift)
+   {
+      state.origin += shift;
+      state.yw_1 -= shift;
+   }
+
+   /// Sample independent part of the tick, runs while the encoder frame is shifted
+   void prepare()
+   {
+      DTermDecay = gains.pLPFa*state.DTerm;
+   }
+
+   /// Rest of the tick from setpoint rk and measured angle y, after prepare().
+   /// uff is added to the effort before saturation.
+   const Terms& update(const float& rk, float y, const int& uMax, const float& uff = 0.0)
+   {
+      terms.y = y;
+      if ((y - state.y_1) < -180.0) state.wrap_count += 1;      //Check if we've rotated more than a full revolution (have we "wrapped" around from 359 degrees to 0 or ffrom 0 to 359?)
+      else if ((y - state.y_1) > 180.0) state.wrap_count -= 1;
+
+      float yw = (y + (360.0 * state.wrap_count)) - state.origin;  //yw is the wrapped angle (can exceed one revolution)
+
+      //Position control
+      float e = (rk - yw);
+
+      state.ITerm += (gains.pKi * e);                             //Integral wind up limit
+      if (state.ITerm > 150.0) state.ITerm = 150.0;
+      else if (state.ITerm < -150.0) state.ITerm = -150.0;
+
+      state.DTerm = DTermDecay -  gains.pLPFb*gains.pKd*(yw-state.yw_1);
+
+      float u = (gains.pKp * e) + state.ITerm + state.DTerm + uff;
+
+      state.y_1 = y;  //copy current value of y to previous value (y_1) for next control cycle before PA angle added
+
+      if (u > 0)          //Depending on direction we want to apply torque, add or subtract a phase angle of PA for max effective torque.  PA should be equal to one full step angle: if the excitation angle is the same as the current position, we would not move!
+      {                 //You can experiment with "Phase Advance" by increasing PA when operating at high speeds
+         y += PA;          //update phase excitation angle
+         if (u > uMax)     // limit control effort
+            u = uMax;       //saturation limits max current command
+      }
+      else
+      {
+         y -= PA;          //update phase excitation angle
+         if (u < -uMax)    // limit control effort
+            u = -uMax;      //saturation limits max current command
+      }
+
+      terms.yw = yw;
+      terms.e = e;
+      terms.ITerm = state.ITerm;
+      terms.DTerm = state.DTerm;
+      terms.u = u;
+      terms.angle = -y;
+      terms.effort = round(fabs(u));
+
+      state.yw_1 = yw;
+      return terms;
+   }
+
+   Gains gains = { 0.0, 0.0, 0.0, 0.0, 0.0 };
+   State state = { 0, 0.0, 0.0, 0.0, 0.0, 0.0 };
+   Terms terms = { 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0 };
+
+   const int spr = 200;                // 200 steps per revolution  -- for 400 step/rev, you should only need to edit this value
+   const float aps = 360.0/ spr;       // angle per step
+   const float PA = aps;            // Phase advance...aps = 1.8 for 200 steps per rev, 0.9 for 400
+
+private:
+   float DTermDecay = 0.0;
+};
+
+#endif
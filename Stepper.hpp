@@ -13,6 +13,13 @@
  * @file
  * @brief       Mechaduino stepper
  *
+ * Open loop stepping, either blocking in full steps (step(), used by the
+ * calibration) or as asynchronous moves in microsteps. A move is run by an
+ * xtimer callback that takes one microstep per expiry and sets the next
+ * expiry from a trapezoidal ramp (D. Austin, "Generate stepper-motor speed
+ * profiles in real time": c_n = c_(n-1) (4n-1)/(4n+1), no square roots in
+ * the callback). The coil current is picked per phase of the move.
+ *
  * @author      Florian Seybold <florian@seybold.space>
  */
 
@@ -20,53 +27,167 @@
 #define STEPPER_HPP
 
 #include <xtimer.h>
+#include <irq.h>
+
+#include <cmath>
 
 #include "Motor.hpp"
 
 class Stepper {
 public:
+   enum Phase { Idle, Accelerating, Cruising, Decelerating };
+
+   /// Coil current per phase of a move, as fractions of uMax
+   struct Currents {
+      float ramp;          // accelerating and decelerating
+      float run;           // cruising
+      float hold;          // standing still after a move
+   };
+
    Stepper(const Motor& motor_, const bool& dir_ = true)
       :  motor(motor_),
          dir(dir_)
-   { }
+   {
+      timer.callback = [](void* arg) { ((Stepper*)arg)->tick(); };
+      timer.arg = this;
+   }
 
    void step()
    {
       if (!dir) {
-         state += 1;
+         position_ += microsteps;
       }
       else {
-         state -= 1;
+         position_ -= microsteps;
       }
 
       //output(1.8 * stepNumber, 64); //updata 1.8 to aps..., second number is control effort
       //motor.output(motor.aps * stepNumber, (int)(0.33 * motor.uMax));
-      motor.output(motor.aps * state, (int)(0.33 * motor.uMax));
+      motor.output(angle(position_), (int)(0.33 * motor.uMax));
       xtimer_usleep(10000);
    }
 
+   /// Returns to step zero and waits until it is there
    void home()
    {
-      while (state != 0) {       //go to step zero
-         if (state > 0) {
-            dir = true;
-         }
-         else
-         {
-            dir = false;
-         }
-         step();
-         xtimer_usleep(100000);
-      }
+      if(move(-position(), home_vmax, home_amax)) wait();
+   }
+
+   /// One revolution in the direction of dir, returns at once
+   bool walkaround()
+   {
+      return move(dir ? -360.0 : 360.0);
+   }
+
+   /// Starts a move by distance deg at up to vmax deg/s, ramping with amax
+   /// deg/s^2 (0 for the defaults). Fails while another move runs.
+   bool move(const float& distance, const float& vmax = 0.0, const float& amax = 0.0)
+   {
+      const int32_t steps = lround(distance / step_angle());
+      if(phase != Idle) return false;
+      if(steps == 0) return true;
+
+      const float v = (vmax > 0.0 ? vmax : move_vmax) / step_angle();  // microsteps/s
+      const float a = (amax > 0.0 ? amax : move_amax) / step_angle();  // microsteps/s^2
+
+      direction = steps > 0 ? 1 : -1;
+      remaining = steps > 0 ? steps : -steps;
+      n = 0;
+      c = 0.676 * sqrt(2.0 / a) * 1000000.0;    // us, first interval with Austin's correction
+      c_min = 1000000.0 / v;
+      if(c_min < min_interval) c_min = min_interval;
+      if(c < c_min) c = c_min;
+      phase = Accelerating;
+      xtimer_set(&timer, min_interval);
+      return true;
    }
 
-   void walkaround()
+   bool move_to(const float& target, const float& vmax = 0.0, const float& amax = 0.0)
    {
-      for(int s=0; s<motor.spr; ++s) {
-         step();
+      return move(target - position(), vmax, amax);
+   }
+
+   /// Ramps a running move down to a standstill
+   void stop()
+   {
+      const unsigned state = irq_disable();
+      if(phase != Idle && remaining > n) {
+         remaining = n > 0 ? n : 1;
+         phase = Decelerating;
       }
+      irq_restore(state);
+   }
+
+   /// Ends a running move at once, without a ramp
+   void halt()
+   {
+      const unsigned state = irq_disable();
+      xtimer_remove(&timer);
+      if(phase != Idle) finish();
+      irq_restore(state);
+   }
+
+   /// Blocks the caller until the running move has ended
+   void wait() const
+   {
+      while(phase != Idle) xtimer_usleep(1000);
+   }
+
+   bool busy() const
+   {
+      return phase != Idle;
    }
 
+   Phase currentPhase() const
+   {
+      return phase;
+   }
+
+   /// deg from step zero
+   float position() const
+   {
+      return position_ * step_angle();
+   }
+
+   /// deg/s, of the current microstep interval
+   float velocity() const
+   {
+      const unsigned state = irq_disable();
+      const float v = phase == Idle ? 0.0 : direction * step_angle() * 1000000.0 / c;
+      irq_restore(state);
+      return v;
+   }
+
+   /// Subdivision of a full step, only changed while idle. Keeps the
+   /// position, rounded to the new microstep.
+   bool setMicrosteps(const int& m)
+   {
+      if(phase != Idle || m < 1 || m > 256) return false;
+      position_ = lround((float)position_ * m / microsteps);
+      microsteps = m;
+      return true;
+   }
+
+   int getMicrosteps() const
+   {
+      return microsteps;
+   }
+
+   float step_angle() const
+   {
+      return motor.aps / microsteps;
+   }
+
+   /// Called at the end of every move, from interrupt context
+   void (*on_done)(void* arg) = NULL;
+   void* on_done_arg = NULL;
+
+   Currents currents = { 0.5, 0.33, 0.33 };
+   float move_vmax = 360.0;      // default velocity in deg/s
+   float move_amax = 3600.0;     // default acceleration in deg/s^2
+   float home_vmax = 90.0;
+   float home_amax = 360.0;
+
    int dir;
    const Motor& motor;
 
@@ -76,8 +197,58 @@ private:
       return n ^ (n >> 1);
    }*/
 
-   int state = 0;
+   float angle(const int32_t p) const
+   {
+      return motor.aps * p / microsteps;
+   }
+
+   /// Takes one microstep and schedules the next
+   void tick()
+   {
+      if(phase == Idle) return;
+
+      position_ += direction;
+      const float current = phase == Cruising ? currents.run : currents.ramp;
+      motor.output(angle(position_), (int)(current * motor.uMax));
+
+      if(--remaining == 0) {
+         finish();
+         return;
+      }
+
+      if(remaining <= n) {                   // as many steps left as it took to accelerate
+         phase = Decelerating;
+         if(--n > 0) c = c * (4*n + 1) / (4*n - 1);
+      }
+      else if(phase == Accelerating) {
+         if(n > 0) c = c * (4*n - 1) / (4*n + 1);
+         ++n;
+         if(c <= c_min) {
+            c = c_min;
+            phase = Cruising;
+         }
+      }
+      xtimer_set(&timer, (uint32_t)c);
+   }
+
+   void finish()
+   {
+      phase = Idle;
+      motor.output(angle(position_), (int)(currents.hold * motor.uMax));
+      if(on_done) on_done(on_done_arg);
+   }
+
+   static const uint32_t min_interval = 50;  // us, the callback takes a good part of it on the M0+
 
+   xtimer_t timer = { };
+   volatile Phase phase = Idle;
+   volatile int32_t position_ = 0;           // microsteps from step zero
+   int microsteps = 16;
+   int direction = 1;
+   int32_t remaining = 0;                    // microsteps left in the move
+   int32_t n = 0;                            // microsteps taken while accelerating
+   float c = 0.0;                            // us, current interval
+   float c_min = 0.0;                        // us, interval at vmax
 };
 
 #endif
@@ -0,0 +1,173 @@
+/*
+ * Copyright (C) 2019 Florian Seybold
+ *
+ * This file is subject to the terms and conditions of the GNU Lesser
+ * General Public License v2.1. See the file LICENSE in the top level
+ * directory for more details.
+ */
+
+/**
+ * @ingroup     mechaduino_firmware
+ *
+ * @{
+ * @file
+ * @brief       Binary telemetry stream of control loop samples
+ *
+ * The control loop pushes one sample per tick into a single producer single
+ * consumer ring, a low priority thread drains it as COBS framed packets
+ * (see TelemetryFormat.hpp) to stdout. Decode with tools/telemetry2csv.
+ * The UART cannot carry every tick at 2kHz, pick a decimation that fits
+ * the baud rate; samples that do not fit are counted as dropped.
+ *
+ * @author      Florian Seybold <florian@seybold.space>
+ */
+
+#ifndef TELEMETRY_HPP
+#define TELEMETRY_HPP
+
+#include <thread.h>
+#include <xtimer.h>
+
+#include <stdio.h>
+
+#include "Cobs.hpp"
+#include "TelemetryFormat.hpp"
+
+#define ENABLE_DEBUG    (0)
+#include "debug.h"
+
+
+class Telemetry
+{
+public:
+   Telemetry(const char& priority_ = THREAD_PRIORITY_MAIN + 1)
+      : priority(priority_)
+   { }
+
+   /// Streams every decimation-th tick with the channels selected in mask
+   void start(const unsigned& decimation_ = 1, const uint8_t& mask_ = telemetry_all)
+   {
+      decimation = decimation_ > 0 ? decimation_ : 1;
+      mask = mask_ & telemetry_all;
+      decimation_count = 0;
+
+      if(go==true) return;
+
+      // After stop() the thread can still be writing a buffer or sleeping,
+      // the new one must not be created on its stack
+      const uint32_t t0 = xtimer_now_usec();
+      while(threadAlive() && xtimer_now_usec() - t0 < exit_timeout) xtimer_usleep(1000);
+      if(threadAlive()) {
+         puts("[Telemetry thread still running]");
+         return;
+      }
+
+      go=true;
+
+      pid = thread_create(thread_stack, sizeof(thread_stack),
+         priority,
+         THREAD_CREATE_STACKTEST,
+         [](void* arg)->void*{ return ((Telemetry*)arg)->run(); },
+         (void*)this,
+         "telemetry");
+
+      DEBUG("Telemetry::start(): Created thread %i...\n", pid);
+   }
+
+   void stop()
+   {
+      go=false;
+   }
+
+   /// Called by the control loop each tick, never blocks
+   void push(const TelemetrySample& s)
+   {
+      if(!go) return;
+      if(++decimation_count < decimation) return;
+      decimation_count = 0;
+
+      const unsigned h = head;
+      const unsigned next = (h + 1) & (capacity - 1);
+      if(next == tail) {
+         ++dropped;
+         return;
+      }
+      buffer[h] = s;
+      __asm__ volatile("" ::: "memory");   // sample complete before it is published
+      head = next;
+   }
+
+   void printStats() const
+   {
+      printf("telemetry: %s, decimation=%u, mask=0x%02x, sent=%lu, dropped=%lu\n",
+         go ? "running" : "stopped", decimation, mask, (unsigned long)sent, (unsigned long)dropped);
+   }
+
+private:
+   /// Whether the thread of an earlier start() has not exited yet, see
+   /// ActionServer::threadAlive()
+   bool threadAlive() const
+   {
+      const char* t = pid != KERNEL_PID_UNDEF ? (const char*)thread_get(pid) : NULL;
+      return t >= thread_stack && t < thread_stack + sizeof(thread_stack);
+   }
+
+   void* run()
+   {
+      DEBUG("Telemetry::run(): Entering...\n");
+
+      static const uint8_t delimiter = 0;
+      fwrite(&delimiter, 1, 1, stdout);   // terminates whatever the decoder saw before
+
+      while(go)
+      {
+         size_t n = 0;
+         while(tail != head && n + max_frame <= sizeof(out)) {
+            const unsigned t = tail;
+            uint8_t packet[telemetry_max_packet];
+            const size_t len = telemetry_pack(buffer[t], mask, packet);
+            __asm__ volatile("" ::: "memory");   // sample read before its slot is released
+            tail = (t + 1) & (capacity - 1);
+
+            n += cobs_encode(packet, len, out + n);
+            out[n++] = 0;
+            ++sent;
+         }
+
+         if(n > 0) {
+            fwrite(out, 1, n, stdout);
+            fflush(stdout);
+         }
+         else {
+            xtimer_usleep(drain_period);
+         }
+      }
+
+      tail = head;
+      return NULL;
+   }
+
+   static const unsigned capacity = 64;    // samples, power of two
+   static const size_t max_frame = telemetry_max_packet + telemetry_max_packet / 254 + 2;
+   const uint32_t drain_period = 2000;     // us between polls of an empty ring
+   const uint32_t exit_timeout = 100000;   // us for a stopped thread to write out its buffer and exit
+
+   const char priority;
+   char thread_stack[THREAD_STACKSIZE_DEFAULT];
+   volatile bool go = false;
+   kernel_pid_t pid = KERNEL_PID_UNDEF;
+
+   TelemetrySample buffer[capacity];
+   volatile unsigned head = 0;    // written by the control loop only
+   volatile unsigned tail = 0;    // written by the drain thread only
+
+   unsigned decimation = 1;
+   unsigned decimation_count = 0;
+   uint8_t mask = telemetry_all;
+
+   uint8_t out[8 * max_frame];
+   uint32_t sent = 0;
+   uint32_t dropped = 0;
+};
+
+#endif
@@ -0,0 +1,100 @@
+/*
+ * Copyright (C) 2019 Florian Seybold
+ *
+ * This file is subject to the terms and conditions of the GNU Lesser
+ * General Public License v2.1. See the file LICENSE in the top level
+ * directory for more details.
+ */
+
+/**
+ * @ingroup     mechaduino_firmware
+ *
+ * @{
+ * @file
+ * @brief       Telemetry sample and packet layout
+ *
+ * Shared between the firmware and tools/telemetry2csv, keep this header
+ * free of RIOT includes. A packet (little endian, before COBS framing) is
+ * version, channel mask, tick, one float per selected channel in channel
+ * order and a crc32 over everything before it.
+ *
+ * @author      Florian Seybold <florian@seybold.space>
+ */
+
+#ifndef TELEMETRYFORMAT_HPP
+#define TELEMETRYFORMAT_HPP
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "Crc.hpp"
+
+enum TelemetryChannel {
+   telemetry_r,        // setpoint
+   telemetry_yw,       // wrapped angle
+   telemetry_e,        // following error
+   telemetry_u,        // saturated control effort
+   telemetry_ITerm,
+   telemetry_DTerm,
+   telemetry_channels
+};
+
+static const char* const telemetry_channel_names[telemetry_channels] = { "r", "yw", "e", "u", "ITerm", "DTerm" };
+
+static const uint8_t telemetry_version = 1;
+static const uint8_t telemetry_all = (1 << telemetry_channels) - 1;
+
+/// Maximum packet size before framing
+static const size_t telemetry_max_packet = 2 + sizeof(uint32_t) + telemetry_channels * sizeof(float) + sizeof(uint32_t);
+
+struct TelemetrySample {
+   uint32_t tick;
+   float channel[telemetry_channels];
+};
+
+/// Packs the channels selected by mask, returns the packet length
+inline size_t telemetry_pack(const TelemetrySample& s, const uint8_t& mask, uint8_t* out)
+{
+   size_t n = 0;
+   out[n++] = telemetry_version;
+   out[n++] = mask;
+   memcpy(out + n, &s.tick, sizeof(s.tick));
+   n += sizeof(s.tick);
+   for(int c = 0; c < telemetry_channels; ++c) {
+      if(!(mask & (1 << c))) continue;
+      memcpy(out + n, &s.channel[c], sizeof(float));
+      n += sizeof(float);
+   }
+   const uint32_t crc = crc32(out, n);
+   memcpy(out + n, &crc, sizeof(crc));
+   return n + sizeof(crc);
+}
+
+/// Unpacks and checks a packet, unselected channels are left untouched
+inline bool telemetry_unpack(const uint8_t* in, const size_t& len, TelemetrySample& s, uint8_t& mask)
+{
+   if(len < 2 + sizeof(uint32_t) + sizeof(uint32_t) || in[0] != telemetry_version) return false;
+
+   mask = in[1] & telemetry_all;
+   size_t n = 2 + sizeof(uint32_t);
+   for(int c = 0; c < telemetry_channels; ++c)
+      if(mask & (1 << c)) n += sizeof(float);
+   if(len != n + sizeof(uint32_t)) return false;
+
+   uint32_t crc;
+   memcpy(&crc, in + n, sizeof(crc));
+   if(crc != crc32(in, n)) return false;
+
+   n = 2;
+   memcpy(&s.tick, in + n, sizeof(s.tick));
+   n += sizeof(s.tick);
+   for(int c = 0; c < telemetry_channels; ++c) {
+      if(!(mask & (1 << c))) continue;
+      memcpy(&s.channel[c], in + n, sizeof(float));
+      n += sizeof(float);
+   }
+   return true;
+}
+
+#endif
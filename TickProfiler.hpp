@@ -0,0 +1,178 @@
+/*
+ * Copyright (C) 2019 Florian Seybold
+ *
+ * This file is subject to the terms and conditions of the GNU Lesser
+ * General Public License v2.1. See the file LICENSE in the top level
+ * directory for more details.
+ */
+
+/**
+ * @ingroup     mechaduino_firmware
+ *
+ * @{
+ * @file
+ * @brief       Section level profile of the control tick
+ *
+ * The tick is split into consecutive sections in the order of the enum.
+ * begin() opens the first one, each lap() closes the running section and
+ * opens the next, so one CycleCounter read times each section. Counts,
+ * mean and maximum per section are kept while enabled.
+ *
+ * One section can drive the TEST1 pin (D3, PA09) high while it runs, for
+ * timing it on a scope as mechaduino_params.h did with TEST1_HIGH() and
+ * TEST1_LOW(). The pin write adds its own time to the profile.
+ *
+ * @author      Florian Seybold <florian@seybold.space>
+ */
+
+#ifndef TICKPROFILER_HPP
+#define TICKPROFILER_HPP
+
+#include <stdio.h>
+#include <string.h>
+
+#include <periph/gpio.h>
+
+#include "arduino_pinmap.h"
+#include "CycleCounter.hpp"
+
+// Section timing output, TEST1 (D3) in mechaduino_params.h
+static const gpio_t profiler_pin = ARDUINO_PIN_3;
+
+class TickProfiler
+{
+public:
+   enum Section {
+      Setpoint,      // encoder frame start, commands, parameters, profile, sample independent terms
+      EncoderRead,   // finishing and validating the encoder read
+      Lookup,        // count to angle through the calibration table, cogging effort at it
+      Record,        // Recorder::push()
+      Pid,           // ServoLoop::update()
+      Commutation,   // Motor::commutate()
+      Output,        // Motor::apply(), PWM and direction pins
+      Report,        // telemetry, scope, velocity estimate and snapshot
+      sections
+   };
+
+   /// Starts profiling, from zero
+   void enable()
+   {
+      CycleCounter::init();
+      reset();
+      enabled = true;
+   }
+
+   void disable()
+   {
+      enabled = false;
+      if(pin_section < sections) gpio_clear(profiler_pin);
+   }
+
+   /// Clears the accumulators before the next tick
+   void reset()
+   {
+      reset_pending = true;
+   }
+
+   /// Selects the section that drives TEST1 high, sections for none
+   void pin(const Section& s)
+   {
+      if(s < sections) gpio_init(profiler_pin, GPIO_OUT);
+      else if(pin_section < sections) gpio_clear(profiler_pin);
+      pin_section = s;
+   }
+
+   /// Section named name, sections if there is none
+   static Section find(const char* name)
+   {
+      for(unsigned s = 0; s < sections; ++s) {
+         if(strcmp(name, names[s]) == 0) return (Section)s;
+      }
+      return sections;
+   }
+
+   /// Opens the first section of a tick
+   void begin()
+   {
+      if(!enabled) return;
+
+      if(reset_pending) {
+         memset(stats, 0, sizeof(stats));
+         memset(&tick, 0, sizeof(tick));
+         reset_pending = false;
+      }
+      if(pin_section == 0) gpio_set(profiler_pin);
+      section = 0;
+      start = mark = CycleCounter::now();
+   }
+
+   /// Closes section s and opens the next one, or ends the tick after the last
+   void lap(const Section& s)
+   {
+      if(!enabled) return;
+
+      const uint32_t now = CycleCounter::now();
+      if(s != section) {         // out of order, e.g. enabled mid tick
+         mark = now;
+         return;
+      }
+      if(pin_section == s) gpio_clear(profiler_pin);
+      else if(pin_section == s + 1u) gpio_set(profiler_pin);
+
+      add(stats[s], (now - mark) & CycleCounter::mask);
+      mark = now;
+      if(++section == sections) add(tick, (now - start) & CycleCounter::mask);
+   }
+
+   /// Prints the breakdown, budget is the tick period in us
+   void print(const uint32_t& budget) const
+   {
+      const float period = (float)budget * CycleCounter::per_us();
+      printf("%-12s %10s %10s %10s %7s\n", "section", "calls", "mean", "max", "tick %");
+      for(unsigned s = 0; s < sections; ++s) {
+         printf("%-12s %10lu %10.1f %10lu %6.1f%%%s\n", names[s], (unsigned long)stats[s].calls, mean(stats[s]),
+                (unsigned long)stats[s].max, 100.0 * mean(stats[s]) / period, pin_section == s ? "  (TEST1)" : "");
+      }
+      printf("%-12s %10lu %10.1f %10lu %6.1f%%\n", "tick", (unsigned long)tick.calls, mean(tick),
+             (unsigned long)tick.max, 100.0 * mean(tick) / period);
+      printf("%s, budget %.0f per %lu us tick%s\n", CycleCounter::unit(), period, (unsigned long)budget,
+             enabled ? "" : ", profiling off");
+   }
+
+   static const char* const names[sections];
+
+private:
+   struct Stats {
+      uint32_t calls;
+      uint32_t max;
+      uint64_t total;
+   };
+
+   static void add(Stats& s, const uint32_t& t)
+   {
+      ++s.calls;
+      s.total += t;
+      if(t > s.max) s.max = t;
+   }
+
+   static float mean(const Stats& s)
+   {
+      return s.calls ? (float)s.total / s.calls : 0.0;
+   }
+
+   volatile bool enabled = false;
+   volatile bool reset_pending = false;
+   volatile unsigned pin_section = sections;
+
+   unsigned section = sections;
+   uint32_t start = 0;
+   uint32_t mark = 0;
+   Stats stats[sections] = { };
+   Stats tick = { 0, 0, 0 };
+};
+
+const char* const TickProfiler::names[TickProfiler::sections] = {
+   "setpoint", "encoder", "lookup", "record", "pid", "commutation", "output", "report"
+};
+
+#endif
@@ -0,0 +1,526 @@
+/*
+ * Copyright (C) 2019 Florian Seybold
+ *
+ * This file is subject to the terms and conditions of the GNU Lesser
+ * General Public License v2.1. See the file LICENSE in the top level
+ * directory for more details.
+ */
+
+/**
+ * @ingroup     mechaduino_firmware
+ *
+ * @{
+ * @file
+ * @brief       Servo performance regression suite
+ *
+ * Runs the unmodified Controller against the simulated plant (Plant.hpp) on
+ * a virtual clock through a fixed set of scenarios and measures rise time,
+ * overshoot, settling time, following error and peak phase current.
+ *
+ *    bench [-o results.csv] [-l limits.csv] [-t dir] [param=value ...]
+ *
+ * Results are written as CSV, one metric per line, -t additionally writes
+ * the trace of every scenario to dir/<scenario>.csv. Every metric that has a
+ * limit in the limits file is checked against it and the exit status is 1
+ * if any of them is exceeded. Parameters (see 'param list') can be
+ * overridden to compare tunings.
+ *
+ * @author      Florian Seybold <florian@seybold.space>
+ */
+
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cmath>
+#include <string>
+#include <vector>
+
+#include "Motor.hpp"
+#include "Encoder.hpp"
+#include "Params.hpp"
+#include "Telemetry.hpp"
+#include "Scope.hpp"
+#include "Recorder.hpp"
+#include "Controller.hpp"
+
+/// Sends stdout to /dev/null until restore(), the firmware objects announce
+/// their defaults on construction (the encoder its built-in lookup table)
+struct Muted {
+   Muted()
+   {
+      fflush(stdout);
+      saved = dup(STDOUT_FILENO);
+      const int null = open("/dev/null", O_WRONLY);
+      dup2(null, STDOUT_FILENO);
+      close(null);
+   }
+
+   void restore()
+   {
+      fflush(stdout);
+      dup2(saved, STDOUT_FILENO);
+      close(saved);
+   }
+
+   int saved;
+};
+
+/// Firmware objects as main() wires them, built fresh for every scenario
+struct Rig : private Muted {
+   Rig()
+      : controller(motor, encoder, params, telemetry, scope, recorder, 0)
+   {
+      restore();
+   }
+
+   Motor motor;
+   Encoder encoder;
+   Params params;
+   Telemetry telemetry;
+   Scope scope;
+   Recorder recorder;
+   Controller controller;
+};
+
+struct Event {
+   enum Kind { Set, Move, Queue, Load, Stop, Home, Learn, Cogging, Belt, Shape, Slip } kind;
+   float time;          // s from scenario start
+   float value;         // deg, Nm for Load, plant angle of the lower hard stop for Stop, direction for Home, s for Learn,
+                        // Nm/rad of belt stiffness for Belt, Hz for Shape, deg the sensor jumps by for Slip
+   float vmax;          // deg/s, Move and Queue only, Nm s/rad of belt damping for Belt, damping ratio for Shape
+   float amax;          // deg/s^2, Move and Queue only, kg m^2 of load inertia for Belt, InputShaper::Type for Shape
+};
+
+/// What is measured, from the time of the event under test (mark) on
+enum Measure {
+   Step,                // rise_time, overshoot, settling_time, peak_current
+   Track,               // rms_error, peak_error, peak_current within [mark, until]
+   Disturbance,         // peak_error, settling_time, peak_current
+   Reversal,            // rms_error, peak_error, settling_time, peak_current
+   Path,                // path_time, settling_time, peak_error, peak_current
+   Home,                // homing_time, home_error, home_repeat, peak_current
+   Learning,            // first_rms within [mark, until], last_rms in as long a window at the end, peak_current
+   Cogging,             // rms_before within [mark, until], rms_after in as long a window at the end, peak_current
+   Vibration,           // load_settling_time, residual (of the load once the setpoint is at target), peak_current
+   Jump                 // resyncs and outliers of the encoder validation, peak_current
+};
+
+struct Scenario {
+   const char* name;
+   std::vector<Event> events;
+   float duration;      // s
+   Measure measure;
+   float mark;          // s, start of the measured part
+   float until;         // s, end of the tracking window
+   float from;          // deg, position before the step
+   float target;        // deg, final position
+   float band;          // deg, settled when the position stays within target +/- band, 0 to not measure settling
+};
+
+struct Sample {
+   float t;             // s
+   float setpoint;      // deg
+   float position;      // deg
+   float error;         // deg
+   float current;       // A, phase current magnitude
+   float load;          // deg, plant angle of the load, not written to the trace
+};
+
+struct Result {
+   std::string scenario;
+   std::string metric;
+   float value;
+};
+
+static Rig* rig = NULL;
+static const Scenario* scenario = NULL;
+static std::vector<Sample> trace;
+static unsigned next_event = 0;
+static uint64_t t0 = 0;
+
+/// A homing run that has ended with the zero set
+struct Homed {
+   float time;          // s the run took
+   float contact;       // deg, in the frame before the run
+   float zero;          // deg, plant angle of the new zero
+};
+
+static std::vector<Homed> homed;
+static Homing::State homing_state = Homing::Idle;
+
+/// Runs at every controller wakeup: fires due events and records the state
+/// left by the previous tick
+static void on_wakeup(uint64_t now)
+{
+   const float t = (now - t0) * 1e-6;
+   Controller& c = rig->controller;
+
+   while(next_event < scenario->events.size() && scenario->events[next_event].time <= t) {
+      const Event& e = scenario->events[next_event++];
+      switch(e.kind) {
+         case Event::Set: c.set(e.value); break;
+         case Event::Move: c.move_to(e.value, e.vmax, e.amax); break;
+         case Event::Queue: c.queue(e.value, e.vmax, e.amax); break;
+         case Event::Load: Motor::plant.load_torque = e.value; break;
+         case Event::Stop: Motor::plant.stop_low = e.value; break;
+         case Event::Home: c.home(e.value); break;
+         case Event::Learn: c.learn(e.value); break;
+         case Event::Cogging: c.sweepCogging(); break;
+         case Event::Belt:
+            Motor::plant.load_inertia = e.amax;
+            Motor::plant.belt(e.value, e.vmax);
+            break;
+         case Event::Shape: c.shape((InputShaper::Type)e.amax, e.value, e.vmax); break;
+         case Event::Slip: Motor::plant.slip += e.value; break;
+      }
+   }
+
+   const Homing& h = c.homing;
+   if(h.state() != homing_state && h.state() == Homing::Done)
+      homed.push_back({ h.time(), h.contact(), (float)Motor::plant.angle() - c.position() });
+   homing_state = h.state();
+
+   const Controller::Snapshot s = c.snapshot();
+   const Plant& p = Motor::plant;
+   trace.push_back({ t, s.setpoint, s.position, s.error, (float)sqrt(p.i_A * p.i_A + p.i_B * p.i_B), (float)p.loadAngle() });
+
+   if(t >= scenario->duration) c.stop();
+}
+
+static float rise_time(const Scenario& s)
+{
+   const float step = s.target - s.from;
+   float t10 = -1.0, t90 = -1.0;
+   for(const Sample& x : trace) {
+      if(x.t < s.mark) continue;
+      const float done = (x.position - s.from) / step;
+      if(t10 < 0.0 && done >= 0.1) t10 = x.t;
+      if(t90 < 0.0 && done >= 0.9) t90 = x.t;
+   }
+   return (t10 < 0.0 || t90 < 0.0) ? s.duration : t90 - t10;
+}
+
+static float overshoot(const Scenario& s)
+{
+   const float step = s.target - s.from;
+   float peak = 0.0;
+   for(const Sample& x : trace) {
+      if(x.t < s.mark) continue;
+      const float over = (x.position - s.target) / step;
+      if(over > peak) peak = over;
+   }
+   return 100.0 * peak;
+}
+
+static float settling_time(const Scenario& s)
+{
+   float last = s.mark;
+   for(const Sample& x : trace) {
+      if(x.t >= s.mark && fabs(x.position - s.target) > s.band) last = x.t;
+   }
+   return last - s.mark;
+}
+
+/// settling_time() of the load, in the plant frame that starts at 0
+static float load_settling_time(const Scenario& s)
+{
+   float last = s.mark;
+   for(const Sample& x : trace) {
+      if(x.t >= s.mark && fabs(x.load - s.target) > s.band) last = x.t;
+   }
+   return last - s.mark;
+}
+
+/// Largest distance of the load from the target once the setpoint is there
+static float residual(const Scenario& s)
+{
+   float peak = 0.0;
+   bool arrived = false;
+   for(const Sample& x : trace) {
+      if(x.t >= s.mark && fabs(x.setpoint - s.target) < 1e-3) arrived = true;
+      if(arrived && fabs(x.load - s.target) > peak) peak = fabs(x.load - s.target);
+   }
+   return arrived ? peak : 360.0;
+}
+
+/// Time the setpoint takes to reach the target
+static float path_time(const Scenario& s)
+{
+   for(const Sample& x : trace) {
+      if(x.t >= s.mark && x.setpoint == s.target) return x.t - s.mark;
+   }
+   return s.duration;
+}
+
+/// Time of the first homing run
+static float homing_time(const Scenario& s)
+{
+   return homed.empty() ? s.duration : homed[0].time;
+}
+
+/// Distance of the first run's zero from target in plant angle
+static float home_error(const Scenario& s)
+{
+   return homed.empty() ? 360.0 : fabs(homed[0].zero - s.target);
+}
+
+/// Largest distance of a later run's zero from the first run's
+static float home_repeat()
+{
+   float worst = homed.size() < 2 ? 360.0 : 0.0;
+   for(const Homed& x : homed) {
+      if(fabs(x.zero - homed[0].zero) > worst) worst = fabs(x.zero - homed[0].zero);
+   }
+   return worst;
+}
+
+static float rms_error(const Scenario& s, const float& until)
+{
+   double sum = 0.0;
+   unsigned n = 0;
+   for(const Sample& x : trace) {
+      if(x.t < s.mark || x.t > until) continue;
+      sum += x.error * x.error;
+      ++n;
+   }
+   return n ? sqrt(sum / n) : 0.0;
+}
+
+/// rms_error() over the last stretch as long as [mark, until]
+static float last_rms(const Scenario& s)
+{
+   double sum = 0.0;
+   unsigned n = 0;
+   for(const Sample& x : trace) {
+      if(x.t <= s.duration - (s.until - s.mark)) continue;
+      sum += x.error * x.error;
+      ++n;
+   }
+   return n ? sqrt(sum / n) : 0.0;
+}
+
+static float peak_error(const Scenario& s, const float& until)
+{
+   float peak = 0.0;
+   for(const Sample& x : trace) {
+      if(x.t >= s.mark && x.t <= until && fabs(x.error) > peak) peak = fabs(x.error);
+   }
+   return peak;
+}
+
+static float peak_current(const Scenario& s, const float& until)
+{
+   float peak = 0.0;
+   for(const Sample& x : trace) {
+      if(x.t >= s.mark && x.t <= until && x.current > peak) peak = x.current;
+   }
+   return peak;
+}
+
+static bool write_trace(const char* dir, const Scenario& s)
+{
+   const std::string path = std::string(dir) + "/" + s.name + ".csv";
+   FILE* f = fopen(path.c_str(), "w");
+   if(!f) {
+      perror(path.c_str());
+      return false;
+   }
+   fprintf(f, "t,setpoint,position,error,current\n");
+   for(const Sample& x : trace) fprintf(f, "%f,%f,%f,%f,%f\n", x.t, x.setpoint, x.position, x.error, x.current);
+   fclose(f);
+   return true;
+}
+
+static bool run(const Scenario& s, const std::vector<std::string>& overrides, std::vector<Result>& results)
+{
+   Motor::plant = Plant();
+   Rig r;
+   for(const std::string& o : overrides) {
+      const size_t eq = o.find('=');
+      if(!r.params.set(o.substr(0, eq).c_str(), o.substr(eq + 1).c_str())) {
+         fprintf(stderr, "bench: cannot set parameter %s\n", o.c_str());
+         return false;
+      }
+   }
+
+   rig = &r;
+   scenario = &s;
+   trace.clear();
+   homed.clear();
+   homing_state = Homing::Idle;
+   next_event = 0;
+   t0 = host::now();
+
+   host::wakeup_hook() = on_wakeup;
+   r.controller.start();
+   host::run();
+   host::wakeup_hook() = NULL;
+
+   const float end = s.measure == Track ? s.until : s.duration;
+   auto add = [&](const char* metric, const float& value) { results.push_back({ s.name, metric, value }); };
+   switch(s.measure) {
+      case Step:
+         add("rise_time", rise_time(s));
+         add("overshoot", overshoot(s));
+         if(s.band > 0.0) add("settling_time", settling_time(s));
+         break;
+      case Track:
+         add("rms_error", rms_error(s, end));
+         add("peak_error", peak_error(s, end));
+         break;
+      case Disturbance:
+         add("peak_error", peak_error(s, end));
+         if(s.band > 0.0) add("settling_time", settling_time(s));
+         break;
+      case Reversal:
+         add("rms_error", rms_error(s, end));
+         add("peak_error", peak_error(s, end));
+         if(s.band > 0.0) add("settling_time", settling_time(s));
+         break;
+      case Path:
+         add("path_time", path_time(s));
+         if(s.band > 0.0) add("settling_time", settling_time(s));
+         add("peak_error", peak_error(s, end));
+         break;
+      case Learning:
+         add("first_rms", rms_error(s, s.until));
+         add("last_rms", last_rms(s));
+         break;
+      case Cogging:
+         add("rms_before", rms_error(s, s.until));
+         add("rms_after", last_rms(s));
+         break;
+      case Vibration:
+         add("load_settling_time", load_settling_time(s));
+         add("residual", residual(s));
+         break;
+      case Jump:
+         add("resyncs", r.encoder.stats.resyncs);
+         add("outliers", r.encoder.stats.outliers);
+         break;
+      case Home:
+         add("homing_time", homing_time(s));
+         add("home_error", home_error(s));
+         add("home_repeat", home_repeat());
+         break;
+   }
+   add("peak_current", peak_current(s, end));
+   return true;
+}
+
+/// Limits file: one "scenario,metric,limit" per line, # starts a comment
+static bool load_limits(const char* path, std::vector<Result>& limits)
+{
+   FILE* f = fopen(path, "r");
+   if(!f) {
+      perror(path);
+      return false;
+   }
+
+   char line[256];
+   while(fgets(line, sizeof(line), f)) {
+      char name[64], metric[64];
+      float limit;
+      if(line[0] == '#' || line[0] == '\n') continue;
+      if(sscanf(line, "%63[^,],%63[^,],%f", name, metric, &limit) == 3) limits.push_back({ name, metric, limit });
+      else fprintf(stderr, "bench: ignoring limits line: %s", line);
+   }
+   fclose(f);
+   return true;
+}
+
+/// Pick and place like path: n segments of length each, all queued at 0.2 s
+static std::vector<Event> path(const unsigned& n, const float& length, const float& vmax, const float& amax)
+{
+   std::vector<Event> events;
+   for(unsigned i = 1; i <= n; ++i) events.push_back({ Event::Queue, 0.2, i * length, vmax, amax });
+   return events;
+}
+
+/// n repetitions of a move by distance and back every period, from 0.2 s
+/// on, learnt over all but the last 20 ms of each period
+static std::vector<Event> cycles(const unsigned& n, const float& period, const float& distance, const float& vmax, const float& amax)
+{
+   std::vector<Event> events = { { Event::Learn, 0.0, period - 0.02f } };
+   for(unsigned i = 0; i < n; ++i) {
+      events.push_back({ Event::Move, 0.2f + i * period, distance, vmax, amax });
+      events.push_back({ Event::Move, 0.2f + (i + 0.5f) * period, 0.0, vmax, amax });
+   }
+   return events;
+}
+
+int main(int argc, char** argv)
+{
+   const char* output = "results.csv";
+   const char* limits_path = "limits.csv";
+   const char* trace_dir = NULL;
+   std::vector<std::string> overrides;
+
+   for(int i = 1; i < argc; ++i) {
+      if(strcmp(argv[i], "-o") == 0 && i + 1 < argc) output = argv[++i];
+      else if(strcmp(argv[i], "-l") == 0 && i + 1 < argc) limits_path = argv[++i];
+      else if(strcmp(argv[i], "-t") == 0 && i + 1 < argc) trace_dir = argv[++i];
+      else if(strchr(argv[i], '=')) overrides.push_back(argv[i]);
+      else {
+         fprintf(stderr, "usage: bench [-o results.csv] [-l limits.csv] [-t dir] [param=value ...]\n");
+         return 2;
+      }
+   }
+
+   std::vector<Result> limits;
+   if(!load_limits(limits_path, limits)) return 2;
+
+   const Scenario scenarios[] = {
+      { "step_small", { { Event::Set, 0.2, 1.8 } }, 0.6, Step, 0.2, 0.0, 0.0, 1.8, 0.05 },
+      { "step_large", { { Event::Set, 0.2, 90.0 } }, 0.8, Step, 0.2, 0.0, 0.0, 90.0, 0.0 },
+      { "track", { { Event::Move, 0.2, 3600.0, 1800.0, 18000.0 } }, 2.4, Track, 0.4, 2.0, 0.0, 3600.0, 0.1 },
+      { "disturbance", { { Event::Load, 0.2, 0.05 } }, 0.6, Disturbance, 0.2, 0.0, 0.0, 0.0, 0.1 },
+      { "reversal", { { Event::Move, 0.2, 360.0, 1800.0, 18000.0 }, { Event::Move, 0.35, 0.0, 1800.0, 18000.0 } },
+        1.5, Reversal, 0.35, 0.0, 0.0, 0.0, 0.0 },
+      { "path", path(10, 36.0, 1800.0, 18000.0), 1.2, Path, 0.2, 0.0, 0.0, 360.0, 0.0 },
+      { "homing", { { Event::Stop, 0.0, -120.0 }, { Event::Home, 0.2, -1.0 }, { Event::Move, 1.2, 200.0, 1800.0, 18000.0 },
+                    { Event::Home, 1.6, -1.0 } }, 3.0, Home, 0.2, 0.0, 0.0, -115.0, 0.0 },
+      { "learning", cycles(20, 0.4, 30.0, 400.0, 4000.0), 8.2, Learning, 0.2, 0.6, 0.0, 0.0, 0.0 },
+      { "cogging", { { Event::Move, 0.2, 30.0, 20.0, 200.0 }, { Event::Cogging, 2.0, 0.0 }, { Event::Move, 20.0, 60.0, 20.0, 200.0 } },
+        21.4, Cogging, 0.4, 1.6, 0.0, 0.0, 0.0 },
+      { "belt", { { Event::Belt, 0.0, 0.077, 2e-4, 5e-5 }, { Event::Move, 0.2, 30.0, 1800.0, 36000.0 } },
+        3.0, Vibration, 0.2, 0.0, 0.0, 30.0, 0.5 },
+      { "shaped", { { Event::Belt, 0.0, 0.077, 2e-4, 5e-5 }, { Event::Shape, 0.0, 6.25, 0.05, InputShaper::ZVD },
+                    { Event::Move, 0.2, 30.0, 1800.0, 36000.0 } }, 1.5, Vibration, 0.2, 0.0, 0.0, 30.0, 0.5 },
+      { "jump", { { Event::Slip, 0.2, 14.4 } }, 0.6, Jump, 0.2, 0.0, 0.0, 0.0, 0.0 },
+   };
+
+   std::vector<Result> results;
+   for(const Scenario& s : scenarios) {
+      if(!run(s, overrides, results)) return 2;
+      if(trace_dir && !write_trace(trace_dir, s)) return 2;
+   }
+
+   FILE* out = fopen(output, "w");
+   if(!out) {
+      perror(output);
+      return 2;
+   }
+   fprintf(out, "scenario,metric,value,limit,result\n");
+
+   unsigned failed = 0;
+   for(const Result& r : results) {
+      const Result* limit = NULL;
+      for(const Result& l : limits) {
+         if(l.scenario == r.scenario && l.metric == r.metric) limit = &l;
+      }
+
+      const bool ok = !limit || r.value <= limit->value;
+      if(!ok) ++failed;
+
+      char limit_text[32] = "";
+      if(limit) snprintf(limit_text, sizeof(limit_text), "%g", limit->value);
+      fprintf(out, "%s,%s,%g,%s,%s\n", r.scenario.c_str(), r.metric.c_str(), r.value, limit_text, limit ? (ok ? "ok" : "FAIL") : "");
+      printf("%-12s %-14s %12.6f %12s  %s\n", r.scenario.c_str(), r.metric.c_str(), r.value, limit_text, limit ? (ok ? "ok" : "FAIL") : "");
+   }
+   fclose(out);
+
+   if(failed) printf("%u metric(s) over their limit\n", failed);
+   return failed ? 1 : 0;
+}
@@ -0,0 +1,105 @@
+/*
+ * Copyright (C) 2019 Florian Seybold
+ *
+ * This file is subject to the terms and conditions of the GNU Lesser
+ * General Public License v2.1. See the file LICENSE in the top level
+ * directory for more details.
+ */
+
+/**
+ * @ingroup     mechaduino_firmware
+ *
+ * @{
+ * @file
+ * @brief       Host microbenchmarks of the control loop's hot path
+ *
+ * Runs the set from Microbench.hpp and times whole control ticks, all with
+ * the peripherals mocked: the clock is frozen, so the simulated plant does
+ * not integrate and the encoder read costs only the count lookup. A second
+ * run with the TickProfiler on breaks the tick down into its sections.
+ *
+ *    microbench [calls per batch] [batches]
+ *
+ * @author      Florian Seybold <florian@seybold.space>
+ */
+
+#include <cstdlib>
+
+#include "Microbench.hpp"
+#include "Params.hpp"
+#include "Telemetry.hpp"
+#include "Scope.hpp"
+#include "Recorder.hpp"
+#include "Controller.hpp"
+
+static Controller* controller = NULL;
+static unsigned calls = 1000;
+static unsigned batches = 1000;
+
+static unsigned tick = 0;
+static unsigned batch = 0;
+static uint32_t t0 = 0;
+static float m2 = 0.0;
+static Microbench::Stats ticks = { 0, 0.0, 0.0, 0.0 };
+static bool profiling = false;
+
+/// Called at every wakeup, times batches of whole loop iterations
+static void on_wakeup(uint64_t)
+{
+   if(tick++ < calls) return;
+
+   const float per_call = (float)CycleCounter::elapsed(t0) / calls;
+   if(batch++ > 0 && !profiling) {    // the first batch includes the loop's setup
+      ++ticks.batches;
+      const float delta = per_call - ticks.mean;
+      ticks.mean += delta / ticks.batches;
+      m2 += delta * (per_call - ticks.mean);
+      if(ticks.batches == 1 || per_call < ticks.min) ticks.min = per_call;
+   }
+
+   if(batch > batches) controller->stop();
+   tick = 1;
+   t0 = CycleCounter::now();
+}
+
+int main(int argc, char** argv)
+{
+   if(argc >= 2) calls = atoi(argv[1]);
+   if(argc >= 3) batches = atoi(argv[2]);
+   if(argc > 3 || calls == 0 || batches == 0) {
+      fprintf(stderr, "usage: microbench [calls per batch] [batches]\n");
+      return 2;
+   }
+
+   host::frozen() = true;
+
+   Motor motor;
+   Encoder encoder;
+   encoder.sim_latency = 0;
+   Params params;
+   Telemetry telemetry;
+   Scope scope;
+   Recorder recorder;
+   Controller c(motor, encoder, params, telemetry, scope, recorder, 0);
+   controller = &c;
+
+   Microbench::run(motor, encoder, calls, batches);
+
+   host::wakeup_hook() = on_wakeup;
+   t0 = CycleCounter::now();
+   c.start();
+   host::run();
+
+   ticks.stddev = ticks.batches > 1 ? sqrt(m2 / (ticks.batches - 1)) : 0.0;
+   Microbench::print("control tick", ticks);
+
+   profiling = true;
+   tick = 0;
+   batch = 0;
+   c.profiler.enable();
+   c.start();
+   host::run();
+   puts("");
+   c.profiler.print(c.tickPeriod());
+   return 0;
+}
@@ -0,0 +1,16 @@
+#ifndef ARDUINO_PINMAP_H
+#define ARDUINO_PINMAP_H
+
+#define ARDUINO_PIN_0   (0)
+#define ARDUINO_PIN_1   (1)
+#define ARDUINO_PIN_3   (3)
+#define ARDUINO_PIN_4   (4)
+#define ARDUINO_PIN_5   (5)
+#define ARDUINO_PIN_6   (6)
+#define ARDUINO_PIN_7   (7)
+#define ARDUINO_PIN_8   (8)
+#define ARDUINO_PIN_9   (9)
+#define ARDUINO_PIN_13  (13)
+#define ARDUINO_PIN_A2  (16)
+
+#endif
@@ -0,0 +1,6 @@
+#ifndef ENABLE_DEBUG
+#define ENABLE_DEBUG (0)
+#endif
+
+#undef DEBUG
+#define DEBUG(...) do { if (ENABLE_DEBUG) printf(__VA_ARGS__); } while (0)
@@ -0,0 +1,129 @@
+/*
+ * Copyright (C) 2019 Florian Seybold
+ *
+ * This file is subject to the terms and conditions of the GNU Lesser
+ * General Public License v2.1. See the file LICENSE in the top level
+ * directory for more details.
+ */
+
+/**
+ * @ingroup     mechaduino_firmware
+ *
+ * @{
+ * @file
+ * @brief       Host stand-ins for the RIOT APIs used by the control loop
+ *
+ * Just enough of RIOT to run Controller::run() on the simulated plant in a
+ * host process. Time is virtual: xtimer waits return at once, and reading
+ * the clock advances it by one microsecond, so busy waits terminate and a
+ * tick takes a plausible time. A frozen clock does not move at all, the
+ * plant then stands still and costs nothing. Threads are not started by
+ * thread_create(), host::run() runs the last created one to completion in
+ * the caller. xtimer callbacks fire when a wait moves the clock past their
+ * time.
+ *
+ * @author      Florian Seybold <florian@seybold.space>
+ */
+
+#ifndef HOST_H
+#define HOST_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef int16_t kernel_pid_t;
+typedef void *(*thread_task_func_t)(void *arg);
+
+namespace host {
+   /// Virtual time in us
+   inline uint64_t& now()
+   {
+      static uint64_t t = 0;
+      return t;
+   }
+
+   inline bool& frozen()
+   {
+      static bool f = false;
+      return f;
+   }
+
+   typedef void (*WakeupHook)(uint64_t now);
+
+   /// Called at each periodic wakeup with the wakeup time
+   inline WakeupHook& wakeup_hook()
+   {
+      static WakeupHook hook = NULL;
+      return hook;
+   }
+
+   struct Timer {
+      Timer* next;
+      uint64_t target;
+      void (*callback)(void*);
+      void* arg;
+   };
+
+   /// Pending timers, soonest first
+   inline Timer*& timers()
+   {
+      static Timer* head = NULL;
+      return head;
+   }
+
+   inline void remove(Timer* t)
+   {
+      for(Timer** p = &timers(); *p; p = &(*p)->next) {
+         if(*p == t) {
+            *p = t->next;
+            return;
+         }
+      }
+   }
+
+   inline void schedule(Timer* t, const uint64_t& target)
+   {
+      remove(t);
+      t->target = target;
+      Timer** p = &timers();
+      while(*p && (*p)->target <= target) p = &(*p)->next;
+      t->next = *p;
+      *p = t;
+   }
+
+   /// Moves the clock to until, firing the timers due on the way at their time
+   inline void advance(const uint64_t& until)
+   {
+      while(timers() && timers()->target <= until) {
+         Timer* t = timers();
+         timers() = t->next;
+         if(t->target > now()) now() = t->target;
+         t->callback(t->arg);
+      }
+      if(until > now()) now() = until;
+   }
+
+   struct Thread {
+      thread_task_func_t func;
+      void* arg;
+   };
+
+   inline Thread& pending()
+   {
+      static Thread t = { NULL, NULL };
+      return t;
+   }
+
+   /// Runs the last created thread until its function returns
+   inline void run()
+   {
+      Thread t = pending();
+      pending().func = NULL;
+      if(t.func) t.func(t.arg);
+   }
+}
+
+#endif
@@ -0,0 +1,19 @@
+#ifndef PERIPH_FLASHPAGE_H
+#define PERIPH_FLASHPAGE_H
+
+#include "host.h"
+
+/* The flash images are read-only data on the host, writes are refused */
+#define FLASHPAGE_SIZE      (256)
+enum { FLASHPAGE_OK = 0, FLASHPAGE_NOMATCH = -1 };
+
+inline void* flashpage_addr(int page) { return (void*)((uintptr_t)page * FLASHPAGE_SIZE); }
+inline int flashpage_page(void* addr) { return (int)((uintptr_t)addr / FLASHPAGE_SIZE); }
+inline void flashpage_write(int, const void*) { }
+
+inline int flashpage_verify(int page, const void* data)
+{
+   return memcmp(flashpage_addr(page), data, FLASHPAGE_SIZE) == 0 ? FLASHPAGE_OK : FLASHPAGE_NOMATCH;
+}
+
+#endif
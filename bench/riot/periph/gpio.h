@@ -0,0 +1,15 @@
+#ifndef PERIPH_GPIO_H
+#define PERIPH_GPIO_H
+
+typedef int gpio_t;
+typedef void (*gpio_cb_t)(void*);
+enum { GPIO_IN, GPIO_OUT };
+enum { GPIO_FALLING, GPIO_RISING, GPIO_BOTH };
+
+inline int gpio_init(gpio_t, int) { return 0; }
+inline int gpio_init_int(gpio_t, int, int, gpio_cb_t, void*) { return -1; }
+inline int gpio_read(gpio_t) { return 0; }
+inline void gpio_set(gpio_t) { }
+inline void gpio_clear(gpio_t) { }
+
+#endif
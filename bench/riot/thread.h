@@ -0,0 +1,28 @@
+#ifndef THREAD_H
+#define THREAD_H
+
+#include "host.h"
+
+#define THREAD_STACKSIZE_DEFAULT        (1024)
+#define THREAD_EXTRA_STACKSIZE_PRINTF   (512)
+#define THREAD_PRIORITY_MAIN            (7)
+#define THREAD_CREATE_STACKTEST         (8)
+
+#define KERNEL_PID_UNDEF                (0)
+
+typedef struct thread thread_t;
+
+/// The host runs no RIOT threads, none is ever found
+inline thread_t* thread_get(kernel_pid_t)
+{
+   return NULL;
+}
+
+inline kernel_pid_t thread_create(char*, int, char, int, thread_task_func_t func, void* arg, const char*)
+{
+   host::pending().func = func;
+   host::pending().arg = arg;
+   return 1;
+}
+
+#endif
@@ -0,0 +1,43 @@
+#ifndef XTIMER_H
+#define XTIMER_H
+
+#include "host.h"
+
+typedef struct { uint32_t ticks32; } xtimer_ticks32_t;
+typedef void (*xtimer_callback_t)(void*);
+typedef host::Timer xtimer_t;
+
+inline uint64_t xtimer_now_usec64(void) { return host::frozen() ? host::now() : host::now()++; }
+inline uint32_t xtimer_now_usec(void) { return (uint32_t)xtimer_now_usec64(); }
+inline xtimer_ticks32_t xtimer_now(void) { return { xtimer_now_usec() }; }
+inline uint32_t xtimer_usec_from_ticks(xtimer_ticks32_t t) { return t.ticks32; }
+inline xtimer_ticks32_t xtimer_ticks_from_usec(uint32_t us) { return { us }; }
+
+inline void xtimer_usleep(uint32_t us)
+{
+   if(!host::frozen()) host::advance(host::now() + us);
+}
+
+inline void xtimer_set(xtimer_t* t, uint32_t offset)
+{
+   host::schedule(t, host::now() + offset);
+}
+
+inline void xtimer_remove(xtimer_t* t)
+{
+   host::remove(t);
+}
+
+inline void xtimer_periodic_wakeup(xtimer_ticks32_t* last, uint32_t period)
+{
+   last->ticks32 += period;
+   if(!host::frozen()) {
+      if((int32_t)(last->ticks32 - (uint32_t)host::now()) > 0)
+         host::advance(host::now() + (last->ticks32 - (uint32_t)host::now()));
+      else
+         last->ticks32 = (uint32_t)host::now();     // late, as the real xtimer does
+   }
+   if(host::wakeup_hook()) host::wakeup_hook()(host::now());
+}
+
+#endif
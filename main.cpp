@@ -21,9 +21,18 @@ limitations under the License.
 #include "Motor.hpp"
 #include "Stepper.hpp"
 #include "Encoder.hpp"
+#include "Params.hpp"
+#include "Telemetry.hpp"
+#include "Scope.hpp"
+#include "Recorder.hpp"
 #include "Controller.hpp"
 //#include "Communicator.hpp"
+#include "Protocol.hpp"
+#include "RosNode.hpp"
 #include "ActionServer.hpp"
+#include "JointStatePublisher.hpp"
+#include "Microbench.hpp"
+#include "MemReport.hpp"
 
 //#include "mechaduino_state.h"
 //#include "mechaduino_commands.h"
@@ -34,7 +43,15 @@ namespace mechaduino {
    Motor *motor;
    Stepper *stepper;
    Encoder *encoder;
+   Params *params;
+   Telemetry *telemetry;
+   Scope *scope;
+   Recorder *recorder;
    Controller *controller;
+   Protocol *protocol;
+   RosNode *ros;
+   ActionServer *actionserver;
+   JointStatePublisher *jointstates;
 }
 
 int main(void)
@@ -42,29 +59,143 @@ int main(void)
    mechaduino::motor = new Motor();
    mechaduino::stepper = new Stepper(*mechaduino::motor);
    mechaduino::encoder = new Encoder();
-   mechaduino::controller = new Controller(*mechaduino::motor, *mechaduino::encoder, 0);
+   mechaduino::params = new Params();
+   mechaduino::params->load();     // before the controller starts
+   mechaduino::telemetry = new Telemetry();
+   mechaduino::scope = new Scope();
+   mechaduino::recorder = new Recorder();
+   mechaduino::controller = new Controller(*mechaduino::motor, *mechaduino::encoder, *mechaduino::params, *mechaduino::telemetry, *mechaduino::scope, *mechaduino::recorder, 0);
+   mechaduino::controller->cogging.load();
+   mechaduino::protocol = new Protocol(*mechaduino::controller, *mechaduino::params);
+   mechaduino::ros = new RosNode("mechaduino");
+   mechaduino::actionserver = new ActionServer(*mechaduino::controller, *mechaduino::ros);
+   mechaduino::jointstates = new JointStatePublisher(*mechaduino::controller, *mechaduino::ros, "mechaduino");
 
   /* start shell */
   puts("Starting the shell now...");
   const shell_command_t commands[] = {
      { "step", "let stepper take one step", [](int, char**)->int{ mechaduino::stepper->step(); return 0; } },
-     { "walkaround", "let stepper walk one revolution", [](int, char**)->int{ mechaduino::stepper->walkaround(); return 0; } },
-     { "calibrate", "calibrate encoder", [](int, char**)->int{ mechaduino::encoder->calibrate(*mechaduino::stepper); return 0; } },
-     { "lookup", "print angle lookup table", [](int, char**)->int{ mechaduino::encoder->printLookup(); return 0; } },
+     { "walkaround", "let stepper walk one revolution", [](int, char**)->int{ return mechaduino::stepper->walkaround() ? 0 : -1; } },
+     { "stepper", "open loop moves: move/to <deg> [vmax] [amax], stop, halt, wait, micro <n>, current <ramp> <run> <hold>, status", [](int argc, char** argv)->int{
+         Stepper& st = *mechaduino::stepper;
+         if(argc==1 || (argc==2 && strcmp(argv[1],"status")==0)) {
+            static const char* const phases[] = { "idle", "accelerating", "cruising", "decelerating" };
+            printf("stepper: %s, position %f deg, velocity %f deg/s, %i microsteps, current %.2f/%.2f/%.2f of uMax\n",
+                   phases[st.currentPhase()], st.position(), st.velocity(), st.getMicrosteps(),
+                   st.currents.ramp, st.currents.run, st.currents.hold);
+         }
+         else if(argc>=3 && argc<=5 && (strcmp(argv[1],"move")==0 || strcmp(argv[1],"to")==0)) {
+            if(mechaduino::controller->running()) {
+               puts("Stop the control loop first.");
+               return -1;
+            }
+            const float vmax = argc>=4 ? atof(argv[3]) : 0.0;
+            const float amax = argc>=5 ? atof(argv[4]) : 0.0;
+            const bool ok = strcmp(argv[1],"move")==0 ? st.move(atof(argv[2]), vmax, amax) : st.move_to(atof(argv[2]), vmax, amax);
+            if(!ok) {
+               puts("Stepper is busy.");
+               return -1;
+            }
+         }
+         else if(argc==2 && strcmp(argv[1],"stop")==0) st.stop();
+         else if(argc==2 && strcmp(argv[1],"halt")==0) st.halt();
+         else if(argc==2 && strcmp(argv[1],"wait")==0) st.wait();
+         else if(argc==3 && strcmp(argv[1],"micro")==0) return st.setMicrosteps(atoi(argv[2])) ? 0 : -1;
+         else if(argc==5 && strcmp(argv[1],"current")==0) {
+            const Stepper::Currents c = { (float)atof(argv[2]), (float)atof(argv[3]), (float)atof(argv[4]) };
+            if(c.ramp < 0.0 || c.ramp > 1.0 || c.run < 0.0 || c.run > 1.0 || c.hold < 0.0 || c.hold > 1.0) {
+               puts("Currents are fractions of uMax, 0 to 1.");
+               return -1;
+            }
+            st.currents = c;
+         }
+         else return -1;
+         return 0;
+     } },
+     { "calibrate", "calibrate encoder, or only stream the raw readings with capture", [](int argc, char** argv)->int{
+         if(argc==1) mechaduino::encoder->calibrate(*mechaduino::stepper);
+         else if(strcmp(argv[1],"capture")==0) mechaduino::encoder->capture(*mechaduino::stepper);
+         else return -1;
+         return 0;
+     } },
+     { "lookup", "print angle lookup table, or its slots with info/verify", [](int argc, char** argv)->int{
+         if(argc==1) mechaduino::encoder->printLookup();
+         else if(strcmp(argv[1],"info")==0) mechaduino::encoder->printSlots();
+         else if(strcmp(argv[1],"verify")==0) {
+            for(int s=0; s<2; ++s) printf("slot %i: %s\n", s, mechaduino::encoder->verify(s) ? "ok" : "invalid");
+         }
+         else return -1;
+         return 0;
+     } },
      { "angle", "print current angle", [](int, char**)->int{ printf("Current angle is %f°.\n", mechaduino::encoder->angle()); return 0; } },
-     { "control", "start/stop/set control loop", [](int argc, char** argv)->int{
-         for(int i=0; i<argc; ++i) {
-            printf("%s,", argv[i]);
+     { "encoder", "encoder diagnostics: stats [reset], bench [n]", [](int argc, char** argv)->int{
+         if(argc>=2 && strcmp(argv[1],"bench")==0) {
+            mechaduino::encoder->bench(argc==3 ? atoi(argv[2]) : 10000);
          }
-         printf("\n");
-
+         else if(argc==2 && strcmp(argv[1],"stats")==0) {
+            mechaduino::encoder->service();
+            mechaduino::encoder->printStats();
+         }
+         else if(argc==3 && strcmp(argv[1],"stats")==0 && strcmp(argv[2],"reset")==0) mechaduino::encoder->resetStats();
+         else return -1;
+         return 0;
+     } },
+     { "microbench", "time hot path functions: [calls per batch] [batches]", [](int argc, char** argv)->int{
+         if(mechaduino::controller->running()) {
+            puts("Stop the control loop first.");
+            return -1;
+         }
+         Microbench::run(*mechaduino::motor, *mechaduino::encoder, argc>=2 ? atoi(argv[1]) : 1000, argc>=3 ? atoi(argv[2]) : 100);
+         return 0;
+     } },
+     { "tick", "control tick profile: on, off, reset, pin <section|off>, or print the breakdown", [](int argc, char** argv)->int{
+         TickProfiler& p = mechaduino::controller->profiler;
+         if(argc==1) p.print(mechaduino::controller->tickPeriod());
+         else if(argc==2 && strcmp(argv[1],"on")==0) p.enable();
+         else if(argc==2 && strcmp(argv[1],"off")==0) p.disable();
+         else if(argc==2 && strcmp(argv[1],"reset")==0) p.reset();
+         else if(argc==3 && strcmp(argv[1],"pin")==0) {
+            const TickProfiler::Section s = TickProfiler::find(argv[2]);
+            if(s==TickProfiler::sections && strcmp(argv[2],"off")!=0) {
+               printf("Sections:");
+               for(unsigned i = 0; i < TickProfiler::sections; ++i) printf(" %s", TickProfiler::names[i]);
+               puts("");
+               return -1;
+            }
+            p.pin(s);
+         }
+         else return -1;
+         return 0;
+     } },
+     { "mem", "RAM, flash and stack budget", [](int, char**)->int{
+         const MemReport::Entry objects[] = {
+            { "Motor", sizeof(Motor) }, { "Stepper", sizeof(Stepper) }, { "Encoder", sizeof(Encoder) },
+            { "Params", sizeof(Params) }, { "Telemetry", sizeof(Telemetry) }, { "Scope", sizeof(Scope) },
+            { "Recorder", sizeof(Recorder) }, { "Controller", sizeof(Controller) }, { "Protocol", sizeof(Protocol) },
+            { "RosNode", sizeof(RosNode) }, { "ActionServer", sizeof(ActionServer) },
+            { "JointStatePublisher", sizeof(JointStatePublisher) }, { "ScratchArena", ScratchArena::size }
+         };
+         const MemReport::Entry tables[] = {
+            { "lookup slots", Encoder::flashBytes() }, { "Motor::sin_1", sizeof(Motor::sin_1) },
+            { "parameter page", Params::flashBytes() }, { "cogging table", CoggingTable::flashBytes() }
+         };
+         MemReport::print("objects (RAM)", objects, sizeof(objects)/sizeof(objects[0]));
+         MemReport::print("tables (flash)", tables, sizeof(tables)/sizeof(tables[0]));
+         MemReport::printStacks();
+         ScratchArena::printStatus();
+         return 0;
+     } },
+     { "control", "start/stop/set/move control loop", [](int argc, char** argv)->int{
          if(argc==2) {
             if(strcmp(argv[1],"start")==0) mechaduino::controller->start();
             if(strcmp(argv[1],"stop")==0) mechaduino::controller->stop();
          }                                                      
          else if(argc==3) {
             if(strcmp(argv[1],"set")==0) {
-               mechaduino::controller->r = atoi(argv[2]);
+               mechaduino::controller->set(atof(argv[2]));
+            }
+            else if(strcmp(argv[1],"move")==0) {
+               mechaduino::controller->move_to(atof(argv[2]));
             }
             else return -1;
          }
@@ -72,6 +203,249 @@ int main(void)
 
          return 0;
      } },
+     { "path", "queued path: add <target> [vmax] [amax], stop, status", [](int argc, char** argv)->int{
+         Controller& c = *mechaduino::controller;
+         if(argc==1 || (argc==2 && strcmp(argv[1],"status")==0)) {
+            const MotionQueue::Stats st = c.queueStats();
+            printf("path: %u of %u queued, %lu queued in total, %lu run, %lu underruns, max depth %u\n",
+                   c.queueDepth(), MotionQueue::capacity, (unsigned long)st.queued, (unsigned long)st.executed,
+                   (unsigned long)st.underruns, st.max_depth);
+         }
+         else if(argc>=3 && argc<=5 && strcmp(argv[1],"add")==0) {
+            if(!c.queue(atof(argv[2]), argc>=4 ? atof(argv[3]) : 0.0, argc>=5 ? atof(argv[4]) : 0.0)) {
+               puts("Path queue is full.");
+               return -1;
+            }
+         }
+         else if(argc==2 && strcmp(argv[1],"stop")==0) c.halt();
+         else return -1;
+         return 0;
+     } },
+     { "home", "homing against a hard stop: start [-1|1], status, speed <deg/s>, current <fraction>, backoff <deg>", [](int argc, char** argv)->int{
+         Controller& c = *mechaduino::controller;
+         Homing& h = c.homing;
+         if(argc==1 || (argc==2 && strcmp(argv[1],"status")==0)) {
+            static const char* const states[] = { "idle", "seeking", "backing off", "done", "failed" };
+            printf("homing: %s, direction %i, %f s, contact at %f deg\n", states[h.state()], h.direction(), h.time(), h.contact());
+            printf("speed: %f deg/s, current: %f, error limit: %f deg, velocity limit: %f deg/s, backoff: %f deg, travel: %f deg\n",
+                   h.speed, h.current, h.error_limit, h.velocity_limit, h.backoff, h.travel);
+         }
+         else if(argc<=3 && strcmp(argv[1],"start")==0) {
+            if(!c.running()) {
+               puts("Start the controller first.");
+               return -1;
+            }
+            c.home(argc==3 ? atoi(argv[2]) : -1);
+         }
+         else if(argc==3 && strcmp(argv[1],"speed")==0 && atof(argv[2]) > 0.0) h.speed = atof(argv[2]);
+         else if(argc==3 && strcmp(argv[1],"current")==0 && atof(argv[2]) > 0.0 && atof(argv[2]) <= 1.0) h.current = atof(argv[2]);
+         else if(argc==3 && strcmp(argv[1],"backoff")==0) h.backoff = atof(argv[2]);
+         else return -1;
+         return 0;
+     } },
+     { "learn", "iterative learning: start <s>, off, gain <effort/deg>, q <0..1>, lead <samples>, status", [](int argc, char** argv)->int{
+         Controller& c = *mechaduino::controller;
+         IterativeLearning& l = c.learning;
+         if(argc==1 || (argc==2 && strcmp(argv[1],"status")==0)) {
+            printf("learning: %s, %u ticks in samples of %u, %lu passes\n", l.active() ? "in a pass" : (l.armed() ? "armed" : "off"),
+                   l.length(), l.sampleTicks(), (unsigned long)l.passes);
+            printf("rms error: first pass %f deg, last pass %f deg\n", l.first_rms, l.last_rms);
+            printf("gain: %f, q: %f, lead: %u, limit: %f\n", l.gain, l.q, l.lead, l.limit);
+         }
+         else if(argc==3 && strcmp(argv[1],"start")==0) {
+            if(!c.learn(atof(argv[2]))) {
+               puts("Cannot start while a pass runs.");
+               return -1;
+            }
+         }
+         else if(argc==2 && strcmp(argv[1],"off")==0) c.forget();
+         else if(argc==3 && strcmp(argv[1],"gain")==0) l.gain = atof(argv[2]);
+         else if(argc==3 && strcmp(argv[1],"q")==0 && atof(argv[2]) >= 0.0 && atof(argv[2]) <= 1.0) l.q = atof(argv[2]);
+         else if(argc==3 && strcmp(argv[1],"lead")==0) l.lead = atoi(argv[2]);
+         else return -1;
+         return 0;
+     } },
+     { "cogging", "cogging compensation: sweep, on, off, clear, save, load, table, speed <deg/s>, status", [](int argc, char** argv)->int{
+         Controller& c = *mechaduino::controller;
+         CoggingTable& t = c.cogging;
+         if(argc==1 || (argc==2 && strcmp(argv[1],"status")==0)) t.print();
+         else if(argc==2 && strcmp(argv[1],"sweep")==0) {
+            if(!c.running()) {
+               puts("Start the controller first.");
+               return -1;
+            }
+            c.sweepCogging();
+         }
+         else if(t.sweeping() && argc==2 && (strcmp(argv[1],"on")==0 || strcmp(argv[1],"clear")==0 || strcmp(argv[1],"load")==0)) {
+            puts("Wait for the sweep to finish.");
+            return -1;
+         }
+         else if(argc==2 && strcmp(argv[1],"on")==0) t.enabled = true;
+         else if(argc==2 && strcmp(argv[1],"off")==0) t.enabled = false;
+         else if(argc==2 && strcmp(argv[1],"clear")==0) t.clear();
+         else if(argc==2 && strcmp(argv[1],"table")==0) t.printTable();
+         else if(argc==2 && strcmp(argv[1],"save")==0) {
+            if(t.sweeping() || !t.save()) {
+               puts("Saving the cogging table failed.");
+               return -1;
+            }
+         }
+         else if(argc==2 && strcmp(argv[1],"load")==0) {
+            if(!t.load()) {
+               puts("No cogging table in flash.");
+               return -1;
+            }
+         }
+         else if(argc==3 && strcmp(argv[1],"speed")==0 && atof(argv[2]) > 0.0) t.speed = atof(argv[2]);
+         else return -1;
+         return 0;
+     } },
+     { "shaper", "setpoint input shaping: zv/zvd/ei <Hz> [damping], off, status", [](int argc, char** argv)->int{
+         Controller& c = *mechaduino::controller;
+         const InputShaper& s = c.shaper;
+         static const char* const types[] = { "off", "zv", "zvd", "ei" };
+         if(argc==1 || (argc==2 && strcmp(argv[1],"status")==0)) {
+            printf("shaper: %s at %f Hz, damping %f, %f ticks longer, history samples of %u ticks\n", types[s.kind()],
+                   s.frequency(), s.damping(), s.duration(), s.sampleTicks());
+            return 0;
+         }
+         if(argc==2 && strcmp(argv[1],"off")==0) return c.shape(InputShaper::Off, 0.0, 0.0) ? 0 : -1;
+         for(unsigned i = InputShaper::ZV; i <= InputShaper::EI; ++i) {
+            if((argc==3 || argc==4) && strcmp(argv[1],types[i])==0) {
+               if(!c.shape((InputShaper::Type)i, atof(argv[2]), argc==4 ? atof(argv[3]) : 0.0)) {
+                  puts("Frequency must be above 0 Hz and damping within [0, 1).");
+                  return -1;
+               }
+               return 0;
+            }
+         }
+         return -1;
+     } },
+     { "param", "parameters: list, get <name>, set <name> <value>, save, load, defaults, info", [](int argc, char** argv)->int{
+         Params& p = *mechaduino::params;
+         if(argc==1 || (argc==2 && strcmp(argv[1],"list")==0)) p.printAll();
+         else if(argc==3 && strcmp(argv[1],"get")==0) {
+            const ParamDesc* d = Params::find(argv[2]);
+            if(!d) return -1;
+            p.print(*d);
+         }
+         else if(argc==4 && strcmp(argv[1],"set")==0) {
+            if(!p.set(argv[2], argv[3])) {
+               puts("Unknown parameter or value out of range.");
+               return -1;
+            }
+         }
+         else if(argc==2 && strcmp(argv[1],"save")==0) puts(p.save() ? "Parameters saved." : "Saving parameters failed.");
+         else if(argc==2 && strcmp(argv[1],"load")==0) puts(p.load() ? "Parameters loaded." : "No saved parameters, keeping the current values.");
+         else if(argc==2 && strcmp(argv[1],"defaults")==0) p.reset();
+         else if(argc==2 && strcmp(argv[1],"info")==0) p.printInfo();
+         else return -1;
+         return 0;
+     } },
+     { "gear", "electronic gearing: set <num> <den> [offset] [pulses|stream], engage [rel], disengage, status", [](int argc, char** argv)->int{
+         Gearing& g = mechaduino::controller->gearing;
+         if(argc>=4 && strcmp(argv[1],"set")==0) {
+            const Gearing::Source source = (argc>=6 && strcmp(argv[5],"pulses")==0) ? Gearing::Pulses : Gearing::Stream;
+            if(!g.configure(atol(argv[2]), atol(argv[3]), argc>=5 ? atof(argv[4]) : 0.0, source)) {
+               puts("Disengage first, den must not be 0.");
+               return -1;
+            }
+         }
+         else if(argc>=2 && strcmp(argv[1],"engage")==0) mechaduino::controller->engage(argc==3 && strcmp(argv[2],"rel")==0);
+         else if(argc==2 && strcmp(argv[1],"disengage")==0) mechaduino::controller->disengage();
+         else if(argc==2 && strcmp(argv[1],"status")==0) {
+            printf("gear: %s, ratio=%li/%li deg/count, offset=%f, master=%lli counts\n", g.active() ? "engaged" : "disengaged",
+               (long)g.numerator(), (long)g.denominator(), g.offsetDeg(), (long long)g.masterPosition());
+         }
+         else return -1;
+         return 0;
+     } },
+     { "telemetry", "binary loop telemetry: start [decimation] [mask], stop, stats", [](int argc, char** argv)->int{
+         if(argc>=2 && strcmp(argv[1],"start")==0) {
+            mechaduino::telemetry->start(argc>=3 ? atoi(argv[2]) : 1, argc>=4 ? strtol(argv[3], NULL, 0) : telemetry_all);
+         }
+         else if(argc==2 && strcmp(argv[1],"stop")==0) mechaduino::telemetry->stop();
+         else if(argc==2 && strcmp(argv[1],"stats")==0) mechaduino::telemetry->printStats();
+         else return -1;
+         return 0;
+     } },
+     { "scope", "RAM capture: arm <manual|setpoint|error|saturation|fault> [level] [pre] [mask], trigger, status, dump, clear", [](int argc, char** argv)->int{
+         if(argc>=3 && strcmp(argv[1],"arm")==0) {
+            static const char* const triggers[] = { "manual", "setpoint", "error", "saturation", "fault" };
+            int t = 0;
+            while(t<5 && strcmp(argv[2],triggers[t])!=0) ++t;
+            if(t==5) return -1;
+            if(!mechaduino::scope->arm((Scope::Trigger)t, argc>=4 ? atof(argv[3]) : 0.0, argc>=5 ? atoi(argv[4]) : 100,
+                                       argc>=6 ? strtol(argv[5], NULL, 0) : telemetry_all)) return -1;
+         }
+         else if(argc==2 && strcmp(argv[1],"trigger")==0) mechaduino::scope->force();
+         else if(argc==2 && strcmp(argv[1],"status")==0) {
+            static const char* const states[] = { "idle", "armed", "triggered", "done" };
+            printf("scope: %s\n", states[mechaduino::scope->status()]);
+         }
+         else if(argc==2 && strcmp(argv[1],"dump")==0) mechaduino::scope->dump();
+         else if(argc==2 && strcmp(argv[1],"clear")==0) mechaduino::scope->clear();
+         else return -1;
+         return 0;
+     } },
+     { "record", "record loop inputs for tools/replay: start, stop, status, dump, clear", [](int argc, char** argv)->int{
+         if(argc!=2) return -1;
+         if(strcmp(argv[1],"start")==0) return mechaduino::recorder->start(mechaduino::encoder->lookupCrc()) ? 0 : -1;
+         else if(strcmp(argv[1],"stop")==0) mechaduino::recorder->stop();
+         else if(strcmp(argv[1],"clear")==0) mechaduino::recorder->clear();
+         else if(strcmp(argv[1],"status")==0) mechaduino::recorder->printStatus();
+         else if(strcmp(argv[1],"dump")==0) mechaduino::recorder->dump();
+         else return -1;
+         return 0;
+     } },
+     { "protocol", "binary command channel: start, stats, sync", [](int argc, char** argv)->int{
+         if(argc!=2) return -1;
+         if(strcmp(argv[1],"start")==0) mechaduino::protocol->start();
+         else if(strcmp(argv[1],"stats")==0) mechaduino::protocol->printStats();
+         else if(strcmp(argv[1],"sync")==0) mechaduino::protocol->printSync();
+         else return -1;
+         return 0;
+     } },
+     { "ros", "start/stop the ROS2 move_to action server", [](int argc, char** argv)->int{
+         if(argc!=2) return -1;
+         if(strcmp(argv[1],"start")==0) mechaduino::actionserver->start();
+         else if(strcmp(argv[1],"stop")==0) mechaduino::actionserver->stop();
+         else return -1;
+         return 0;
+     } },
+     { "joints", "joint_states publisher: start [rate], stop, stats [reset]", [](int argc, char** argv)->int{
+         if(argc>=2 && strcmp(argv[1],"start")==0) mechaduino::jointstates->start(argc==3 ? atoi(argv[2]) : 100);
+         else if(argc==2 && strcmp(argv[1],"stop")==0) mechaduino::jointstates->stop();
+         else if(argc==2 && strcmp(argv[1],"stats")==0) mechaduino::jointstates->printStats();
+         else if(argc==3 && strcmp(argv[1],"stats")==0 && strcmp(argv[2],"reset")==0) mechaduino::jointstates->resetStats();
+         else return -1;
+         return 0;
+     } },
+#ifdef MECHADUINO_SIM
+     { "sim", "simulated plant: info, load <Nm>, inertia <kg m^2>, friction <Nm> [Nm s/rad], detent <Nm>, noise <counts>, stops <deg> <deg>|off, belt <Nm/rad> [Nm s/rad]", [](int argc, char** argv)->int{
+         Plant& p = Motor::plant;
+         if(argc==1 || (argc==2 && strcmp(argv[1],"info")==0)) p.print();
+         else if(argc==3 && strcmp(argv[1],"load")==0) p.load_torque = atof(argv[2]);
+         else if(argc==3 && strcmp(argv[1],"inertia")==0) p.load_inertia = atof(argv[2]);
+         else if(argc>=3 && strcmp(argv[1],"friction")==0) {
+            p.coulomb = atof(argv[2]);
+            if(argc==4) p.viscous = atof(argv[3]);
+         }
+         else if(argc==3 && strcmp(argv[1],"detent")==0) p.detent = atof(argv[2]);
+         else if(argc==3 && strcmp(argv[1],"noise")==0) p.noise = atoi(argv[2]);
+         else if(argc==4 && strcmp(argv[1],"stops")==0) {
+            p.stop_low = atof(argv[2]);
+            p.stop_high = atof(argv[3]);
+         }
+         else if((argc==3 || argc==4) && strcmp(argv[1],"belt")==0) p.belt(atof(argv[2]), argc==4 ? atof(argv[3]) : 0.0);
+         else if(argc==3 && strcmp(argv[1],"stops")==0 && strcmp(argv[2],"off")==0) {
+            p.stop_low = -INFINITY;
+            p.stop_high = INFINITY;
+         }
+         else return -1;
+         return 0;
+     } },
+#endif
      { NULL, NULL, NULL }
   };
   char line_buf[SHELL_DEFAULT_BUFSIZE];
@@ -7,18 +7,7 @@
 #include "stdint.h"
 
 //----Current Parameters-----
-
-volatile float Fs = 6500.0;   //Sample frequency in Hz
-
-volatile float pKp = 15.0;      //position mode PID values.  Depending on your motor/load/desired performance, you will need to tune these values.  You can also implement your own control scheme
-volatile float pKi = 0.2;
-volatile float pKd = 250.0;//1000.0;
-volatile float pLPF = 30;       //break frequency in hertz
-
-volatile float vKp = 0.001;       //velocity mode PID values.  Depending on your motor/load/desired performance, you will need to tune these values.  You can also implement your own control scheme
-volatile float vKi = 0.001;
-volatile float vKd = 0.0;
-volatile float vLPF = 100.0;       //break frequency in hertz
+// Sample frequency, gains and filter corners live in Params.hpp
 
 // This is the encoder lookup table (created by calibration routine):
 
@@ -28,12 +17,6 @@ const float __attribute__((__aligned__(256))) lookup[16384] = {
 
 
 
-volatile float pLPFa = 0.0;   // initialized in init_params()
-volatile float pLPFb = 0.0;   // initialized in init_params()
-volatile float vLPFa = 0.0;   // initialized in init_params()
-volatile float vLPFb = 0.0;   // initialized in init_params()
-
-
 const int spr = 200;                // 200 steps per revolution  -- for 400 step/rev, you should only need to edit this value
 float aps = 0.0;   // initialized in init_params()
 int cpr = 16384;                    // counts per rev
@@ -426,11 +409,6 @@ const int sin_1[] = {
 };
 
 void init_params() {
-   pLPFa = exp(pLPF*-2*3.14159/Fs); // z = e^st pole mapping
-   pLPFb = (1.0-pLPFa);
-   vLPFa = exp(vLPF*-2*3.14159/Fs); // z = e^st pole mapping
-   vLPFb = (1.0-vLPFa)* Fs * 0.16666667;
-
    aps = 360.0/ spr;       // angle per step
    stepangle = aps/32.0;   // for step/dir interrupt: aps/32 is the equivalent of 1/32 microsteps
 
@@ -8,28 +8,10 @@
 #define identifier "x"              // change this to help keep track of multiple mechaduinos (printed on startup)
 
 //----Current Parameters-----
-
-extern volatile float Ts;
-extern volatile float Fs;
-
-extern volatile float pKp;
-extern volatile float pKi;
-extern volatile float pKd;
-extern volatile float pLPF;
-
-
-extern volatile float vKp;
-extern volatile float vKi;
-extern volatile float vKd;
-extern volatile float vLPF;
+// Sample frequency, gains and filter corners live in Params.hpp
 
 extern const float lookup[];
 
-extern volatile float pLPFa;
-extern volatile float pLPFb;
-extern volatile float vLPFa;
-extern volatile float vLPFb;
-
 
 extern const int spr; //  200 steps per revolution
 extern float aps; // angle per step
@@ -0,0 +1,193 @@
+/*
+ * Copyright (C) 2019 Florian Seybold
+ *
+ * This file is subject to the terms and conditions of the GNU Lesser
+ * General Public License v2.1. See the file LICENSE in the top level
+ * directory for more details.
+ */
+
+/**
+ * @ingroup     mechaduino_firmware
+ *
+ * @{
+ * @file
+ * @brief       Host side lookup table generator
+ *
+ * Turns a capture streamed by 'calibrate capture' into lookup.dat (the
+ * format included by Encoder.hpp) or into a binary table blob. Uses the
+ * same LookupBuilder as the firmware.
+ *
+ *    lookupgen [-b] [-o out] [-c reference] capture.bin
+ *
+ * The capture may contain console output around the frame, it is located
+ * by its magic and checked by its crc. With -c the generated output is
+ * compared byte by byte against a reference and the exit code is 1 on any
+ * difference, e.g. against a table dumped with 'lookup' on the device.
+ *
+ * @author      Florian Seybold <florian@seybold.space>
+ */
+
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "Crc.hpp"
+#include "LookupBuilder.hpp"
+
+static bool read_file(const char* name, std::vector<uint8_t>& data)
+{
+   FILE* f = fopen(name, "rb");
+   if(!f) return false;
+   uint8_t buf[4096];
+   size_t n;
+   while((n = fread(buf, 1, sizeof(buf), f)) > 0)
+      data.insert(data.end(), buf, buf + n);
+   fclose(f);
+   return true;
+}
+
+/// Finds the first frame with a valid crc and unpacks it
+static bool parse_capture(const std::vector<uint8_t>& data, CalibrationFrameHeader& header,
+                          std::vector<int>& readings, std::vector<uint16_t>& spread)
+{
+   for(size_t pos = 0; pos + sizeof(header) <= data.size(); ++pos) {
+      memcpy(&header, &data[pos], sizeof(header));
+      if(header.magic != calibration_frame_magic || header.version != calibration_frame_version)
+         continue;
+
+      const size_t payload = header.spr * (sizeof(int16_t) + sizeof(uint16_t));
+      const size_t length = sizeof(header) + payload + sizeof(uint32_t);
+      if(pos + length > data.size())
+         continue;
+
+      uint32_t crc;
+      memcpy(&crc, &data[pos + length - sizeof(crc)], sizeof(crc));
+      if(crc32(&data[pos], length - sizeof(crc)) != crc) {
+         fprintf(stderr, "lookupgen: skipping frame at offset %zu with bad crc\n", pos);
+         continue;
+      }
+
+      const uint8_t* p = &data[pos + sizeof(header)];
+      readings.resize(header.spr);
+      spread.resize(header.spr);
+      for(int x = 0; x < header.spr; ++x, p += sizeof(int16_t)) {
+         int16_t r;
+         memcpy(&r, p, sizeof(r));
+         readings[x] = r;
+      }
+      memcpy(spread.data(), p, header.spr * sizeof(uint16_t));
+      return true;
+   }
+   return false;
+}
+
+static void print_statistics(const CalibrationFrameHeader& header, const std::vector<int>& readings, const std::vector<uint16_t>& spread)
+{
+   int tmin = header.cpr, tmax = -header.cpr;
+   long tsum = 0;
+   unsigned smax = 0;
+   for(int i = 0; i < header.spr; ++i) {
+      int ticks = readings[(i + 1) % header.spr] - readings[i];
+      if(ticks < -header.cpr/2) ticks += header.cpr;
+      else if(ticks > header.cpr/2) ticks -= header.cpr;
+      if(ticks < tmin) tmin = ticks;
+      if(ticks > tmax) tmax = ticks;
+      tsum += ticks;
+      if(spread[i] > smax) smax = spread[i];
+   }
+   fprintf(stderr, "lookupgen: spr=%u, cpr=%u, avg=%u, ticks per step min=%i max=%i mean=%.2f, max spread=%u\n",
+           header.spr, header.cpr, header.avg, tmin, tmax, double(tsum)/header.spr, smax);
+}
+
+static std::string format_table(const std::vector<float>& table, const bool& binary)
+{
+   std::string out;
+   if(binary) {
+      out.assign((const char*)table.data(), table.size()*sizeof(float));
+      return out;
+   }
+
+   char buf[32];
+   for(size_t c = 0; c < table.size(); ++c) {
+      snprintf(buf, sizeof(buf), c + 1 < table.size() ? "%f, " : "%f,\n", table[c]);
+      out += buf;
+   }
+   return out;
+}
+
+int main(int argc, char** argv)
+{
+   bool binary = false;
+   const char* output = NULL;
+   const char* reference = NULL;
+   const char* input = NULL;
+
+   for(int i = 1; i < argc; ++i) {
+      if(strcmp(argv[i], "-b") == 0) binary = true;
+      else if(strcmp(argv[i], "-o") == 0 && i + 1 < argc) output = argv[++i];
+      else if(strcmp(argv[i], "-c") == 0 && i + 1 < argc) reference = argv[++i];
+      else if(!input) input = argv[i];
+      else input = NULL, i = argc;
+   }
+   if(!input) {
+      fprintf(stderr, "usage: %s [-b] [-o out] [-c reference] capture.bin\n", argv[0]);
+      return 2;
+   }
+
+   std::vector<uint8_t> data;
+   if(!read_file(input, data)) {
+      fprintf(stderr, "lookupgen: cannot read %s\n", input);
+      return 2;
+   }
+
+   CalibrationFrameHeader header;
+   std::vector<int> readings;
+   std::vector<uint16_t> spread;
+   if(!parse_capture(data, header, readings, spread)) {
+      fprintf(stderr, "lookupgen: no valid capture frame in %s\n", input);
+      return 2;
+   }
+   print_statistics(header, readings, spread);
+
+   std::vector<float> table;
+   table.reserve(header.cpr);
+   auto sink = [&table](const float& lookupAngle) { table.push_back(lookupAngle); };
+   LookupBuilder(header.spr, header.cpr).build(readings.data(), sink);
+
+   if(table.size() != header.cpr) {
+      fprintf(stderr, "lookupgen: generated %zu of %u entries\n", table.size(), header.cpr);
+      return 1;
+   }
+
+   const std::string out = format_table(table, binary);
+
+   if(output) {
+      FILE* f = fopen(output, "wb");
+      if(!f || fwrite(out.data(), 1, out.size(), f) != out.size()) {
+         fprintf(stderr, "lookupgen: cannot write %s\n", output);
+         return 2;
+      }
+      fclose(f);
+   }
+   else if(!reference) {
+      fwrite(out.data(), 1, out.size(), stdout);
+   }
+
+   if(reference) {
+      std::vector<uint8_t> ref;
+      if(!read_file(reference, ref)) {
+         fprintf(stderr, "lookupgen: cannot read %s\n", reference);
+         return 2;
+      }
+      size_t n = 0;
+      while(n < ref.size() && n < out.size() && ref[n] == (uint8_t)out[n]) ++n;
+      if(n != ref.size() || n != out.size()) {
+         fprintf(stderr, "lookupgen: output differs from %s at byte %zu\n", reference, n);
+         return 1;
+      }
+      fprintf(stderr, "lookupgen: output identical to %s\n", reference);
+   }
+
+   return 0;
+}
@@ -0,0 +1,239 @@
+/*
+ * Copyright (C) 2019 Florian Seybold
+ *
+ * This file is subject to the terms and conditions of the GNU Lesser
+ * General Public License v2.1. See the file LICENSE in the top level
+ * directory for more details.
+ */
+
+/**
+ * @ingroup     mechaduino_firmware
+ *
+ * @{
+ * @file
+ * @brief       Offline replay of control loop recordings
+ *
+ * Feeds a recording streamed by 'record dump' through the same ServoLoop
+ * as the firmware, starting from the recorded loop state, and writes every
+ * intermediate term as CSV, one line per tick.
+ *
+ *    replay [-t table] [-o out.csv] [name=value ...] record.bin
+ *
+ * With the recorded settings the output reproduces the device's terms
+ * exactly, up to a tick where homing changed the loop state outside the
+ * loop (cleared the integrator or moved the origin), which is warned about
+ * with its tick. pKp, pKi, pKd, pLPF and iMax can be overridden to see how other
+ * settings would have reacted to the same measurements; a summary of both
+ * runs goes to stderr. The replay is open loop, the measured angles and the
+ * feedforward of iterative learning and cogging compensation stay the
+ * recorded ones. Counts are mapped through the built-in lookup table
+ * unless -t gives another one, as printed by 'lookup' or lookupgen.
+ *
+ * @author      Florian Seybold <florian@seybold.space>
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <string>
+#include <vector>
+
+#include "Crc.hpp"
+#include "RecordFormat.hpp"
+#include "ServoLoop.hpp"
+
+static const int cpr = 16384;
+
+static const float builtin_table[cpr] = {
+   #include "lookup.dat"
+};
+
+static bool read_file(const char* name, std::vector<uint8_t>& data)
+{
+   FILE* f = fopen(name, "rb");
+   if(!f) return false;
+   uint8_t buf[4096];
+   size_t n;
+   while((n = fread(buf, 1, sizeof(buf), f)) > 0)
+      data.insert(data.end(), buf, buf + n);
+   fclose(f);
+   return true;
+}
+
+/// Finds the first recording with a valid crc
+static bool parse_record(const std::vector<uint8_t>& data, RecordHeader& header, std::vector<RecordEntry>& entries)
+{
+   for(size_t pos = 0; pos + sizeof(header) <= data.size(); ++pos) {
+      memcpy(&header, &data[pos], sizeof(header));
+      if(header.magic != record_magic || header.version != record_version)
+         continue;
+
+      const size_t length = sizeof(header) + header.entries * sizeof(RecordEntry) + sizeof(uint32_t);
+      if(pos + length > data.size())
+         continue;
+
+      uint32_t crc;
+      memcpy(&crc, &data[pos + length - sizeof(crc)], sizeof(crc));
+      if(crc32(&data[pos], length - sizeof(crc)) != crc) {
+         fprintf(stderr, "replay: skipping recording at offset %zu with bad crc\n", pos);
+         continue;
+      }
+
+      entries.resize(header.entries);
+      memcpy(entries.data(), &data[pos + sizeof(header)], header.entries * sizeof(RecordEntry));
+      return true;
+   }
+   return false;
+}
+
+/// Table as text ("%f, " separated, as printed by 'lookup') or as binary floats
+static bool load_table(const char* name, std::vector<float>& table)
+{
+   std::vector<uint8_t> data;
+   if(!read_file(name, data)) return false;
+
+   if(data.size() == cpr * sizeof(float)) {
+      table.resize(cpr);
+      memcpy(table.data(), data.data(), data.size());
+      return true;
+   }
+
+   data.push_back(0);
+   const char* p = (const char*)data.data();
+   table.clear();
+   while(*p && table.size() < (size_t)cpr) {
+      char* end;
+      const float v = strtof(p, &end);
+      if(end == p) {
+         ++p;
+         continue;
+      }
+      table.push_back(v);
+      p = end;
+   }
+   return table.size() == (size_t)cpr;
+}
+
+struct Summary {
+   double e2;
+   double u2;
+   float e_max;
+   unsigned saturated;
+};
+
+static void print_summary(const char* name, const Summary& s, const size_t& n)
+{
+   fprintf(stderr, "replay: %-9s rms e=%f max |e|=%f rms u=%f saturated=%u of %zu ticks\n",
+           name, sqrt(s.e2 / n), s.e_max, sqrt(s.u2 / n), s.saturated, n);
+}
+
+int main(int argc, char** argv)
+{
+   const char* table_name = NULL;
+   const char* output = NULL;
+   const char* input = NULL;
+   std::vector<std::string> overrides;
+
+   for(int i = 1; i < argc; ++i) {
+      if(strcmp(argv[i], "-t") == 0 && i + 1 < argc) table_name = argv[++i];
+      else if(strcmp(argv[i], "-o") == 0 && i + 1 < argc) output = argv[++i];
+      else if(strchr(argv[i], '=')) overrides.push_back(argv[i]);
+      else if(!input) input = argv[i];
+      else input = NULL, i = argc;
+   }
+   if(!input) {
+      fprintf(stderr, "usage: %s [-t table] [-o out.csv] [name=value ...] record.bin\n", argv[0]);
+      return 2;
+   }
+
+   std::vector<uint8_t> data;
+   if(!read_file(input, data)) {
+      fprintf(stderr, "replay: cannot read %s\n", input);
+      return 2;
+   }
+
+   RecordHeader header;
+   std::vector<RecordEntry> entries;
+   if(!parse_record(data, header, entries) || entries.empty()) {
+      fprintf(stderr, "replay: no valid recording in %s\n", input);
+      return 2;
+   }
+
+   std::vector<float> table(builtin_table, builtin_table + cpr);
+   if(table_name && !load_table(table_name, table)) {
+      fprintf(stderr, "replay: cannot read a %i entry table from %s\n", cpr, table_name);
+      return 2;
+   }
+   if(crc32(table.data(), cpr * sizeof(float)) != header.lookup_crc)
+      fprintf(stderr, "replay: warning, the device used another lookup table (-t)\n");
+   if(header.flags & record_params_changed)
+      fprintf(stderr, "replay: warning, parameters were changed during the recording, replaying with the first ones\n");
+
+   const RecordKeyframe& k = header.keyframe;
+   ServoLoop recorded;
+   recorded.state = k.state;
+   recorded.gains = k.gains;
+
+   ServoLoop loop = recorded;
+   int uMax = k.uMax;
+   for(const std::string& o : overrides) {
+      const std::string name = o.substr(0, o.find('='));
+      const float value = atof(o.substr(o.find('=') + 1).c_str());
+      ServoLoop::Gains& g = loop.gains;
+      if(name == "pKp") g.pKp = value;
+      else if(name == "pKi") g.pKi = value;
+      else if(name == "pKd") g.pKd = value;
+      else if(name == "pLPF") loop.configure(k.Fs, g.pKp, g.pKi, g.pKd, value);
+      else if(name == "iMax") uMax = (int)((255.0/3.3)*(value*10.0*0.150));   // as Motor::setCurrentLimit()
+      else {
+         fprintf(stderr, "replay: cannot override %s\n", name.c_str());
+         return 2;
+      }
+   }
+
+   FILE* out = stdout;
+   if(output && !(out = fopen(output, "w"))) {
+      fprintf(stderr, "replay: cannot write %s\n", output);
+      return 2;
+   }
+
+   fprintf(stderr, "replay: %zu ticks at %.0f Hz, pKp=%f pKi=%f pKd=%f pLPFa=%f uMax=%i\n", entries.size(), k.Fs,
+           loop.gains.pKp, loop.gains.pKi, loop.gains.pKd, loop.gains.pLPFa, uMax);
+
+   fprintf(out, "tick,time,dt,count,rejected,setpoint,feedforward,uMax,y,yw,e,ITerm,DTerm,u,effort,angle\n");
+   Summary base = { }, replayed = { };
+   uint32_t time = header.start;
+   bool changed = false;
+   for(size_t i = 0; i < entries.size(); ++i) {
+      const RecordEntry& x = entries[i];
+      if(i > 0) time += x.dt;
+      const int16_t count = x.count & 0x3fff;
+      if((x.count & record_loop_changed) && !changed) {
+         fprintf(stderr, "replay: warning, homing changed the loop state at tick %zu, the replay is not exact from there on\n", i);
+         changed = true;
+      }
+      const int limit = uMax == k.uMax ? x.uMax : (int)((float)x.uMax * uMax / k.uMax);   // homing lowers it from the motor's
+
+      loop.prepare();
+      const ServoLoop::Terms& t = loop.update(x.setpoint, table[count], limit, x.feedforward);
+      recorded.prepare();
+      const ServoLoop::Terms& b = recorded.update(x.setpoint, table[count], x.uMax, x.feedforward);
+
+      fprintf(out, "%zu,%lu,%u,%i,%i,%f,%f,%i,%f,%f,%f,%f,%f,%f,%i,%f\n", i, (unsigned long)time, x.dt, count,
+              (x.count & record_rejected) ? 1 : 0, x.setpoint, x.feedforward, x.uMax, t.y, t.yw, t.e, t.ITerm, t.DTerm, t.u, t.effort, t.angle);
+
+      for(Summary* s : { &base, &replayed }) {
+         const ServoLoop::Terms& u = s == &base ? b : t;
+         s->e2 += u.e * u.e;
+         s->u2 += u.u * u.u;
+         if(fabs(u.e) > s->e_max) s->e_max = fabs(u.e);
+         if(fabs(u.u) >= (s == &base ? x.uMax : limit)) ++s->saturated;
+      }
+   }
+   if(out != stdout) fclose(out);
+
+   print_summary("recorded", base, entries.size());
+   if(!overrides.empty()) print_summary("replayed", replayed, entries.size());
+   return 0;
+}
@@ -0,0 +1,203 @@
+/*
+ * Copyright (C) 2019 Florian Seybold
+ *
+ * This file is subject to the terms and conditions of the GNU Lesser
+ * General Public License v2.1. See the file LICENSE in the top level
+ * directory for more details.
+ */
+
+/**
+ * @ingroup     mechaduino_firmware
+ *
+ * @{
+ * @file
+ * @brief       Clock sync master and coordinated move for several axes
+ *
+ * Talks the binary protocol to each device (after 'protocol start'),
+ * measures round trips against CLOCK_MONOTONIC and hands the midpoints to
+ * the devices as sync samples. Every round prints each device's clock
+ * error against the master, bounded by half its round trip. Optionally
+ * sends one timed move to all devices afterwards.
+ *
+ *    sync_master [-r rounds] [-i interval_ms] [-m target -d delay_ms] device...
+ *
+ * Devices are serial ports, or the ptys of native instances started with
+ * their protocol UART mapped, e.g. '-c /dev/null -c /dev/pts/N'.
+ *
+ * @author      Florian Seybold <florian@seybold.space>
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "Cobs.hpp"
+#include "ProtocolFormat.hpp"
+
+struct Device {
+   const char* name;
+   int fd;
+   uint16_t seq;
+   bool pending;          // sync sample from the last exchange, sent with the next
+   uint32_t device_time;
+   uint64_t master_time;
+   uint64_t min_rtt;
+};
+
+static uint64_t master_now()
+{
+   timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int open_device(const char* name)
+{
+   const int fd = open(name, O_RDWR | O_NOCTTY);
+   if(fd < 0) return -1;
+
+   termios tio;
+   if(tcgetattr(fd, &tio) == 0) {     // ptys of native instances are fine without
+      cfmakeraw(&tio);
+      cfsetispeed(&tio, B115200);
+      cfsetospeed(&tio, B115200);
+      tcsetattr(fd, TCSANOW, &tio);
+   }
+   tcflush(fd, TCIOFLUSH);
+   return fd;
+}
+
+/// Sends a request and waits for its ack, returns false on timeout
+static bool exchange(Device& d, ProtocolRequest& req, ProtocolAck& ack, uint64_t& t1, uint64_t& t4)
+{
+   const size_t len = req.finish();
+   uint8_t out[cobs_max_size(protocol_max_request) + 1];
+   size_t n = cobs_encode(req.buf, len, out);
+   out[n++] = 0;
+
+   t1 = master_now();
+   if(write(d.fd, out, n) != (ssize_t)n) return false;
+
+   std::vector<uint8_t> frame;
+   const uint64_t deadline = t1 + 200000;
+   while(master_now() < deadline) {
+      pollfd p = { d.fd, POLLIN, 0 };
+      if(poll(&p, 1, 10) <= 0) continue;
+
+      uint8_t buf[64];
+      const ssize_t r = read(d.fd, buf, sizeof(buf));
+      for(ssize_t i = 0; i < r; ++i) {
+         if(buf[i] != 0) {
+            frame.push_back(buf[i]);
+            continue;
+         }
+         uint8_t packet[256];
+         const int plen = frame.size() < sizeof(packet) ? cobs_decode(frame.data(), frame.size(), packet) : -1;
+         frame.clear();
+         if(plen > 0 && protocol_unpack_ack(packet, plen, ack) && ack.seq == d.seq) {
+            t4 = master_now();
+            return true;
+         }
+      }
+   }
+   return false;
+}
+
+int main(int argc, char** argv)
+{
+   int rounds = 10;
+   int interval = 1000;
+   bool move = false;
+   float target = 0.0;
+   int delay = 500;
+
+   int opt;
+   while((opt = getopt(argc, argv, "r:i:m:d:")) != -1) {
+      switch(opt) {
+         case 'r': rounds = atoi(optarg); break;
+         case 'i': interval = atoi(optarg); break;
+         case 'm': move = true; target = atof(optarg); break;
+         case 'd': delay = atoi(optarg); break;
+         default: optind = argc + 1;
+      }
+   }
+   if(optind >= argc) {
+      fprintf(stderr, "usage: sync_master [-r rounds] [-i interval_ms] [-m target -d delay_ms] device...\n");
+      return 2;
+   }
+
+   std::vector<Device> devices;
+   for(int i = optind; i < argc; ++i) {
+      Device d = { argv[i], open_device(argv[i]), 0, false, 0, 0, UINT64_MAX };
+      if(d.fd < 0) {
+         perror(argv[i]);
+         return 1;
+      }
+      devices.push_back(d);
+   }
+
+   for(int round = 0; round < rounds; ++round) {
+      int64_t worst = 0;
+      bool all_synced = true;
+
+      for(Device& d : devices) {
+         ProtocolRequest req(++d.seq);
+         if(d.pending) req.sync(d.device_time, d.master_time);
+         req.clock();
+
+         ProtocolAck ack;
+         uint64_t t1, t4;
+         if(!exchange(d, req, ack, t1, t4)) {
+            printf("%s: no ack\n", d.name);
+            d.pending = false;
+            all_synced = false;
+            continue;
+         }
+
+         const uint64_t rtt = t4 - t1;
+         const uint64_t mid = t1 + rtt / 2;
+         if(rtt < d.min_rtt) d.min_rtt = rtt;
+
+         // Only round trips close to the best seen make good samples
+         d.pending = rtt <= 2 * d.min_rtt + 200;
+         d.device_time = ack.timestamp;
+         d.master_time = mid;
+
+         if(ack.master_time == 0) {
+            printf("%s: rtt=%llu us, not synced\n", d.name, (unsigned long long)rtt);
+            all_synced = false;
+            continue;
+         }
+         const int64_t error = (int64_t)(ack.master_time - mid);
+         printf("%s: rtt=%llu us, clock error=%lld us (+-%llu)\n", d.name,
+            (unsigned long long)rtt, (long long)error, (unsigned long long)rtt / 2);
+         if(llabs(error) > llabs(worst)) worst = error;
+      }
+
+      if(all_synced) printf("round %i: worst clock error %lld us\n", round, (long long)worst);
+      usleep(interval * 1000);
+   }
+
+   if(move) {
+      const uint64_t at = master_now() + (uint64_t)delay * 1000;
+      for(Device& d : devices) {
+         ProtocolRequest req(++d.seq);
+         req.move_at(at, target).status();
+         ProtocolAck ack;
+         uint64_t t1, t4;
+         if(!exchange(d, req, ack, t1, t4)) printf("%s: no ack\n", d.name);
+         else printf("%s: move to %f at %llu: %s\n", d.name, target, (unsigned long long)at,
+                     ack.result == result_ok ? "queued" : "rejected");
+      }
+   }
+
+   for(Device& d : devices) close(d.fd);
+   return 0;
+}
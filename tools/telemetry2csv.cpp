@@ -0,0 +1,95 @@
+/*
+ * Copyright (C) 2019 Florian Seybold
+ *
+ * This file is subject to the terms and conditions of the GNU Lesser
+ * General Public License v2.1. See the file LICENSE in the top level
+ * directory for more details.
+ */
+
+/**
+ * @ingroup     mechaduino_firmware
+ *
+ * @{
+ * @file
+ * @brief       Host side telemetry decoder
+ *
+ * Turns the stream written by 'telemetry start' into CSV, one line per
+ * sample. Reads the given file or stdin, e.g. straight from the tty:
+ *
+ *    telemetry2csv /dev/ttyACM0 > run.csv
+ *
+ * Frames that fail COBS decoding or their crc (shell output mixed into the
+ * stream) are skipped and counted on stderr. A new header line is written
+ * whenever the channel selection changes.
+ *
+ * @author      Florian Seybold <florian@seybold.space>
+ */
+
+#include <cstdio>
+#include <vector>
+
+#include "Cobs.hpp"
+#include "TelemetryFormat.hpp"
+
+int main(int argc, char** argv)
+{
+   FILE* in = stdin;
+   if(argc == 2) {
+      in = fopen(argv[1], "rb");
+      if(!in) {
+         perror(argv[1]);
+         return 2;
+      }
+   }
+   else if(argc > 2) {
+      fprintf(stderr, "usage: telemetry2csv [stream]\n");
+      return 2;
+   }
+
+   std::vector<uint8_t> frame;
+   uint8_t packet[telemetry_max_packet];
+   unsigned long good = 0, bad = 0, lost = 0;
+   int last_mask = -1;
+   uint32_t last_tick = 0;
+   TelemetrySample s = { };
+
+   int c;
+   while((c = fgetc(in)) != EOF) {
+      if(c != 0) {
+         if(frame.size() < cobs_max_size(telemetry_max_packet)) frame.push_back(c);
+         else frame.clear(), ++bad;    // not a telemetry frame, wait for the next delimiter
+         continue;
+      }
+      if(frame.empty()) continue;
+
+      uint8_t mask;
+      const int len = cobs_decode(&frame[0], frame.size(), packet);
+      frame.clear();
+      if(len < 0 || !telemetry_unpack(packet, len, s, mask)) {
+         ++bad;
+         continue;
+      }
+
+      if(mask != last_mask) {
+         printf("tick");
+         for(int ch = 0; ch < telemetry_channels; ++ch)
+            if(mask & (1 << ch)) printf(",%s", telemetry_channel_names[ch]);
+         printf("\n");
+      }
+      else if(s.tick - last_tick > 1) {
+         ++lost;     // gaps also show decimation, counted for the summary only
+      }
+      last_mask = mask;
+      last_tick = s.tick;
+
+      printf("%lu", (unsigned long)s.tick);
+      for(int ch = 0; ch < telemetry_channels; ++ch)
+         if(mask & (1 << ch)) printf(",%.6g", s.channel[ch]);
+      printf("\n");
+      ++good;
+   }
+
+   fprintf(stderr, "telemetry2csv: %lu samples, %lu bad frames, %lu gaps\n", good, bad, lost);
+   if(in != stdin) fclose(in);
+   return 0;
+}